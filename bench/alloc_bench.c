@@ -0,0 +1,90 @@
+#include "disk_driver.h"
+#include "util.h"
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Block allocation with the first-fit search from block 0 used before, and
+// with the next-fit cursor and locality hints.
+// Many small files are created and half of them removed, then a few large
+// files grow a few blocks at a time, interleaved with new small files
+
+#define NUM_BLOCKS (64 * 1024)
+#define NUM_SMALL 20000
+#define NUM_LARGE 4
+#define LARGE_BLOCKS 4000
+#define CHUNK_BLOCKS 8
+
+typedef struct {
+  const char *name;
+  int hinted;         // use the cursor and the hints
+  long scanned;       // total distance between the search start and the found block
+  long allocations;
+  int last[NUM_LARGE];      // last block of each large file
+  long adjacent, pairs;     // consecutive blocks of the large files that are also adjacent on disk
+} Policy;
+
+static int alloc(DiskDriver *disk, Policy *p, int hint) {
+    int start = p->hinted ? (hint == DISK_NO_HINT ? disk->cursors[0] : hint % NUM_BLOCKS) : 0;
+    int pos = p->hinted ? DiskDriver_getFreeBlockNear(disk, hint) : DiskDriver_getFreeBlock(disk, 0);
+    ONERROR(pos == -1 || DiskDriver_allocBlock(disk, pos) == -1, "disk full");
+
+    // Bits between the start of the search and the block found, wrapping around
+    p->scanned += (pos - start + NUM_BLOCKS) % NUM_BLOCKS;
+    p->allocations++;
+    return pos;
+}
+
+static void bench(Policy *p) {
+    DiskDriver disk;
+    unlink("bench.fs");
+    DiskDriver_init(&disk, "bench.fs", NUM_BLOCKS);
+    srand(42);
+
+    double start = now();
+    int *small = (int *) malloc(NUM_SMALL * sizeof(int));
+    for(int i = 0; i < NUM_SMALL; i++) {
+        small[i] = alloc(&disk, p, DISK_NO_HINT);
+    }
+    for(int i = 0; i < NUM_SMALL; i += 2) {
+        DiskDriver_freeBlock(&disk, small[i]);
+    }
+
+    for(int i = 0; i < NUM_LARGE; i++) p->last[i] = -1;
+    for(int round = 0; round < LARGE_BLOCKS / CHUNK_BLOCKS; round++) {
+        for(int f = 0; f < NUM_LARGE; f++) {
+            for(int b = 0; b < CHUNK_BLOCKS; b++) {
+                int hint = p->last[f] == -1 ? DISK_NO_HINT : p->last[f] + 1;
+                int pos = alloc(&disk, p, hint);
+                if(p->last[f] != -1) {
+                    p->pairs++;
+                    if(pos == p->last[f] + 1) p->adjacent++;
+                }
+                p->last[f] = pos;
+            }
+            if(rand() % 4 == 0) alloc(&disk, p, DISK_NO_HINT);
+        }
+    }
+    double elapsed = now() - start;
+
+    printf("%-28s %14.1f %15.1f%% %10.1f\n", p->name, (double) p->scanned / p->allocations,
+        100.0 * p->adjacent / p->pairs, elapsed * 1e3);
+
+    free(small);
+    DiskDriver_close(&disk);
+    unlink("bench.fs");
+}
+
+int main(int argc, char **argv) {
+    Policy first_fit = { "first fit from block 0", 0 };
+    Policy next_fit = { "next fit + locality hints", 1 };
+
+    printf("%d blocks, %d small files (half removed), %d large files of %d blocks\n",
+        NUM_BLOCKS, NUM_SMALL, NUM_LARGE, LARGE_BLOCKS);
+    printf("%-28s %14s %16s %10s\n", "policy", "avg scan len", "contiguous", "time (ms)");
+    bench(&first_fit);
+    bench(&next_fit);
+    return 0;
+}
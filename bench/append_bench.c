@@ -0,0 +1,60 @@
+#include "simplefs.h"
+#include "util.h"
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Builds a file out of many small appends, keeping the handle open (like a
+// log) and opening and closing the file around every append (like the
+// shell's write command), and counts the blocks written for each KiB
+
+#define NUM_BLOCKS 4096
+#define FILE_SIZE (256 * 1024)
+
+static void bench(int append_size, int reopen) {
+    DiskDriver disk;
+    SimpleFS fs;
+    char data[1024];
+    memset(data, 'x', sizeof(data));
+    unlink("bench.fs");
+    DiskDriver_init(&disk, "bench.fs", NUM_BLOCKS);
+    DirectoryHandle *dir = SimpleFS_init(&fs, &disk);
+    FileHandle *fh = SimpleFS_createFile(dir, "log");
+    ONERROR(fh == NULL, "can't create log");
+    int num_appends = FILE_SIZE / append_size;
+
+    long blocks_written = disk.blocks_written;
+    double start = now();
+    for(int i = 0; i < num_appends; i++) {
+        if(reopen) {
+            fh = SimpleFS_openFile(dir, "log");
+            ONERROR(fh == NULL, "can't open log");
+            SimpleFS_seek(fh, i * append_size);
+        }
+        ONERROR(SimpleFS_write(fh, data, append_size) != append_size, "write failed");
+        if(reopen) SimpleFS_close(fh);
+    }
+    if(!reopen) SimpleFS_close(fh);
+    double elapsed = now() - start;
+    blocks_written = disk.blocks_written - blocks_written;
+
+    printf("%12d %-10s %10ld %16.2f %14.3f\n", append_size, reopen ? "reopen" : "open", blocks_written,
+        (double) blocks_written * 1024 / FILE_SIZE, elapsed * 1e6 / num_appends);
+
+    SimpleFS_destroy(&fs);
+    DiskDriver_close(&disk);
+    unlink("bench.fs");
+}
+
+int main(int argc, char **argv) {
+    printf("%d KiB file built with appends, %d bytes blocks\n", FILE_SIZE / 1024, BLOCK_SIZE);
+    printf("%12s %-10s %10s %16s %14s\n", "append size", "handle", "blocks", "blocks per KiB", "us per append");
+    int sizes[] = { 1, 16, 100, 1024 };
+    for(int i = 0; i < (int) (sizeof(sizes) / sizeof(sizes[0])); i++) {
+        bench(sizes[i], 0);
+        bench(sizes[i], 1);
+    }
+    return 0;
+}
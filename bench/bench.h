@@ -0,0 +1,11 @@
+#pragma once
+#include <time.h>
+
+// Helpers shared by the benchmarks
+
+// seconds elapsed since an arbitrary point, for timing
+static inline double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,79 @@
+#include "bitmap.h"
+#include "util.h"
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// BitMap_find against the bit by bit search it replaced, on a nearly full
+// bitmap of a multi-million blocks disk
+
+#define NUM_BITS (4 * 1024 * 1024)
+#define NUM_FREE 64
+
+// The previous implementation of BitMap_find
+static int BitMap_findBitByBit(BitMap* bmap, int start, int status) {
+    if(start < 0 || start >= bmap->num_bits) return -1;
+
+    int pos = start;
+    while(pos < bmap->num_bits) {
+        BitMapEntryKey key = BitMap_blockToIndex(pos);
+        if(((bmap->entries[key.entry_num] >> key.bit_num) & 1) == status) {
+            return pos;
+        }
+        pos++;
+    }
+    return -1;
+}
+
+// Finds all the free bits, starting each search from the beginning like DiskDriver_getFreeBlock
+static double bench(BitMap *bmap, int (*find)(BitMap *, int, int), long *checksum) {
+    double start = now();
+    for(int i = 0; i < NUM_FREE; i++) {
+        int pos = find(bmap, 0, 0);
+        *checksum += pos;
+        BitMap_set(bmap, pos, 1);
+    }
+    double elapsed = now() - start;
+
+    // Free them again for the next run
+    for(int i = 0; i < NUM_FREE; i++) {
+        BitMap_set(bmap, NUM_BITS - 1 - i * 997, 0);
+    }
+    return elapsed;
+}
+
+int main(int argc, char **argv) {
+    BitMap bmap;
+    bmap.num_bits = NUM_BITS;
+    bmap.entries = (char *) calloc(NUM_BITS / 8, 1);
+    ONERROR(bmap.entries == NULL, "calloc failed");
+
+    // Only a few free blocks, all of them near the end of the disk
+    BitMap_setRange(&bmap, 0, NUM_BITS, 1);
+    for(int i = 0; i < NUM_FREE; i++) {
+        BitMap_set(&bmap, NUM_BITS - 1 - i * 997, 0);
+    }
+
+    long checksum_old = 0, checksum_new = 0;
+    double old_time = bench(&bmap, BitMap_findBitByBit, &checksum_old);
+    double new_time = bench(&bmap, BitMap_find, &checksum_new);
+    ONERROR(checksum_old != checksum_new, "the searches found different bits");
+
+    printf("%d searches for a free bit in a %d bits bitmap\n", NUM_FREE, NUM_BITS);
+#if defined(__x86_64__) || defined(__i386__)
+    printf("AVX2: %s\n", __builtin_cpu_supports("avx2") ? "yes" : "no");
+#endif
+    printf("  bit by bit: %10.3f ms\n", old_time * 1e3);
+    printf("  BitMap_find: %9.3f ms (%.0fx)\n", new_time * 1e3, old_time / new_time);
+
+    double start = now();
+    long free_bits = 0;
+    for(int i = 0; i < 100; i++) free_bits += BitMap_countRange(&bmap, 0, NUM_BITS, 0);
+    double count_time = (now() - start) / 100;
+    ONERROR(free_bits != 100 * NUM_FREE, "wrong count");
+    printf("  BitMap_countRange of the whole bitmap: %.3f ms\n", count_time * 1e3);
+
+    free(bmap.entries);
+    return 0;
+}
@@ -0,0 +1,66 @@
+#include "simplefs.h"
+#include "util.h"
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Sequential write and read of a large file with different block sizes
+
+#define FILE_SIZE (8 * 1024 * 1024)
+#define CHUNK_SIZE (64 * 1024)
+
+static void bench(int block_size, char *data, char *data2) {
+    DiskDriver disk;
+    SimpleFS fs;
+    // Enough blocks for the file, the headers of its blocks and the root directory
+    int num_blocks = FILE_SIZE / (block_size - 64) + 16;
+
+    unlink("bench.fs");
+    DiskDriver_initWithBlockSize(&disk, "bench.fs", num_blocks, block_size);
+    DirectoryHandle *dir = SimpleFS_init(&fs, &disk);
+
+    FileHandle *fh = SimpleFS_createFile(dir, "big.bin");
+    ONERROR(fh == NULL, "can't create file");
+
+    double start = now();
+    for(int i = 0; i < FILE_SIZE; i += CHUNK_SIZE) {
+        ONERROR(SimpleFS_write(fh, data + i, CHUNK_SIZE) != CHUNK_SIZE, "write failed");
+    }
+    ONERROR(DiskDriver_flush(&disk) == -1, "flush failed");
+    double write_time = now() - start;
+
+    SimpleFS_seek(fh, 0);
+    start = now();
+    for(int i = 0; i < FILE_SIZE; i += CHUNK_SIZE) {
+        ONERROR(SimpleFS_read(fh, data2 + i, CHUNK_SIZE) != CHUNK_SIZE, "read failed");
+    }
+    double read_time = now() - start;
+    ONERROR(memcmp(data, data2, FILE_SIZE) != 0, "read back different data");
+
+    printf("%10d %10d %12.1f %12.1f\n", block_size, fh->fcb->fcb.size_in_blocks,
+        FILE_SIZE / write_time / (1 << 20), FILE_SIZE / read_time / (1 << 20));
+
+    SimpleFS_close(fh);
+    SimpleFS_destroy(&fs);
+    DiskDriver_close(&disk);
+    unlink("bench.fs");
+}
+
+int main(int argc, char **argv) {
+    char *data = (char *) malloc(FILE_SIZE), *data2 = (char *) malloc(FILE_SIZE);
+    ONERROR(!data || !data2, "malloc failed");
+    for(int i = 0; i < FILE_SIZE; i++) data[i] = rand() % 256;
+
+    printf("Sequential write and read of %d MiB in %d KiB chunks\n", FILE_SIZE >> 20, CHUNK_SIZE >> 10);
+    printf("%10s %10s %12s %12s\n", "block size", "blocks", "write MiB/s", "read MiB/s");
+    int block_sizes[] = {512, 4096, 65536};
+    for(int i = 0; i < sizeof(block_sizes) / sizeof(int); i++) {
+        bench(block_sizes[i], data, data2);
+    }
+
+    free(data);
+    free(data2);
+    return 0;
+}
@@ -0,0 +1,60 @@
+#include "simplefs.h"
+#include "util.h"
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Writes new files of 1 MiB to 1 GiB (or the size in MiB given as the first
+// argument) with a single SimpleFS_write, which reserves and writes all the
+// blocks at once, and with 4 KiB writes, which add one or two blocks at a time
+
+#define DISK_BLOCK_SIZE 4096
+#define SMALL_WRITE 4096
+#define MAX_SIZE (1024 * 1024 * 1024)
+
+// Returns the throughput in MiB/s, flush included
+static double bench(char *data, int size, int chunk) {
+    DiskDriver disk;
+    SimpleFS fs;
+    unlink("bench.fs");
+    // Room for the data, the index and the directory
+    DiskDriver_initWithBlockSize(&disk, "bench.fs", size / (DISK_BLOCK_SIZE - 16) + 1024, DISK_BLOCK_SIZE);
+    DirectoryHandle *dir = SimpleFS_init(&fs, &disk);
+
+    double start = now();
+    FileHandle *fh = SimpleFS_createFile(dir, "file");
+    ONERROR(fh == NULL, "can't create file");
+    for(int pos = 0; pos < size; pos += chunk) {
+        int len = min(chunk, size - pos);
+        ONERROR(SimpleFS_write(fh, data + pos, len) != len, "write failed");
+    }
+    ONERROR(SimpleFS_fsync(fh) == -1, "fsync failed");
+    double elapsed = now() - start;
+    SimpleFS_close(fh);
+
+    SimpleFS_destroy(&fs);
+    DiskDriver_close(&disk);
+    unlink("bench.fs");
+    return size / (1024.0 * 1024) / elapsed;
+}
+
+int main(int argc, char **argv) {
+    long max_size = argc > 1 ? atol(argv[1]) * 1024 * 1024 : MAX_SIZE;
+    max_size = min(max_size, MAX_SIZE);
+    char *data = (char *) malloc(max_size);
+    ONERROR(!data, "malloc failed");
+    for(long i = 0; i < max_size; i++) data[i] = i * 7;
+
+    printf("%d bytes blocks, throughput including the final flush\n", DISK_BLOCK_SIZE);
+    printf("%10s %22s %22s\n", "size (MiB)", "single write (MiB/s)", "4 KiB writes (MiB/s)");
+    for(long size = 1024 * 1024; size <= max_size; size *= 4) {
+        double bulk = bench(data, size, size);
+        double small = bench(data, size, SMALL_WRITE);
+        printf("%10ld %22.1f %22.1f\n", size / (1024 * 1024), bulk, small);
+    }
+
+    free(data);
+    return 0;
+}
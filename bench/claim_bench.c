@@ -0,0 +1,79 @@
+#include "disk_driver.h"
+#include "util.h"
+#include "bench.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Allocation throughput with 1 to N threads (N is the number of cores, or
+// the first argument) taking single blocks from the same disk, through the
+// compare-and-swap on the bitmap of DiskDriver_allocBlockNear, and by looking
+// for a free block and then allocating it, each step taking the lock of the
+// driver (and starting again when another thread got the block first)
+
+#define MAX_THREADS 16
+#define NUM_BLOCKS (256 * 1024)
+#define NUM_ALLOCS (240 * 1024)
+
+typedef struct {
+    DiskDriver *disk;
+    int lock_free;
+    int count;
+} Worker;
+
+static void *worker(void *arg) {
+    Worker *w = (Worker *) arg;
+    for(int i = 0; i < w->count; i++) {
+        int pos;
+        if(w->lock_free) {
+            pos = DiskDriver_allocBlockNear(w->disk, DISK_NO_HINT);
+        } else {
+            do {
+                pos = DiskDriver_getFreeBlockNear(w->disk, DISK_NO_HINT);
+            } while(pos != -1 && DiskDriver_allocBlock(w->disk, pos) == -1);
+        }
+        ONERROR(pos == -1, "disk full");
+    }
+    return NULL;
+}
+
+// Returns the millions of blocks allocated per second by all the threads together
+static double bench(int lock_free, int num_threads) {
+    DiskDriver disk;
+    pthread_t threads[MAX_THREADS];
+    Worker workers[MAX_THREADS];
+    unlink("bench.fs");
+    DiskDriver_init(&disk, "bench.fs", NUM_BLOCKS);
+
+    double start = now();
+    for(int i = 0; i < num_threads; i++) {
+        workers[i] = (Worker) { &disk, lock_free, NUM_ALLOCS / num_threads };
+        ONERROR(pthread_create(&threads[i], NULL, worker, &workers[i]) != 0, "can't start thread %d", i);
+    }
+    for(int i = 0; i < num_threads; i++) pthread_join(threads[i], NULL);
+    double elapsed = now() - start;
+
+    int allocated = NUM_BLOCKS - disk.header->free_blocks;
+    ONERROR(allocated != num_threads * (NUM_ALLOCS / num_threads), "%d blocks allocated", allocated);
+    DiskDriver_close(&disk);
+    unlink("bench.fs");
+    return allocated / elapsed / 1e6;
+}
+
+int main(int argc, char **argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    max_threads = max(1, min(max_threads, MAX_THREADS));
+
+    printf("%d single block allocations on a disk of %d blocks, %ld cores\n", NUM_ALLOCS, NUM_BLOCKS,
+        sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%8s %18s %18s\n", "threads", "CAS (M/s)", "locked (M/s)");
+    for(int num_threads = 1; num_threads <= max_threads; num_threads++) {
+        // Powers of 2, and the maximum
+        if((num_threads & (num_threads - 1)) != 0 && num_threads != max_threads) continue;
+        double cas = bench(1, num_threads);
+        double locked = bench(0, num_threads);
+        printf("%8d %18.2f %18.2f\n", num_threads, cas, locked);
+    }
+    return 0;
+}
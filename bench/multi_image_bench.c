@@ -0,0 +1,82 @@
+#include "simplefs.h"
+#include "util.h"
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Serves several disk images from the same process: the files are created
+// and then looked up by path on all the images in turn, each image with its
+// own SimpleFS instance and a directory handle for each of its directories
+
+#define MAX_IMAGES 8
+#define NUM_BLOCKS 4096
+#define NUM_DIRS 16
+#define FILES_PER_DIR 64
+#define NUM_LOOKUPS 200000
+#define FILE_SIZE 1000
+
+static void bench(int num_images) {
+    DiskDriver disks[MAX_IMAGES];
+    SimpleFS fs[MAX_IMAGES];
+    DirectoryHandle *roots[MAX_IMAGES];
+    DirectoryHandle *dirs[MAX_IMAGES][NUM_DIRS];
+    char name[64], data[FILE_SIZE];
+    memset(data, 'x', sizeof(data));
+
+    for(int i = 0; i < num_images; i++) {
+        sprintf(name, "bench%d.fs", i);
+        unlink(name);
+        DiskDriver_init(&disks[i], name, NUM_BLOCKS);
+        roots[i] = SimpleFS_init(&fs[i], &disks[i]);
+        for(int j = 0; j < NUM_DIRS; j++) {
+            sprintf(name, "dir%d", j);
+            ONERROR(SimpleFS_mkDir(roots[i], name) == -1, "can't create %s", name);
+            dirs[i][j] = SimpleFS_openDirectory(roots[i], name);
+            ONERROR(dirs[i][j] == NULL, "can't open %s", name);
+        }
+    }
+
+    // Interleave the images, one file at a time
+    double start = now();
+    for(int k = 0; k < NUM_DIRS * FILES_PER_DIR; k++) {
+        for(int i = 0; i < num_images; i++) {
+            sprintf(name, "file%d", k / NUM_DIRS);
+            FileHandle *fh = SimpleFS_createFile(dirs[i][k % NUM_DIRS], name);
+            ONERROR(fh == NULL, "can't create %s", name);
+            ONERROR(SimpleFS_write(fh, data, FILE_SIZE) != FILE_SIZE, "write failed");
+            SimpleFS_close(fh);
+        }
+    }
+    double created = now();
+
+    FileInfo info;
+    for(int k = 0; k < NUM_LOOKUPS; k++) {
+        int i = k % num_images;
+        sprintf(name, "/dir%d/file%d", rand() % NUM_DIRS, rand() % FILES_PER_DIR);
+        ONERROR(SimpleFS_statPath(roots[i], name, &info) == -1, "can't find %s", name);
+        ONERROR(info.size_in_bytes != FILE_SIZE, "wrong size for %s", name);
+    }
+    double looked_up = now();
+
+    int num_files = num_images * NUM_DIRS * FILES_PER_DIR;
+    printf("%8d %12d %14.2f %14.3f\n", num_images, num_files,
+        (created - start) * 1e6 / num_files, (looked_up - created) * 1e6 / NUM_LOOKUPS);
+
+    for(int i = 0; i < num_images; i++) {
+        SimpleFS_destroy(&fs[i]);
+        DiskDriver_close(&disks[i]);
+        sprintf(name, "bench%d.fs", i);
+        unlink(name);
+    }
+}
+
+int main(int argc, char **argv) {
+    printf("%d directories of %d files on each image, %d lookups by path\n", NUM_DIRS, FILES_PER_DIR, NUM_LOOKUPS);
+    printf("%8s %12s %14s %14s\n", "images", "files", "us per create", "us per lookup");
+    for(int num_images = 1; num_images <= MAX_IMAGES; num_images *= 2) {
+        bench(num_images);
+    }
+    return 0;
+}
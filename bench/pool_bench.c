@@ -0,0 +1,79 @@
+#include "simplefs.h"
+#include "util.h"
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Opens, reads and closes files and directories over and over, with the
+// pools of the file system keeping the released objects and with the pools
+// disabled (every object comes from malloc), and counts the mallocs per cycle
+
+#define NUM_BLOCKS 4096
+#define NUM_FILES 64
+#define NUM_CYCLES 200000
+
+static long pool_mallocs(SimpleFS *fs) {
+    return fs->block_pool.mallocs + fs->file_handle_pool.mallocs + fs->open_file_pool.mallocs +
+        fs->dir_handle_pool.mallocs + fs->iterator_pool.mallocs;
+}
+
+static long pool_allocs(SimpleFS *fs) {
+    return fs->block_pool.allocs + fs->file_handle_pool.allocs + fs->open_file_pool.allocs +
+        fs->dir_handle_pool.allocs + fs->iterator_pool.allocs;
+}
+
+static void bench(int max_free) {
+    DiskDriver disk;
+    SimpleFS fs;
+    char name[32], buf[64];
+    unlink("bench.fs");
+    DiskDriver_init(&disk, "bench.fs", NUM_BLOCKS);
+    DirectoryHandle *dir = SimpleFS_init(&fs, &disk);
+    fs.block_pool.max_free = fs.file_handle_pool.max_free = fs.open_file_pool.max_free = max_free;
+    fs.dir_handle_pool.max_free = fs.iterator_pool.max_free = max_free;
+
+    ONERROR(SimpleFS_mkDir(dir, "dir") == -1, "can't create dir");
+    DirectoryHandle *sub = SimpleFS_openDirectory(dir, "dir");
+    for(int i = 0; i < NUM_FILES; i++) {
+        sprintf(name, "file%d", i);
+        FileHandle *fh = SimpleFS_createFile(sub, name);
+        ONERROR(fh == NULL, "can't create %s", name);
+        ONERROR(SimpleFS_write(fh, name, strlen(name)) == -1, "write failed");
+        SimpleFS_close(fh);
+    }
+    SimpleFS_closeDirectory(sub);
+
+    long allocs = pool_allocs(&fs), mallocs = pool_mallocs(&fs);
+    double start = now();
+    for(int k = 0; k < NUM_CYCLES; k++) {
+        sub = SimpleFS_openDirectory(dir, "dir");
+        ONERROR(sub == NULL, "can't open dir");
+        sprintf(name, "file%d", k % NUM_FILES);
+        FileHandle *fh = SimpleFS_openFile(sub, name);
+        ONERROR(fh == NULL, "can't open %s", name);
+        ONERROR(SimpleFS_read(fh, buf, sizeof(buf)) != (int) strlen(name), "read failed");
+        SimpleFS_close(fh);
+        SimpleFS_closeDirectory(sub);
+    }
+    double elapsed = now() - start;
+    allocs = pool_allocs(&fs) - allocs;
+    mallocs = pool_mallocs(&fs) - mallocs;
+
+    printf("%-10s %16.2f %18.4f %14.3f\n", max_free ? "pooled" : "malloc", (double) allocs / NUM_CYCLES,
+        (double) mallocs / NUM_CYCLES, elapsed * 1e6 / NUM_CYCLES);
+
+    SimpleFS_destroy(&fs);
+    DiskDriver_close(&disk);
+    unlink("bench.fs");
+}
+
+int main(int argc, char **argv) {
+    printf("%d cycles of opening a directory, opening, reading and closing a file in it, and closing the directory\n",
+        NUM_CYCLES);
+    printf("%-10s %16s %18s %14s\n", "objects", "allocs per cycle", "mallocs per cycle", "us per cycle");
+    bench(0);
+    bench(SIMPLEFS_POOL_MAX_FREE);
+    return 0;
+}
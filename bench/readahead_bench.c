@@ -0,0 +1,88 @@
+#define _GNU_SOURCE
+#include "simplefs.h"
+#include "util.h"
+#include "bench.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Streams a big file with and without readahead, starting with none of the
+// image in memory. The file is written once in a single extent, and once
+// interleaved with another file so that its blocks are spread over the disk
+
+#define NUM_BLOCKS (48 * 1024)
+#define DISK_BLOCK_SIZE 4096
+#define FILE_SIZE (64 * 1024 * 1024)
+#define CHUNK_SIZE (64 * 1024)
+
+// Drop the pages of the image from memory, so that the reads go to the disk
+static void drop_cache(DiskDriver *disk) {
+    ONERROR(DiskDriver_flush(disk) == -1, "flush failed");
+    madvise(disk->header, disk->map_size, MADV_DONTNEED);
+    posix_fadvise(disk->fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+// Returns the throughput in MiB/s
+static double bench(SimpleFS *fs, DirectoryHandle *dir, const char *name, int readahead_max, char *buf) {
+    fs->readahead_max = readahead_max;
+    drop_cache(fs->disk);
+    FileHandle *fh = SimpleFS_openFile(dir, name);
+    ONERROR(fh == NULL, "can't open %s", name);
+
+    double start = now();
+    for(int pos = 0; pos < FILE_SIZE; pos += CHUNK_SIZE) {
+        ONERROR(SimpleFS_read(fh, buf, CHUNK_SIZE) != CHUNK_SIZE, "read failed");
+    }
+    double elapsed = now() - start;
+    SimpleFS_close(fh);
+    return FILE_SIZE / (1024.0 * 1024) / elapsed;
+}
+
+int main(int argc, char **argv) {
+    DiskDriver disk;
+    SimpleFS fs;
+    unlink("bench.fs");
+    DiskDriver_initWithBlockSize(&disk, "bench.fs", NUM_BLOCKS, DISK_BLOCK_SIZE);
+    DirectoryHandle *dir = SimpleFS_init(&fs, &disk);
+    char *buf = (char *) malloc(CHUNK_SIZE);
+    ONERROR(!buf, "malloc failed");
+    memset(buf, 'x', CHUNK_SIZE);
+
+    FileHandle *fh = SimpleFS_createFile(dir, "contiguous");
+    ONERROR(fh == NULL, "can't create contiguous");
+    for(int pos = 0; pos < FILE_SIZE; pos += CHUNK_SIZE) {
+        ONERROR(SimpleFS_write(fh, buf, CHUNK_SIZE) != CHUNK_SIZE, "write failed");
+    }
+    SimpleFS_close(fh);
+
+    // One block at a time, alternating with the other file
+    FileHandle *fh1 = SimpleFS_createFile(dir, "fragmented");
+    FileHandle *fh2 = SimpleFS_createFile(dir, "other");
+    ONERROR(fh1 == NULL || fh2 == NULL, "can't create fragmented");
+    for(int pos = 0; pos < FILE_SIZE / 2; pos += DISK_BLOCK_SIZE) {
+        ONERROR(SimpleFS_write(fh1, buf, DISK_BLOCK_SIZE) != DISK_BLOCK_SIZE, "write failed");
+        ONERROR(SimpleFS_write(fh1, buf, DISK_BLOCK_SIZE) != DISK_BLOCK_SIZE, "write failed");
+        ONERROR(SimpleFS_write(fh2, buf, DISK_BLOCK_SIZE) != DISK_BLOCK_SIZE, "write failed");
+    }
+    SimpleFS_close(fh1);
+    SimpleFS_close(fh2);
+
+    printf("%d MiB files, %d bytes blocks, read in %d KiB calls with an empty page cache\n",
+        FILE_SIZE / (1024 * 1024), DISK_BLOCK_SIZE, CHUNK_SIZE / 1024);
+    printf("%-12s %20s %24s\n", "file", "no readahead (MiB/s)", "readahead (MiB/s)");
+    const char *names[] = { "contiguous", "fragmented" };
+    for(int i = 0; i < 2; i++) {
+        double off = bench(&fs, dir, names[i], 0, buf);
+        double on = bench(&fs, dir, names[i], FILE_READAHEAD_MAX, buf);
+        printf("%-12s %20.1f %24.1f\n", names[i], off, on);
+    }
+
+    free(buf);
+    SimpleFS_destroy(&fs);
+    DiskDriver_close(&disk);
+    unlink("bench.fs");
+    return 0;
+}
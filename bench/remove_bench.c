@@ -0,0 +1,55 @@
+#include "simplefs.h"
+#include "util.h"
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Removes every file of a directory with NUM_FILES entries, in the order
+// they were created (each hole is filled with the last entry) and in the
+// opposite order (the last entry is always the one removed)
+
+#define NUM_BLOCKS (64 * 1024)
+#define NUM_FILES 50000
+
+static void bench(const char *order, int reverse) {
+    DiskDriver disk;
+    SimpleFS fs;
+    char name[32];
+    unlink("bench.fs");
+    DiskDriver_init(&disk, "bench.fs", NUM_BLOCKS);
+    DirectoryHandle *dir = SimpleFS_init(&fs, &disk);
+    int free_blocks = disk.header->free_blocks;
+
+    double start = now();
+    for(int i = 0; i < NUM_FILES; i++) {
+        sprintf(name, "file%d", i);
+        FileHandle *fh = SimpleFS_createFile(dir, name);
+        ONERROR(fh == NULL, "can't create %s", name);
+        SimpleFS_close(fh);
+    }
+    double created = now();
+
+    for(int i = 0; i < NUM_FILES; i++) {
+        sprintf(name, "file%d", reverse ? NUM_FILES - 1 - i : i);
+        ONERROR(SimpleFS_remove(dir, name) == -1, "can't remove %s", name);
+    }
+    double removed = now();
+    ONERROR(dir->dcb->num_entries != 0 || disk.header->free_blocks != free_blocks, "blocks leaked");
+
+    printf("%-16s %12.1f %12.1f %14.2f\n", order, (created - start) * 1e3, (removed - created) * 1e3,
+        (removed - created) * 1e6 / NUM_FILES);
+
+    SimpleFS_destroy(&fs);
+    DiskDriver_close(&disk);
+    unlink("bench.fs");
+}
+
+int main(int argc, char **argv) {
+    printf("%d files in a single directory, %d bytes blocks\n", NUM_FILES, BLOCK_SIZE);
+    printf("%-16s %12s %12s %14s\n", "removal order", "create (ms)", "remove (ms)", "us per remove");
+    bench("creation", 0);
+    bench("reverse", 1);
+    return 0;
+}
@@ -0,0 +1,119 @@
+#include "simplefs.h"
+#include "util.h"
+#include "bench.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Throughput of a file system shared by 1 to N threads (N is the number of
+// cores, or the first argument): every thread reads its own file, all the
+// threads read the same file, and every thread writes (and then removes) a new file
+
+#define MAX_THREADS 16
+#define NUM_BLOCKS (48 * 1024)
+#define DISK_BLOCK_SIZE 4096
+#define FILE_SIZE (4 * 1024 * 1024)
+#define CHUNK_SIZE (64 * 1024)
+#define ROUNDS 8
+
+typedef enum { READ_OWN, READ_SHARED, WRITE_OWN } Mode;
+
+typedef struct {
+    DirectoryHandle *dir;
+    Mode mode;
+    int id;
+} Worker;
+
+static void *worker(void *arg) {
+    Worker *w = (Worker *) arg;
+    char name[32];
+    char *buf = (char *) malloc(CHUNK_SIZE);
+    ONERROR(!buf, "malloc failed");
+    memset(buf, 'x', CHUNK_SIZE);
+
+    for(int round = 0; round < ROUNDS; round++) {
+        if(w->mode == WRITE_OWN) {
+            sprintf(name, "w%d", w->id);
+            FileHandle *fh = SimpleFS_createFile(w->dir, name);
+            ONERROR(fh == NULL, "can't create %s", name);
+            for(int pos = 0; pos < FILE_SIZE; pos += CHUNK_SIZE) {
+                ONERROR(SimpleFS_write(fh, buf, CHUNK_SIZE) != CHUNK_SIZE, "write failed");
+            }
+            SimpleFS_close(fh);
+            ONERROR(SimpleFS_remove(w->dir, name) == -1, "can't remove %s", name);
+        } else {
+            sprintf(name, "r%d", w->mode == READ_OWN ? w->id : 0);
+            FileHandle *fh = SimpleFS_openFile(w->dir, name);
+            ONERROR(fh == NULL, "can't open %s", name);
+            for(int pos = 0; pos < FILE_SIZE; pos += CHUNK_SIZE) {
+                ONERROR(SimpleFS_read(fh, buf, CHUNK_SIZE) != CHUNK_SIZE, "read failed");
+            }
+            SimpleFS_close(fh);
+        }
+    }
+
+    free(buf);
+    return NULL;
+}
+
+// Returns the throughput of all the threads together, in MiB/s
+static double bench(DirectoryHandle *dir, Mode mode, int num_threads) {
+    pthread_t threads[MAX_THREADS];
+    Worker workers[MAX_THREADS];
+
+    double start = now();
+    for(int i = 0; i < num_threads; i++) {
+        workers[i] = (Worker) { dir, mode, i };
+        ONERROR(pthread_create(&threads[i], NULL, worker, &workers[i]) != 0, "can't start thread %d", i);
+    }
+    for(int i = 0; i < num_threads; i++) pthread_join(threads[i], NULL);
+    double elapsed = now() - start;
+
+    return (double) num_threads * ROUNDS * FILE_SIZE / (1024 * 1024) / elapsed;
+}
+
+int main(int argc, char **argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    max_threads = max(1, min(max_threads, MAX_THREADS));
+
+    DiskDriver disk;
+    SimpleFS fs;
+    unlink("bench.fs");
+    DiskDriver_initWithBlockSize(&disk, "bench.fs", NUM_BLOCKS, DISK_BLOCK_SIZE);
+    DirectoryHandle *dir = SimpleFS_init(&fs, &disk);
+
+    // The files read by the threads, written once
+    char name[32];
+    char *buf = (char *) malloc(CHUNK_SIZE);
+    ONERROR(!buf, "malloc failed");
+    memset(buf, 'r', CHUNK_SIZE);
+    for(int i = 0; i < max_threads; i++) {
+        sprintf(name, "r%d", i);
+        FileHandle *fh = SimpleFS_createFile(dir, name);
+        ONERROR(fh == NULL, "can't create %s", name);
+        for(int pos = 0; pos < FILE_SIZE; pos += CHUNK_SIZE) {
+            ONERROR(SimpleFS_write(fh, buf, CHUNK_SIZE) != CHUNK_SIZE, "write failed");
+        }
+        SimpleFS_close(fh);
+    }
+    free(buf);
+
+    printf("%d MiB per thread and test, %d bytes blocks, %ld cores\n", ROUNDS * FILE_SIZE / (1024 * 1024),
+        DISK_BLOCK_SIZE, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%8s %16s %18s %16s\n", "threads", "own file (MiB/s)", "same file (MiB/s)", "write (MiB/s)");
+    for(int num_threads = 1; num_threads <= max_threads; num_threads++) {
+        // Powers of 2, and the maximum
+        if((num_threads & (num_threads - 1)) != 0 && num_threads != max_threads) continue;
+        double own = bench(dir, READ_OWN, num_threads);
+        double shared = bench(dir, READ_SHARED, num_threads);
+        double write = bench(dir, WRITE_OWN, num_threads);
+        printf("%8d %16.1f %18.1f %16.1f\n", num_threads, own, shared, write);
+    }
+
+    SimpleFS_destroy(&fs);
+    DiskDriver_close(&disk);
+    unlink("bench.fs");
+    return 0;
+}
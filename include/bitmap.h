@@ -19,13 +19,44 @@ int BitMap_indexToBlock(int entry, uint8_t bit_num);
 
 // returns the index of the first bit having status "status"
 // in the bitmap bmap, and starts looking from position start
-// returns -1 if no block is found
+// returns -1 if no block is found.
+// The bitmap is scanned 64 bits at a time (32 bytes at a time with AVX2,
+// if the CPU supports it)
 int BitMap_find(BitMap* bmap, int start, int status);
 
+// returns the index of the first run of at least min_len consecutive bits
+// having status "status", starting from position start.
+// The length of the run, up to max_len, is stored in len
+// returns -1 if there's no such run
+int BitMap_findRun(BitMap* bmap, int start, int status, int min_len, int max_len, int *len);
+
+// sets the count bits starting at index start to status
+// returns -1 if the range isn't in the bitmap
+int BitMap_setRange(BitMap* bmap, int start, int count, int status);
+
+// returns how many of the count bits starting at index start have status "status"
+// returns -1 if the range isn't in the bitmap
+int BitMap_countRange(BitMap* bmap, int start, int count, int status);
+
 // sets the bit at index pos in bmap to status
 // returns -1 if the block isn't in the bitmap
 int BitMap_set(BitMap* bmap, int pos, int status);
 
+// sets the bit at index pos to status with an atomic operation, so that it can be
+// used by more threads at the same time, together with BitMap_claim
+// returns the previous status of the bit, -1 if it isn't in the bitmap.
+// BitMap_testAndSet and BitMap_claim access the bitmap 64 bits at a time:
+// entries must be 8 bytes aligned, and padded to a multiple of 8 bytes
+int BitMap_testAndSet(BitMap* bmap, int pos, int status);
+
+// looks for a bit with status 0 from start (included) to end (excluded),
+// and sets it to 1 with an atomic compare-and-swap of its 64 bits word.
+// Concurrent calls never return the same bit. The searches (BitMap_find and
+// the others) don't use atomic operations, so while other threads claim bits
+// what they find is only a hint
+// returns the index of the bit, -1 if they're all set
+int BitMap_claim(BitMap* bmap, int start, int end);
+
 // returns the status of the block at index pos
 // returns -1 if the block isn't in the bitmap
 int BitMap_get(BitMap *bmap, int pos);
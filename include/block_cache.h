@@ -0,0 +1,64 @@
+#pragma once
+
+// Called when a dirty block has to be written back to the disk
+// returns -1 on failure, 0 otherwise
+typedef int (*BlockCache_writebackFn)(void *ctx, int block_num, const void *data);
+
+typedef struct {
+  int block_num;   // block stored in this slot, -1 if the slot is unused
+  int dirty;       // 1 if the data has to be written back before eviction
+  int prev, next;  // LRU list (indices of the slots, -1 terminated)
+  int hash_next;   // next slot in the same hash bucket
+  char *data;
+} BlockCacheEntry;
+
+typedef struct {
+  BlockCacheEntry *entries;
+  int capacity;    // maximum number of cached blocks, 0 disables the cache
+  int block_size;
+
+  int *buckets;    // hash table block_num -> first slot in the bucket
+  int num_buckets; // always a power of 2
+
+  int head, tail;  // most and least recently used slots
+  int free_slot;   // first unused slot (chained through next)
+
+  BlockCache_writebackFn writeback;
+  void *ctx;
+
+  long hits;
+  long misses;
+  long writebacks;
+} BlockCache;
+
+// initializes an empty cache holding up to capacity blocks of block_size bytes.
+// writeback is used to store dirty blocks when they are evicted or flushed
+void BlockCache_init(BlockCache *c, int capacity, int block_size, BlockCache_writebackFn writeback, void *ctx);
+
+// writes back all the dirty blocks and releases the memory used by the cache
+// returns -1 if a write back failed
+int BlockCache_destroy(BlockCache *c);
+
+// returns the cached copy of block_num, marking it as the most recently used one.
+// returns NULL if the block isn't cached. Updates the hit/miss counters
+char *BlockCache_get(BlockCache *c, int block_num);
+
+// stores a copy of data as the content of block_num, evicting the least
+// recently used block if the cache is full. If dirty is set the block will be
+// written back before being evicted.
+// returns -1 if the cache is disabled or the eviction failed
+int BlockCache_put(BlockCache *c, int block_num, const void *data, int dirty);
+
+// drops block_num from the cache without writing it back
+void BlockCache_invalidate(BlockCache *c, int block_num);
+
+// drops block_num from the cache, writing it back first if it's dirty
+// returns -1 if the write back failed
+int BlockCache_evict(BlockCache *c, int block_num);
+
+// writes back all the dirty blocks, which stay in the cache
+// returns -1 if a write back failed
+int BlockCache_flush(BlockCache *c);
+
+// print a description of the cache to stdout
+void BlockCache_print(BlockCache *c);
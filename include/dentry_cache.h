@@ -0,0 +1,60 @@
+#pragma once
+
+// longest name (terminator included) that can be cached, same as MAX_FILENAME_LEN
+#define DENTRY_NAME_LEN 128
+
+typedef struct {
+  int parent;      // first block of the directory holding the entry, -1 if the slot is unused
+  unsigned int hash;
+  char name[DENTRY_NAME_LEN];
+  int block;       // first block of the file, -1 for a negative entry (no such file)
+  int is_dir;
+  int size_in_bytes;
+  int prev, next;  // LRU list (indices of the slots, -1 terminated)
+  int hash_next;   // next slot in the same hash bucket
+} DentryCacheEntry;
+
+// Remembers the result of looking up names in directories, including the
+// names that weren't found. Entries are keyed by (parent, name) and the
+// least recently used one is replaced when the cache is full
+typedef struct {
+  DentryCacheEntry *entries;
+  int capacity;    // maximum number of entries, 0 disables the cache
+
+  int *buckets;    // hash table (parent, name) -> first slot in the bucket
+  int num_buckets; // always a power of 2
+
+  int head, tail;  // most and least recently used slots
+  int free_slot;   // first unused slot (chained through next)
+
+  long hits;
+  long misses;
+} DentryCache;
+
+// initializes an empty cache holding up to capacity entries
+void DentryCache_init(DentryCache *c, int capacity);
+
+// releases the memory used by the cache
+void DentryCache_destroy(DentryCache *c);
+
+// returns the entry for name in parent, marking it as the most recently used one.
+// hash is the hash of name, as used by the directories.
+// returns NULL if it isn't cached. Updates the hit/miss counters
+DentryCacheEntry *DentryCache_get(DentryCache *c, int parent, const char *name, unsigned int hash);
+
+// stores the entry for name in parent, replacing the cached one if there's any.
+// block is -1 to remember that there's no such name.
+// Names longer than DENTRY_NAME_LEN - 1 aren't cached
+void DentryCache_put(DentryCache *c, int parent, const char *name, unsigned int hash, int block, int is_dir, int size_in_bytes);
+
+// drops the entry for name in parent
+void DentryCache_invalidate(DentryCache *c, int parent, const char *name, unsigned int hash);
+
+// drops all the entries of the directory parent
+void DentryCache_invalidateDir(DentryCache *c, int parent);
+
+// drops all the entries
+void DentryCache_clear(DentryCache *c);
+
+// print a description of the cache to stdout
+void DentryCache_print(DentryCache *c);
@@ -1,14 +1,40 @@
 #pragma once
 #include "bitmap.h"
+#include "block_cache.h"
+#include "io_ring.h"
+#include <stdbool.h>
+#include <pthread.h>
 
+// block size of the disks created by DiskDriver_init
 #define BLOCK_SIZE 512
+// range of the block sizes accepted by DiskDriver_initWithBlockSize
+#define DISK_MIN_BLOCK_SIZE 512
+#define DISK_MAX_BLOCK_SIZE 65536
+// version of the on-disk format, stored in the header
+#define DISK_VERSION 4
+// oldest version that can be opened. SimpleFS_init upgrades older disks
+#define DISK_MIN_VERSION 1
+// size of the header of the disks created before the version was stored.
+// DiskDriver_init turns them into disks of version 1
+#define DISK_UNVERSIONED_HEADER_SIZE 16
+// number of blocks kept in the write-back cache by default
+#define DISK_CACHE_BLOCKS 64
+// number of blocks in each group of the free space summary
+#define DISK_GROUP_BLOCKS 4096
+// allocation hint meaning "anywhere": the search starts from the allocation cursor of the thread
+#define DISK_NO_HINT -1
+// number of allocation cursors, the threads allocating at the same time use different ones
+#define DISK_ALLOC_SLOTS 16
 // this is stored in the 1st block of the disk
 typedef struct {
   int num_blocks;
-  int bitmap_blocks;   // how many blocks in the bitmap
+  int free_queue;      // first block of the queue of blocks to free (see SimpleFS_reclaim), -1 if empty.
+                       // Before version 4 this was a copy of num_blocks
   int bitmap_entries;  // how many bytes are needed to store the bitmap
   
   int free_blocks;     // free blocks
+  int block_size;      // size of each block, chosen when the disk is created
+  int version;         // DISK_VERSION
 } DiskHeader; 
 
 typedef struct {
@@ -16,7 +42,20 @@ typedef struct {
   BitMap bitmap;  // mmapped (bitmap)
   int fd; // for us
 
+  int block_size;    // copy of header->block_size
   int metadata_size; // Total size of header + bitmap
+  size_t map_size;   // Total size of the mmapped region
+  BlockCache cache;  // write-back cache of the most recently used blocks
+  uint16_t *pins;    // how many times each block is mapped (see DiskDriver_mapBlock), changed atomically
+  IoRing ring;       // asynchronous requests, if io_uring is available
+  bool io_failed;    // a synchronous request failed since the last DiskDriver_complete
+  int *group_free;   // free blocks in each group of DISK_GROUP_BLOCKS blocks (not stored on disk)
+  int num_groups;
+  int cursors[DISK_ALLOC_SLOTS]; // for each slot, the block after the last one allocated by its threads, where
+                                // their DISK_NO_HINT searches start. The slots start spread over the disk
+  pthread_mutex_t lock; // taken by all the functions, the driver can be shared between threads
+  long blocks_written; // blocks written through writeBlock, writeBlocks and submitWrite
+  long blocks_prefetched; // blocks passed to DiskDriver_prefetchBlocks
 } DiskDriver;
 
 /**
@@ -30,25 +69,126 @@ typedef struct {
 // if the file was new
 // compiles a disk header, and fills in the bitmap of appropriate size
 // with all 0 (to denote the free space);
+// the block cache is enabled with DISK_CACHE_BLOCKS entries
+// new disks have blocks of BLOCK_SIZE bytes
 void DiskDriver_init(DiskDriver* disk, const char* filename, int num_blocks);
 
+// same as DiskDriver_init, but a new disk is created with blocks of
+// block_size bytes (a power of 2 between DISK_MIN_BLOCK_SIZE and DISK_MAX_BLOCK_SIZE).
+// Existing disks always keep the block size stored in their header
+void DiskDriver_initWithBlockSize(DiskDriver* disk, const char* filename, int num_blocks, int block_size);
+
+// flushes the disk and releases all the resources held by the driver
+int DiskDriver_close(DiskDriver* disk);
+
+// writes back the cache and resizes it to hold up to capacity blocks
+// a capacity of 0 disables the cache (all the writes go straight to the disk)
+// returns -1 if the cache couldn't be written back, keeping the old cache
+int DiskDriver_setCacheCapacity(DiskDriver* disk, int capacity);
+
 // reads the block in position block_num
 // returns -1 if the block is free accrding to the bitmap
 // 0 otherwise
 int DiskDriver_readBlock(DiskDriver* disk, void* dest, int block_num);
 
 // writes a block in position block_num, and alters the bitmap accordingly
+// the data is kept in the cache and reaches the disk on eviction or flush
 // returns -1 if operation not possible
 int DiskDriver_writeBlock(DiskDriver* disk, void* src, int block_num);
 
+// reads count blocks, block_nums[i] is stored in the buffer dest[i]
+// runs of contiguous blocks are read with a single system call,
+// cached blocks are copied from the cache. With io_uring all the runs
+// are in flight at the same time. Waits for all the submitted requests
+// returns -1 if any of the blocks is free according to the bitmap
+// 0 otherwise
+int DiskDriver_readBlocks(DiskDriver* disk, void** dest, const int* block_nums, int count);
+
+// writes count blocks, src[i] is stored in position block_nums[i],
+// and alters the bitmap accordingly
+// runs of contiguous blocks are written with a single system call,
+// bypassing the cache. Waits for all the submitted requests
+// returns -1 if operation not possible
+int DiskDriver_writeBlocks(DiskDriver* disk, void** src, const int* block_nums, int count);
+
+// same as DiskDriver_writeBlocks, but block block_nums[i] is made of the first
+// split bytes of heads[i] followed by block_size - split bytes of tails[i].
+// A header and the data after it are written together without copying them
+// into a buffer first
+int DiskDriver_writeSplitBlocks(DiskDriver* disk, void** heads, void** tails, int split, const int* block_nums, int count);
+
+// marks the block in position block_num as used, without writing it.
+// Its content is undefined until it's written or modified through a mapping
+// returns -1 if the block is already used or not in the disk
+int DiskDriver_allocBlock(DiskDriver* disk, int block_num);
+
+// marks as used a run of at least min_len and at most max_len contiguous free
+// blocks, without writing them. The search starts from block hint (or from the
+// allocation cursor with DISK_NO_HINT) and wraps around to the beginning of the disk.
+// returns the first block of the run, and stores its length in len
+// returns -1 if there's no such run
+int DiskDriver_allocExtent(DiskDriver* disk, int hint, int min_len, int max_len, int *len);
+
+// returns a pointer to the block in position block_num inside the mmapped
+// disk image, which can be used to read and modify the block in place without copies.
+// The block is pinned: while mapped it's never held in the cache, so all the
+// accesses (mapped or through read/write) see the same data.
+// Every successful call must be paired with DiskDriver_unmapBlock.
+// Only the first mapping of a block takes the lock of the driver
+// returns NULL if the block is free according to the bitmap
+void* DiskDriver_mapBlock(DiskDriver* disk, int block_num);
+
+// unpins a block previously mapped with DiskDriver_mapBlock, without the lock
+void DiskDriver_unmapBlock(DiskDriver* disk, int block_num);
+
+// hints that the count blocks in block_nums are going to be read soon: each
+// run of contiguous blocks starts loading in the background with a single
+// request, so that mapping them later doesn't wait for the disk.
+// Returns right away, without the lock. The blocks out of the disk are skipped
+void DiskDriver_prefetchBlocks(DiskDriver* disk, const int* block_nums, int count);
+
+// starts reading the block in position block_num into dest, which must
+// stay valid until DiskDriver_complete. The request is asynchronous if
+// io_uring is available, otherwise it's done before returning
+// returns -1 if the block is free according to the bitmap
+// 0 otherwise
+int DiskDriver_submitRead(DiskDriver* disk, void* dest, int block_num);
+
+// starts writing src in position block_num, and alters the bitmap accordingly.
+// src must stay valid until DiskDriver_complete. Like DiskDriver_submitRead
+// the request is asynchronous only if io_uring is available
+// returns -1 if operation not possible
+int DiskDriver_submitWrite(DiskDriver* disk, void* src, int block_num);
+
+// waits for all the submitted requests to complete
+// returns -1 if any of them failed
+int DiskDriver_complete(DiskDriver* disk);
+
 // frees a block in position block_num, and alters the bitmap accordingly
 // returns -1 if operation not possible
 int DiskDriver_freeBlock(DiskDriver* disk, int block_num);
 
 // returns the first free blockin the disk from position (checking the bitmap)
+// the groups of DISK_GROUP_BLOCKS blocks without free blocks are skipped
+// without scanning their part of the bitmap
 int DiskDriver_getFreeBlock(DiskDriver* disk, int start);
 
-// writes the data (flushing the mmaps)
+// returns a free block, looking from block hint to the end of the disk and then
+// wrapping around. With DISK_NO_HINT the search starts from the block after the
+// last allocated one (next-fit), instead of rescanning the full front of the disk
+// returns -1 if the disk is full
+int DiskDriver_getFreeBlockNear(DiskDriver* disk, int hint);
+
+// like DiskDriver_getFreeBlockNear, but the block is also marked as used
+// (as DiskDriver_allocBlock does). With more threads sharing the disk this is
+// the only way to get a free block that no one else can take in the meantime.
+// It doesn't wait for the lock of the driver: the block is claimed with an
+// atomic compare-and-swap on the bitmap, so the threads allocating at the
+// same time don't wait for each other
+// returns -1 if the disk is full
+int DiskDriver_allocBlockNear(DiskDriver* disk, int hint);
+
+// writes the data (writing back the dirty cached blocks and flushing the mmaps)
 int DiskDriver_flush(DiskDriver* disk);
 
 // print a description of the driver to stdout
@@ -0,0 +1,58 @@
+#pragma once
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Asynchronous I/O on a file descriptor through io_uring.
+// The ring is only available if the project is built with IO_URING=1
+// (which defines DISK_IO_URING) and the kernel supports it
+
+// maximum number of requests in flight
+#define IO_RING_ENTRIES 32
+// maximum number of buffers in a single request
+#define IO_RING_MAX_IOV 256
+
+typedef struct {
+  struct iovec iov[IO_RING_MAX_IOV];
+  int iovcnt;
+  size_t expected;  // number of bytes to transfer
+} IoRingRequest;
+
+typedef struct {
+  int ring_fd;      // -1 if the ring isn't available
+
+  // submission queue
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  void *sqes;
+  // completion queue
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  void *cqes;
+
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+
+  IoRingRequest *requests; // IO_RING_ENTRIES requests
+  int free_requests[IO_RING_ENTRIES]; // stack of unused requests
+  int num_free;
+  int to_submit;    // queued but not yet submitted to the kernel
+  int in_flight;    // submitted but not yet completed
+  bool failed;      // a request failed since the last IoRing_wait
+} IoRing;
+
+// sets up a ring
+// returns -1 if io_uring isn't compiled in or not supported by the kernel
+int IoRing_init(IoRing *r);
+
+// waits for the pending requests and releases the ring
+void IoRing_destroy(IoRing *r);
+
+// queues a vectored read (or write if is_write is set) of the iovcnt buffers
+// in iov, at the given offset of fd. The buffers are copied, but the memory
+// they point to must stay valid until IoRing_wait returns.
+// If the ring is full, waits for the pending requests first
+// returns -1 if the ring isn't available or iovcnt is too large
+int IoRing_queue(IoRing *r, int fd, const struct iovec *iov, int iovcnt, off_t offset, bool is_write);
+
+// submits the queued requests and waits for all of them to complete
+// returns -1 if any request failed or transferred less than expected
+int IoRing_wait(IoRing *r);
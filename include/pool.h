@@ -0,0 +1,36 @@
+#pragma once
+#include <pthread.h>
+#include <stddef.h>
+
+// Keeps the objects of one size released with Pool_free, so that allocating
+// them again doesn't go through malloc. Once the pool has as many objects as
+// are in use at the same time, allocating and releasing them costs no malloc
+// and no free. Can be shared between threads
+typedef struct {
+  size_t object_size;
+  void *free_list;   // released objects, chained through their first bytes
+  int num_free;
+  int max_free;      // objects kept in free_list at most, the others are freed
+  pthread_mutex_t lock;
+
+  long allocs;       // calls to Pool_alloc
+  long mallocs;      // calls to Pool_alloc that took a new object from malloc
+  long frees;        // calls to Pool_free
+} Pool;
+
+// initializes an empty pool of objects of object_size bytes,
+// keeping up to max_free released objects for reuse
+void Pool_init(Pool *p, size_t object_size, int max_free);
+
+// releases the objects kept by the pool. The objects still in use can
+// be freed with free() from now on
+void Pool_destroy(Pool *p);
+
+// returns a zeroed object, like calloc
+void *Pool_alloc(Pool *p);
+
+// releases an object returned by Pool_alloc. NULL is ignored
+void Pool_free(Pool *p, void *obj);
+
+// print a description of the pool to stdout
+void Pool_print(Pool *p);
@@ -1,8 +1,29 @@
 #pragma once
 #include "bitmap.h"
 #include "disk_driver.h"
+#include "dentry_cache.h"
+#include "pool.h"
 
 #define MAX_FILENAME_LEN 128
+// files with more blocks than this get a block index
+#define FILE_INDEX_MIN_BLOCKS 8
+// the readahead window of a file handle starts at FILE_READAHEAD_MIN blocks
+// and doubles up to SimpleFS.readahead_max (at most FILE_READAHEAD_MAX)
+#define FILE_READAHEAD_MIN 4
+#define FILE_READAHEAD_MAX 256
+// writes appending at least this many blocks to a file reserve and write them in batches
+#define FILE_BULK_WRITE_BLOCKS 16
+// blocks reserved and written at once by each batch of a bulk write
+#define FILE_BULK_BATCH_BLOCKS 64
+// blocks remembered by each file handle as starting points for seeking
+#define FILE_SEEK_CHECKPOINTS 4
+// number of names remembered by the dentry cache
+#define DENTRY_CACHE_ENTRIES 1024
+// released objects of each kind kept for reuse by the pools of a file system
+#define SIMPLEFS_POOL_MAX_FREE 64
+
+// blocks freed at a time by the background reclaimer, see SimpleFS_startReclaimer
+#define SIMPLEFS_RECLAIM_BATCH 64
 
 /*these are structures stored on disk*/
 
@@ -17,14 +38,29 @@ typedef struct {
 
 // this is in the first block of a chain, after the header
 typedef struct {
-  int directory_block; // first block of the parent directory
+  int directory_block; // first block of the parent directory. For removed files waiting
+                       // in the free queue, the next one in the queue (-1 terminated)
   int block_in_disk;   // repeated position of the block on the disk
   char name[MAX_FILENAME_LEN];
   int size_in_bytes;
   int size_in_blocks;
   int is_dir;          // 0 for file, 1 for dir
+  int index_block;     // root of the block index, -1 if there's none
+  int index_depth;     // levels of index blocks below (and including) the root
 } FileControlBlock;
 
+// The block index maps the position of each block in a file (block_in_file)
+// to its position on the disk, so that seeking doesn't have to follow the
+// chain of blocks. It's a radix tree of index blocks, each one an array of
+// block_size / sizeof(int) block numbers (0 for unused entries): the entries
+// of the lowest level are data blocks, the others point to the next level.
+// Index blocks aren't part of the chain of the file. Only files with more
+// than FILE_INDEX_MIN_BLOCKS blocks have one
+
+// the blocks have the size chosen when the disk was created, so the
+// arrays at the end of each block take all the space left in the block
+// (see DiskDriver.block_size)
+
 // this is the first physical block of a file
 // it has a header
 // an FCB storing file infos
@@ -34,70 +70,168 @@ typedef struct {
 typedef struct {
   BlockHeader header;
   FileControlBlock fcb;
-  char data[BLOCK_SIZE-sizeof(FileControlBlock) - sizeof(BlockHeader)] ;
+  char data[];
 } FirstFileBlock;
 
 // this is one of the next physical blocks of a file
 typedef struct {
   BlockHeader header;
-  char  data[BLOCK_SIZE-sizeof(BlockHeader)];
+  char  data[];
 } FileBlock;
 
+// an entry of a directory: the first block of a file (or directory) and
+// the hash of its name, so that looking for a name only reads the first
+// blocks of the files whose names have the same hash
+typedef struct {
+  int block;
+  unsigned int hash;
+} DirectoryEntry;
+
 // this is the first physical block of a directory
 typedef struct {
   BlockHeader header;
   FileControlBlock fcb;
   int num_entries;
-  int file_blocks[ (BLOCK_SIZE
-		   -sizeof(BlockHeader)
-		   -sizeof(FileControlBlock)
-		    -sizeof(int))/sizeof(int) ];
+  DirectoryEntry entries[];
 } FirstDirectoryBlock;
 
 // this is remainder block of a directory
 typedef struct {
   BlockHeader header;
-  int file_blocks[ (BLOCK_SIZE-sizeof(BlockHeader))/sizeof(int) ];
+  DirectoryEntry entries[];
 } DirectoryBlock;
+
+// Directories that don't fit in their first block also get a hash index,
+// rooted in fcb.index_block (with index_depth 1). The root holds a power
+// of 2 of buckets, chosen by the low bits of the hash of the name. Each
+// bucket is 0 if empty, or the first of a chain of DirectoryHashBuckets
+// holding copies of the entries of the directory. The index is rebuilt
+// with more buckets as the directory grows
+typedef struct {
+  int num_buckets;
+  int buckets[];
+} DirectoryHashIndex;
+
+typedef struct {
+  int next_bucket;     // overflow bucket, 0 if there's none
+  int num_entries;
+  DirectoryEntry entries[];
+} DirectoryHashBucket;
 /******************* stuff on disk END *******************/
 
 
 
 
   
+typedef struct DirectoryHandle DirectoryHandle;
+
+// the in-memory state of a file, shared by all the handles open on it
+typedef struct OpenFile {
+  FirstFileBlock* ffb;             // first block of the file, written back by SimpleFS_write
+  int refs;                        // number of handles open on the file
+  int dirty;                       // ffb was changed since it was last written to the disk
+  int unlinked;                    // removed from its directory and put in the free queue,
+                                   // the last SimpleFS_close frees its blocks
+  pthread_rwlock_t lock;           // held for reading by SimpleFS_read/seek, for writing by SimpleFS_write
+  struct OpenFile* prev;           // list of the open files of sfs
+  struct OpenFile* next;
+} OpenFile;
+
+// the state of a file system, one for each disk in use.
+// Nothing is shared between different instances.
+// Any number of threads can use the same file system, as long as each
+// handle is used by one thread at a time. The directories (and everything
+// else in here) are guarded by lock, the contents of the files by the lock
+// of each OpenFile: reads of the same file and writes of different files
+// run in parallel. A thread holding the lock of a file can take lock, not the other way around
 typedef struct {
   DiskDriver* disk;
   int current_directory_block;
+  DentryCache dentries;            // names looked up in all the directories
+  DirectoryHandle* handles;        // open directory handles
+  OpenFile* open_files;            // files with at least a handle open
+  Pool block_pool;                 // buffers holding a block of the disk
+  Pool file_handle_pool;           // the handles, open files and directory iterators of
+  Pool open_file_pool;             // this file system, reused instead of going through malloc
+  Pool dir_handle_pool;
+  Pool iterator_pool;
+  int readahead_max;               // largest readahead window of the file handles (see SimpleFS_read),
+                                   // FILE_READAHEAD_MAX by default, 0 disables readahead
+  pthread_t reclaimer;             // frees the free queue in the background, see SimpleFS_startReclaimer
+  int reclaimer_running;
+  pthread_cond_t reclaim_cond;     // signaled when a directory is queued, and to stop the reclaimer
+  pthread_mutex_t lock;            // recursive
 } SimpleFS;
 
+// a block of the file where a seek stopped, see SimpleFS_seek
+typedef struct {
+  int block_in_file;               // -1 if unused
+  int block;                       // position on the disk
+} SeekCheckpoint;
+
 // this is a file handle, used to refer to open files
 typedef struct {
   SimpleFS* sfs;                   // pointer to memory file system structure
-  FirstFileBlock* fcb;             // pointer to the first block of the file(read it)
+  OpenFile* file;                  // shared with the other handles on the same file
+  FirstFileBlock* fcb;             // pointer to the first block of the file (file->ffb)
   FirstDirectoryBlock* directory;  // pointer to the directory where the file is stored
-  BlockHeader* current_block;      // current block in the file
+  BlockHeader* current_block;      // current block in the file (mapped, unless it's the first block)
   int current_block_pos;           // block index of the current block
   int pos_in_file;                 // position of the cursor
+  int readahead_window;            // blocks prefetched at a time, 0 after a seek
+  int readahead_end;               // block_in_file after the last one prefetched
+  SeekCheckpoint checkpoints[FILE_SEEK_CHECKPOINTS]; // replaced round robin
+  int next_checkpoint;
 } FileHandle;
 
+// attributes of a file (or directory), as returned by SimpleFS_readDirPlus
 typedef struct {
+  char name[MAX_FILENAME_LEN];
+  int is_dir;
+  int size_in_bytes;
+  int size_in_blocks;
+  int block;                       // first block of the file on the disk
+} FileInfo;
+
+// a cursor over the files of a directory, see SimpleFS_openDir
+typedef struct FileIterator FileIterator;
+
+struct DirectoryHandle {
   SimpleFS* sfs;                   // pointer to memory file system structure
   FirstDirectoryBlock* dcb;        // pointer to the first block of the directory(read it)
   FirstDirectoryBlock* directory;  // pointer to the parent directory (null if top level)
   BlockHeader* current_block;      // current block in the directory
   int pos_in_dir;                  // absolute position of the cursor in the directory
   int pos_in_block;                // relative position of the cursor in the block
-} DirectoryHandle;
+  int unlinked;                    // the directory (or one above it) was removed,
+                                   // only paths starting with '/' can be used
+  DirectoryHandle* prev;           // list of the open handles of sfs
+  DirectoryHandle* next;
+};
 
 // initializes a file system on an already made disk
-// returns a handle to the top level directory stored in the first block
+// returns a handle to the top level directory stored in the first block.
+// Any number of file systems can be used at the same time, each on its own disk
 DirectoryHandle* SimpleFS_init(SimpleFS* fs, DiskDriver* disk);
 
+// releases the memory used by fs, stopping the reclaimer and closing the
+// directory handles still open. The disk is left open
+void SimpleFS_destroy(SimpleFS* fs);
+
+// opens a new handle to the directory at path (see SimpleFS_openPath).
+// All the handles of a file system see the changes made through the others
+// returns NULL if there's no such directory
+DirectoryHandle* SimpleFS_openDirectory(DirectoryHandle* d, const char* path);
+
+// closes a directory handle (destroyes it)
+void SimpleFS_closeDirectory(DirectoryHandle* d);
+
 // creates the inital structures, the top level directory
 // has name "/" and its control block is in the first position
 // it also clears the bitmap of occupied blocks on the disk
 // the current_directory_block is cached in the SimpleFS struct
-// and set to the top level directory
+// and set to the top level directory. The open directory handles
+// are moved to the top level directory too
 void SimpleFS_format(SimpleFS* fs);
 
 // creates an empty file in the directory d
@@ -108,30 +242,70 @@ FileHandle* SimpleFS_createFile(DirectoryHandle* d, const char* filename);
 // reads in the (preallocated) blocks array, the name of all files in a directory 
 int SimpleFS_readDir(char** names, DirectoryHandle* d);
 
+// reads in the (preallocated) infos array the name and attributes of all the
+// files in a directory, reading each first block once
+// returns the number of files
+int SimpleFS_readDirPlus(FileInfo* infos, DirectoryHandle* d);
+
+// opens a cursor over the files of the directory d, which must not be changed
+// (or moved to another directory) until the cursor is closed.
+// Listing a directory this way takes the same memory for any number of files
+FileIterator* SimpleFS_openDir(DirectoryHandle* d);
+
+// stores the name and attributes of the next file in info, without allocating anything
+// returns 0 at the end of the directory, 1 otherwise
+int SimpleFS_nextDir(FileIterator* it, FileInfo* info);
+
+// closes a cursor opened with SimpleFS_openDir
+void SimpleFS_closeDir(FileIterator* it);
+
 
 // opens a file in the  directory d. The file should be exisiting
 FileHandle* SimpleFS_openFile(DirectoryHandle* d, const char* filename);
 
+// opens the file at path. The path is relative to d unless it starts with '/',
+// names are separated by '/' and can be "." or ".."
+// returns NULL if there's no such file or it's a directory
+FileHandle* SimpleFS_openPath(DirectoryHandle* d, const char* path);
+
+// stores in info the attributes of the file or directory at path (see SimpleFS_openPath)
+// returns -1 if there's no such file, 0 on success
+int SimpleFS_statPath(DirectoryHandle* d, const char* path, FileInfo* info);
+
 
 // closes a file handle (destroyes it)
 int SimpleFS_close(FileHandle* f);
 
 // writes in the file, at current position for size bytes stored in data
-// overwriting and allocating new space if necessary
+// overwriting and allocating new space if necessary.
+// The data blocks are changed in place, the first block (with the control
+// block) is kept in memory and written back only when the file grows by some
+// blocks, by SimpleFS_fsync and by SimpleFS_close. Until then the size
+// stored on the disk can be behind the one seen by the handles
 // returns the number of bytes written
 int SimpleFS_write(FileHandle* f, void* data, int size);
 
-// writes in the file, at current position size bytes stored in data
-// overwriting and allocating new space if necessary
+// writes back the first block of the file if it was changed, and flushes the disk
+// returns -1 on error, 0 on success
+int SimpleFS_fsync(FileHandle* f);
+
+// reads in data up to size bytes of the file, from the current position.
+// Reading a file with a block index sequentially prefetches the blocks
+// ahead of the cursor, in a window that grows while the reads go on
 // returns the number of bytes read
 int SimpleFS_read(FileHandle* f, void* data, int size);
 
 // returns the number of bytes read (moving the current pointer to pos)
+// The chain of blocks is followed forwards or backwards from the closest of
+// the first block, the last one, the current one and the checkpoints of the
+// handle. Files with a block index use it when it's cheaper.
+// The readahead window of the handle starts over
 // returns pos on success
 // -1 on error (file too short)
 int SimpleFS_seek(FileHandle* f, int pos);
 
-// seeks for a directory in d. If dirname is equal to ".." it goes one level up
+// seeks for a directory in d. dirname can be a path (see SimpleFS_openPath),
+// so ".." goes one level up and "/" to the top level directory
 // 0 on success, negative value on error
 // it does side effect on the provided handle
 int SimpleFS_changeDir(DirectoryHandle* d, char* dirname);
@@ -143,9 +317,37 @@ int SimpleFS_mkDir(DirectoryHandle* d, char* dirname);
 
 // removes the file in the current directory
 // returns -1 on failure 0 on success
-// if a directory, it removes recursively all contained files
+// a file still open is gone from the directory right away, and its blocks
+// are freed when its last handle is closed. Until then it waits in the free
+// queue, so it's freed by SimpleFS_reclaim if the disk is opened again.
+// if a directory, it removes recursively all contained files:
+// the directory is detached right away, and its blocks are put in the
+// free queue to be released by SimpleFS_reclaim. The handles open on
+// the directories below it can only be moved elsewhere with an absolute
+// path, and the files still open there are freed by their last close
 int SimpleFS_remove(DirectoryHandle* d, char* filename);
 
+// frees up to max_blocks blocks (-1 for no limit) of the removed directories
+// in the free queue. The files still open are skipped. The queue is kept on disk, so the work left is resumed
+// the next time the disk is opened. When the disk is full, the allocation
+// functions reclaim the blocks they need by themselves
+// returns the number of blocks freed
+int SimpleFS_reclaim(SimpleFS* fs, int max_blocks);
+
+// starts a thread that reclaims the free queue whenever a directory is
+// removed, SIMPLEFS_RECLAIM_BATCH blocks at a time. The lock of fs is
+// released between the batches. Does nothing if it's already running
+void SimpleFS_startReclaimer(SimpleFS* fs);
+
+// stops the thread started by SimpleFS_startReclaimer, after the batch in
+// progress. The blocks left stay in the queue
+void SimpleFS_stopReclaimer(SimpleFS* fs);
+
+// returns the number of blocks in the free queue. They aren't counted in the
+// free_blocks of the disk until they're reclaimed.
+// Reads the control blocks and the indexes of the removed files, not their data
+int SimpleFS_queuedBlocks(SimpleFS* fs);
+
 
 // Debug prints
 
@@ -0,0 +1,19 @@
+#!/bin/bash
+
+RED="\e[31m"
+BOLDGREEN="\e[1;32m"
+ENDCOLOR="\e[0m"
+
+files=$(find ./bench/ -executable -type f)
+
+if [[ ${files[@]} ]]; then
+
+    for bench_file in ${files[@]}
+    do
+        echo -e ${BOLDGREEN}Running $bench_file...${ENDCOLOR}
+        ./$bench_file
+    done
+
+else
+    echo -e ${RED}No benchmarks found. Did you run make?${ENDCOLOR}
+fi
@@ -33,8 +33,7 @@ void do_format(int argc, char **argv) {
         return;
     }
 
-    SimpleFS_format(&fs);
-    cwd = SimpleFS_init(&fs, &disk);
+    SimpleFS_format(&fs); // cwd is moved to the top level directory
 
     if(cwd_path) free(cwd_path);
     cwd_path_cap = 64;
@@ -45,14 +44,46 @@ void do_format(int argc, char **argv) {
     puts("Done");
 }
 
+// Open a handle on the directory holding the last name of path, and store that
+// name in name. cwd doesn't move, the handle is closed with SimpleFS_closeDirectory
+// returns NULL if the directory doesn't exist
+DirectoryHandle *open_parent(char *path, char **name) {
+    // Ignore the slashes at the end
+    int len = strlen(path);
+    while(len > 1 && path[len - 1] == '/') path[--len] = 0;
+
+    char *slash = strrchr(path, '/');
+    if(!slash) {
+        *name = path;
+        return SimpleFS_openDirectory(cwd, ".");
+    }
+
+    DirectoryHandle *parent;
+    if(slash == path) {
+        parent = SimpleFS_openDirectory(cwd, "/");
+    } else {
+        *slash = 0;
+        parent = SimpleFS_openDirectory(cwd, path);
+        *slash = '/';
+    }
+    *name = slash + 1;
+    return parent;
+}
+
 void do_mkdir(int argc, char **argv) {
-    if(SimpleFS_mkDir(cwd, argv[1]) == -1) {
+    char *name;
+    DirectoryHandle *parent = open_parent(argv[1], &name);
+    if(!parent || SimpleFS_mkDir(parent, name) == -1) {
         fprintf(stderr, "Operation failed\n");
     }
+    if(parent) SimpleFS_closeDirectory(parent);
 }
 
 void do_touch(int argc, char **argv) {
-    FileHandle *fh = SimpleFS_createFile(cwd, argv[1]);
+    char *name;
+    DirectoryHandle *parent = open_parent(argv[1], &name);
+    FileHandle *fh = parent ? SimpleFS_createFile(parent, name) : NULL;
+    if(parent) SimpleFS_closeDirectory(parent);
 
     if(!fh) {
         fprintf(stderr, "Operation failed\n");
@@ -65,130 +96,107 @@ void do_touch(int argc, char **argv) {
 void do_cd(int argc, char **argv) {
     if(SimpleFS_changeDir(cwd, argv[1]) == -1) {
         fprintf(stderr, "%s: not found\n", argv[1]);
-    } else {
+        return;
+    }
 
-        // update the current path
-        if(!strcmp("/", argv[1])) {
-            strcpy(cwd_path, "/");
-        } else if(!strcmp("..", argv[1])) {
+    // update the current path, one name at a time
+    if(argv[1][0] == '/') {
+        strcpy(cwd_path, "/");
+    }
+    for(char *name = strtok(argv[1], "/"); name; name = strtok(NULL, "/")) {
+        if(!strcmp("..", name)) {
             char *pos = strrchr(cwd_path, '/');
             if(pos) {
                 if(pos == cwd_path) *(pos+1) = 0;
                 else *pos = 0;
             }
-        } else if(!strcmp(".", argv[1])) {
+        } else if(!strcmp(".", name)) {
             // do nothing
         } else {
-            if(strlen(cwd_path) + strlen(argv[1]) + 2 > cwd_path_cap) {
-                cwd_path_cap = max(cwd_path_cap * 2, strlen(cwd_path) + strlen(argv[1]) + 2);
+            if(strlen(cwd_path) + strlen(name) + 2 > cwd_path_cap) {
+                cwd_path_cap = max(cwd_path_cap * 2, strlen(cwd_path) + strlen(name) + 2);
                 cwd_path = (char *) realloc(cwd_path, cwd_path_cap * sizeof(char));
                 ONERROR(cwd_path == NULL, "realloc failed");
             }
             if(strcmp(cwd_path, "/") != 0) {
                 strcat(cwd_path, "/");
             }
-            strcat(cwd_path, argv[1]);
+            strcat(cwd_path, name);
         }
     }
 }
 
-typedef struct {
-    char *name;
-    bool is_dir;
-    int size;
-} ls_item;
-
 int ls_compare(const void *_a, const void *_b) {
-    ls_item *a = (ls_item *)_a;
-    ls_item *b = (ls_item *)_b;
+    FileInfo *a = (FileInfo *)_a;
+    FileInfo *b = (FileInfo *)_b;
 
     return strcmp(a->name, b->name);
 }
 
 void do_ls(int argc, char **argv) {
-    int num_entries = cwd->dcb->num_entries;
-    ls_item *entries = (ls_item *) malloc(num_entries * sizeof(ls_item));
-    char **names = (char **) malloc(num_entries * sizeof(char *));
-    assert(entries != NULL && names != NULL);
+    DirectoryHandle *dir = SimpleFS_openDirectory(cwd, argc == 2 ? argv[1] : ".");
+    if(!dir) {
+        fprintf(stderr, "%s: not found\n", argv[1]);
+        return;
+    }
 
-    if(SimpleFS_readDir(names, cwd) == -1) {
+    int num_entries = dir->dcb->num_entries;
+    FileInfo *entries = (FileInfo *) malloc(num_entries * sizeof(FileInfo));
+    assert(entries != NULL);
+
+    if(SimpleFS_readDirPlus(entries, dir) == -1) {
         fprintf(stderr, "Operation failed\n");
+        free(entries);
+        SimpleFS_closeDirectory(dir);
         return;
     }
 
     for(int i = 0; i < num_entries; i++) {
-        entries[i].name = names[i];
-
-        FileHandle *fh = SimpleFS_openFile(cwd, names[i]);
-        if(fh) {
-            entries[i].size = fh->fcb->fcb.size_in_bytes;
-            entries[i].is_dir = false;
-            SimpleFS_close(fh);
-        } else {
-            entries[i].size = BLOCK_SIZE;
-            entries[i].is_dir = true;
-        }
+        if(entries[i].is_dir) entries[i].size_in_bytes = disk.block_size;
     }
 
-    qsort(entries, num_entries, sizeof(ls_item), ls_compare);
+    qsort(entries, num_entries, sizeof(FileInfo), ls_compare);
 
     // Find the maximum width of the file sizes when printed.
     // To do this, call snprintf with no buffer and a size of 0,
     // so that it returns the size it would need to print the number
 
-    int size_width = snprintf(NULL, 0, "%d", BLOCK_SIZE);
+    int size_width = snprintf(NULL, 0, "%d", disk.block_size);
     for(int i = 0; i < num_entries; i++) {
-        size_width = max(size_width, snprintf(NULL, 0, "%d", entries[i].size));
+        size_width = max(size_width, snprintf(NULL, 0, "%d", entries[i].size_in_bytes));
     }
 
-    printf("%s:\n", cwd->dcb->fcb.name);
-    printf("  %*d ./\n", size_width, BLOCK_SIZE);
-    printf("  %*d ../\n", size_width, BLOCK_SIZE);
+    printf("%s:\n", dir->dcb->fcb.name);
+    printf("  %*d ./\n", size_width, disk.block_size);
+    printf("  %*d ../\n", size_width, disk.block_size);
     for(int i = 0; i < num_entries; i++) {
         if(entries[i].is_dir) {
-            printf("  %*d %s/\n", size_width, entries[i].size, entries[i].name);
+            printf("  %*d %s/\n", size_width, entries[i].size_in_bytes, entries[i].name);
         } else {
-            printf("  %*d %s\n", size_width, entries[i].size, entries[i].name);
+            printf("  %*d %s\n", size_width, entries[i].size_in_bytes, entries[i].name);
         }
     }
 
-    for(int i = 0; i < num_entries; i++) {
-        free(names[i]);
-    }
     free(entries);
-    free(names);
+    SimpleFS_closeDirectory(dir);
 }
 
 // Used to keep the prefix for the current line in tree
 static char *tree_prefix = NULL;
 static int tree_prefix_len, tree_prefix_cap;
 
-void tree_aux(int depth) {
-    int num_entries = cwd->dcb->num_entries;
-    ls_item *entries = (ls_item *) malloc(num_entries * sizeof(ls_item));
-    char **names = (char **) malloc(num_entries * sizeof(char *));
-    assert(entries != NULL && names != NULL);
+void tree_aux(DirectoryHandle *dir, int depth) {
+    int num_entries = dir->dcb->num_entries;
+    FileInfo *entries = (FileInfo *) malloc(num_entries * sizeof(FileInfo));
+    assert(entries != NULL);
 
-    if(SimpleFS_readDir(names, cwd) == -1) {
+    if(SimpleFS_readDirPlus(entries, dir) == -1) {
         fprintf(stderr, "Operation failed\n");
+        free(entries);
         return;
     }
 
-    for(int i = 0; i < num_entries; i++) {
-        entries[i].name = names[i];
-
-        FileHandle *fh = SimpleFS_openFile(cwd, names[i]);
-        if(fh) {
-            entries[i].size = fh->fcb->fcb.size_in_bytes;
-            entries[i].is_dir = false;
-            SimpleFS_close(fh);
-        } else {
-            entries[i].size = 0;
-            entries[i].is_dir = true;
-        }
-    }
-
-    qsort(entries, num_entries, sizeof(ls_item), ls_compare);
+    qsort(entries, num_entries, sizeof(FileInfo), ls_compare);
 
     // "│   " is 7 bytes long, make sure there's enough space to append it to the prefix
     if(tree_prefix_cap < tree_prefix_len + 8) {
@@ -205,7 +213,8 @@ void tree_aux(int depth) {
 
         if(entries[i].is_dir) {
             printf("%s\n", entries[i].name);
-            SimpleFS_changeDir(cwd, entries[i].name);
+            DirectoryHandle *child = SimpleFS_openDirectory(dir, entries[i].name);
+            if(!child) continue;
 
             int prefix_item_len = 0;
             if(i < num_entries - 1) {
@@ -217,39 +226,42 @@ void tree_aux(int depth) {
             }
             tree_prefix_len += prefix_item_len;
 
-            tree_aux(depth + 1);
+            tree_aux(child, depth + 1);
             
             tree_prefix_len -= prefix_item_len;
             tree_prefix[tree_prefix_len] = 0;
 
-            SimpleFS_changeDir(cwd, "..");
+            SimpleFS_closeDirectory(child);
         } else {
             printf("%s\n", entries[i].name);
         }
     }
 
-    for(int i = 0; i < num_entries; i++) {
-        free(names[i]);
-    }
     free(entries);
-    free(names);
 }
 
 void do_tree(int argc, char **argv) {
+    DirectoryHandle *dir = SimpleFS_openDirectory(cwd, argc == 2 ? argv[1] : ".");
+    if(!dir) {
+        fprintf(stderr, "%s: not found\n", argv[1]);
+        return;
+    }
+
     tree_prefix_cap = 64;
     tree_prefix = (char *) calloc(1, tree_prefix_cap * sizeof(char));
     ONERROR(tree_prefix == NULL, "calloc failed");
 
-    printf("%s\n", cwd->dcb->fcb.name);
-    tree_aux(0);
+    printf("%s\n", dir->dcb->fcb.name);
+    tree_aux(dir, 0);
 
     free(tree_prefix);
     tree_prefix = NULL;
+    SimpleFS_closeDirectory(dir);
 }
 
 void do_cat(int argc, char **argv) {
     char buf[512];
-    FileHandle *fh = SimpleFS_openFile(cwd, argv[1]);
+    FileHandle *fh = SimpleFS_openPath(cwd, argv[1]);
     if(!fh) {
         fprintf(stderr, "%s: not found\n", argv[1]);
         return;
@@ -271,11 +283,16 @@ void do_cat(int argc, char **argv) {
 }
 
 void do_write(int argc, char **argv) {
-    FileHandle *fh = SimpleFS_openFile(cwd, argv[1]);
+    FileHandle *fh = SimpleFS_openPath(cwd, argv[1]);
     if(!fh) {
 
         // File not found, try to create it
-        fh = SimpleFS_createFile(cwd, argv[1]);
+        char *name;
+        DirectoryHandle *parent = open_parent(argv[1], &name);
+        if(parent) {
+            fh = SimpleFS_createFile(parent, name);
+            SimpleFS_closeDirectory(parent);
+        }
 
         if(!fh) {
             fprintf(stderr, "%s: file creation failed\n", argv[1]);
@@ -295,9 +312,18 @@ void do_write(int argc, char **argv) {
 }
 
 void do_rm(int argc, char **argv) {
-    if(SimpleFS_remove(cwd, argv[1]) == -1) {
+    char *name;
+    DirectoryHandle *parent = open_parent(argv[1], &name);
+    if(!parent || SimpleFS_remove(parent, name) == -1) {
         fprintf(stderr, "Operation failed\n");
     }
+    if(parent) SimpleFS_closeDirectory(parent);
+
+    // The current directory may have just been removed
+    if(cwd->unlinked) {
+        SimpleFS_changeDir(cwd, "/");
+        strcpy(cwd_path, "/");
+    }
 }
 
 void do_help(int argc, char **argv);
@@ -307,22 +333,23 @@ typedef struct {
     char *name;
     handler_fn fn;
     int num_arguments;
+    int optional_arguments;
     char *argument_names;
     char *description;
 } handler_t;
 
 handler_t handlers[] = {
-    {"mkdir",  do_mkdir, 1, "<dir>", "create directory <dir> in the current directory"},
-    {"touch",  do_touch, 1, "<file>", "create empty file <file> in the current directory"},
-    {"cd",     do_cd, 1, "<dir>", "move in directory <dir> from the current directory"},
-    {"ls",     do_ls, 0, "", "print the contents of the current directory"},
-    {"tree",   do_tree, 0, "", "recursively print the contents of the current directory"},
-    {"cat",    do_cat, 1, "<file>", "print the contents of file <file>"},
-    {"write",  do_write, 2, "<file> <data>", "append <data> at the end of <file>, creating it if necessary"},
-    {"rm",     do_rm, 1, "<file|dir>", "remove the specified file or directory"},
-    {"format", do_format, 0, "", "format the filesystem"},
-    {"help",   do_help, 0, "", "print this message"},
-    {"exit",   NULL, 0, "", "exit the shell"}
+    {"mkdir",  do_mkdir, 1, 0, "<dir>", "create directory <dir>"},
+    {"touch",  do_touch, 1, 0, "<file>", "create empty file <file>"},
+    {"cd",     do_cd, 1, 0, "<dir>", "move in directory <dir>"},
+    {"ls",     do_ls, 0, 1, "[dir]", "print the contents of the current directory (or <dir>)"},
+    {"tree",   do_tree, 0, 1, "[dir]", "recursively print the contents of the current directory (or <dir>)"},
+    {"cat",    do_cat, 1, 0, "<file>", "print the contents of file <file>"},
+    {"write",  do_write, 2, 0, "<file> <data>", "append <data> at the end of <file>, creating it if necessary"},
+    {"rm",     do_rm, 1, 0, "<file|dir>", "remove the specified file or directory"},
+    {"format", do_format, 0, 0, "", "format the filesystem"},
+    {"help",   do_help, 0, 0, "", "print this message"},
+    {"exit",   NULL, 0, 0, "", "exit the shell"}
 };
 
 void do_help(int argc, char **argv) {
@@ -425,6 +452,8 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Error opening filesystem\n");
         exit(EXIT_FAILURE);
     }
+    // Free the blocks of the removed directories in the background
+    SimpleFS_startReclaimer(&fs);
 
     cwd_path_cap = 64;
     cwd_path = (char *) calloc(sizeof(char), cwd_path_cap);
@@ -435,6 +464,8 @@ int main(int argc, char **argv) {
         bzero(cmd, sizeof(cmd));
 
         printf(BOLDBLUE "%s" ENDCOLOR "$ ", cwd_path);
+        fflush(stdout);
+
         if(fgets(cmd, sizeof(cmd), stdin) == 0) {
             // Ctrl+D
             puts("");
@@ -461,7 +492,9 @@ int main(int argc, char **argv) {
                 } else {
 
                     // Right number of arguments?
-                    if(num_tokens != handlers[i].num_arguments + 1) {
+                    int num_arguments = num_tokens - 1;
+                    if(num_arguments < handlers[i].num_arguments ||
+                        num_arguments > handlers[i].num_arguments + handlers[i].optional_arguments) {
                         fprintf(stderr, "Usage: %s %s\n", handlers[i].name, handlers[i].argument_names);
                     } else {
                         handlers[i].fn(num_tokens, parsed);
@@ -480,5 +513,6 @@ int main(int argc, char **argv) {
     }
 
     free(cwd_path);
-    DiskDriver_flush(&disk);
+    SimpleFS_destroy(&fs);
+    DiskDriver_close(&disk);
 }
@@ -1,6 +1,12 @@
 #include "bitmap.h"
+#include "util.h"
 #include <assert.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 BitMapEntryKey BitMap_blockToIndex(int num) {
     BitMapEntryKey key;
@@ -13,23 +19,124 @@ int BitMap_indexToBlock(int entry, uint8_t bit_num) {
     return (entry << 3) | bit_num;
 }
 
+// Returns the 64 bits starting at bit 64 * word, bit i of the result being
+// bit 64 * word + i of the bitmap. Bytes past the end of the bitmap read as 0
+static uint64_t BitMap_loadWord(BitMap *bmap, int word) {
+    int num_bytes = (bmap->num_bits + 7) >> 3;
+    int offset = word << 3;
+    uint64_t w = 0;
+    memcpy(&w, bmap->entries + offset, min(8, num_bytes - offset));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    w = __builtin_bswap64(w);
+#endif
+    return w;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BITMAP_AVX2
+
+static bool BitMap_hasAvx2(void) {
+    static int has_avx2 = -1;
+    if(has_avx2 == -1) {
+        __builtin_cpu_init();
+        has_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    return has_avx2;
+}
+
+// Skips the 32 bytes chunks made only of full bytes, starting from the given
+// word and without reading past end_word.
+// returns the first word of the chunk where the scan stopped
+__attribute__((target("avx2")))
+static int BitMap_skipAvx2(BitMap *bmap, int word, int end_word, char full) {
+    __m256i pattern = _mm256_set1_epi8(full);
+    int byte = word << 3, end_byte = end_word << 3;
+    while(byte + 32 <= end_byte) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *) (bmap->entries + byte));
+        if(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, pattern)) != -1) break;
+        byte += 32;
+    }
+    return byte >> 3;
+}
+#endif
+
 int BitMap_find(BitMap* bmap, int start, int status) {
     if(start < 0 || start >= bmap->num_bits) return -1;
 
-    int pos = start;
-    while(pos < bmap->num_bits) {
-        
-        BitMapEntryKey key = BitMap_blockToIndex(pos);
-        if(((bmap->entries[key.entry_num] >> key.bit_num) & 1) == status) {
-            return pos;
+    // Look for a set bit in each word, after flipping it if searching for a 0
+    uint64_t flip = status ? 0 : ~(uint64_t) 0;
+    int num_words = (bmap->num_bits + 63) >> 6;
+    int word = start >> 6;
+    uint64_t w = (BitMap_loadWord(bmap, word) ^ flip) & (~(uint64_t) 0 << (start & 63));
+
+    while(w == 0) {
+        if(++word == num_words) return -1;
+#if defined(BITMAP_AVX2)
+        // Only whole words are safe to load, the last one may be partial
+        if(num_words - word > 4 && BitMap_hasAvx2()) {
+            word = BitMap_skipAvx2(bmap, word, (bmap->num_bits >> 3) >> 3, status ? 0 : 0xff);
+            if(word == num_words) return -1;
         }
+#endif
+        w = BitMap_loadWord(bmap, word) ^ flip;
+    }
+
+    // The bytes past the end of the bitmap read as 0, so ignore what's found there
+    int pos = (word << 6) + __builtin_ctzll(w);
+    return pos < bmap->num_bits ? pos : -1;
+}
+
+int BitMap_findRun(BitMap* bmap, int start, int status, int min_len, int max_len, int *len) {
+    if(min_len < 1 || max_len < min_len) return -1;
+
+    int pos = BitMap_find(bmap, start, status);
+    while(pos != -1) {
+        // The run ends at the first bit with the other status
+        int end = BitMap_find(bmap, pos, !status);
+        if(end == -1) end = bmap->num_bits;
 
-        pos++;
+        if(end - pos >= min_len) {
+            *len = min(end - pos, max_len);
+            return pos;
+        }
+        pos = end < bmap->num_bits ? BitMap_find(bmap, end, status) : -1;
     }
 
     return -1;
 }
 
+int BitMap_setRange(BitMap* bmap, int start, int count, int status) {
+    if(start < 0 || count < 0 || start > bmap->num_bits - count) return -1;
+
+    int pos = start, end = start + count;
+
+    // Single bits up to the first whole byte, then whole bytes, then the remaining bits
+    for(; pos < end && (pos & 7); pos++) BitMap_set(bmap, pos, status);
+    int num_bytes = (end - pos) >> 3;
+    memset(bmap->entries + (pos >> 3), status ? 0xff : 0, num_bytes);
+    pos += num_bytes << 3;
+    for(; pos < end; pos++) BitMap_set(bmap, pos, status);
+
+    return 0;
+}
+
+int BitMap_countRange(BitMap* bmap, int start, int count, int status) {
+    if(start < 0 || count < 0 || start > bmap->num_bits - count) return -1;
+    if(count == 0) return 0;
+
+    int end = start + count;
+    int first_word = start >> 6, last_word = (end - 1) >> 6;
+    int set = 0;
+    for(int word = first_word; word <= last_word; word++) {
+        uint64_t w = BitMap_loadWord(bmap, word);
+        if(word == first_word) w &= ~(uint64_t) 0 << (start & 63);
+        if(word == last_word && (end & 63)) w &= ~(~(uint64_t) 0 << (end & 63));
+        set += __builtin_popcountll(w);
+    }
+
+    return status ? set : count - set;
+}
+
 int BitMap_set(BitMap* bmap, int pos, int status) {
     if(pos < 0 || pos >= bmap->num_bits) return -1;
     BitMapEntryKey key = BitMap_blockToIndex(pos);
@@ -47,6 +154,60 @@ int BitMap_set(BitMap* bmap, int pos, int status) {
     return -1;
 }
 
+// Converts a word of the bitmap as stored in memory (bit i of the bitmap is
+// bit i & 7 of byte i >> 3) to one where bit i is the i-th bit, and back
+static uint64_t BitMap_swap(uint64_t w) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    w = __builtin_bswap64(w);
+#endif
+    return w;
+}
+
+// The word of the bitmap holding bit pos, and the mask of the bit inside it as stored in memory
+static uint64_t *BitMap_word(BitMap *bmap, int pos, uint64_t *mask) {
+    *mask = BitMap_swap((uint64_t) 1 << (pos & 63));
+    return (uint64_t *) bmap->entries + (pos >> 6);
+}
+
+int BitMap_testAndSet(BitMap* bmap, int pos, int status) {
+    if(pos < 0 || pos >= bmap->num_bits) return -1;
+    uint64_t mask;
+    uint64_t *word = BitMap_word(bmap, pos, &mask);
+
+    uint64_t old;
+    if(status) old = __atomic_fetch_or(word, mask, __ATOMIC_ACQ_REL);
+    else old = __atomic_fetch_and(word, ~mask, __ATOMIC_ACQ_REL);
+    return (old & mask) != 0;
+}
+
+int BitMap_claim(BitMap* bmap, int start, int end) {
+    if(start < 0 || end > bmap->num_bits) return -1;
+
+    // Jump to the next free bit, which may be taken by someone else by the time
+    // it's claimed: then try the other free bits of its word, and move on
+    while(start < end && (start = BitMap_find(bmap, start, 0)) != -1 && start < end) {
+        uint64_t mask;
+        uint64_t *word = BitMap_word(bmap, start, &mask);
+        int word_end = min((start | 63) + 1, end);
+        // The bits of the word before start and from word_end on are left alone
+        uint64_t range = ~(uint64_t) 0 << (start & 63);
+        if(word_end & 63) range &= ~(~(uint64_t) 0 << (word_end & 63));
+
+        uint64_t w = __atomic_load_n(word, __ATOMIC_RELAXED);
+        for(;;) {
+            uint64_t free = BitMap_swap(~w) & range;
+            if(free == 0) break;
+            int bit = __builtin_ctzll(free);
+            if(__atomic_compare_exchange_n(word, &w, w | BitMap_swap((uint64_t) 1 << bit),
+                false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                return ((start >> 6) << 6) + bit;
+            }
+        }
+        start = word_end;
+    }
+    return -1;
+}
+
 int BitMap_get(BitMap* bmap, int pos) {
     if(pos < 0 || pos >= bmap->num_bits) return -1;
     BitMapEntryKey key = BitMap_blockToIndex(pos);
@@ -55,7 +216,8 @@ int BitMap_get(BitMap* bmap, int pos) {
         return -1;
     }
 
-    return (bmap->entries[key.entry_num] >> key.bit_num) & 1;
+    // Atomic, as the bit may be changed at the same time by BitMap_testAndSet or BitMap_claim
+    return (__atomic_load_n(&bmap->entries[key.entry_num], __ATOMIC_RELAXED) >> key.bit_num) & 1;
 }
 
 void BitMap_print(BitMap *bmap) {
@@ -0,0 +1,194 @@
+#include "block_cache.h"
+#include "util.h"
+#include <stdio.h>
+#include <string.h>
+
+static int BlockCache_bucket(BlockCache *c, int block_num) {
+    // Knuth's multiplicative hash, the table size is a power of 2
+    return ((unsigned int) block_num * 2654435761u) & (c->num_buckets - 1);
+}
+
+// Remove the slot from the LRU list
+static void BlockCache_unlink(BlockCache *c, int slot) {
+    BlockCacheEntry *e = &c->entries[slot];
+    if(e->prev != -1) c->entries[e->prev].next = e->next;
+    else c->head = e->next;
+    if(e->next != -1) c->entries[e->next].prev = e->prev;
+    else c->tail = e->prev;
+    e->prev = e->next = -1;
+}
+
+// Insert the slot at the front of the LRU list
+static void BlockCache_pushFront(BlockCache *c, int slot) {
+    BlockCacheEntry *e = &c->entries[slot];
+    e->prev = -1;
+    e->next = c->head;
+    if(c->head != -1) c->entries[c->head].prev = slot;
+    c->head = slot;
+    if(c->tail == -1) c->tail = slot;
+}
+
+static int BlockCache_find(BlockCache *c, int block_num) {
+    int slot = c->buckets[BlockCache_bucket(c, block_num)];
+    while(slot != -1 && c->entries[slot].block_num != block_num) {
+        slot = c->entries[slot].hash_next;
+    }
+    return slot;
+}
+
+// Remove the slot from the hash table and from the LRU list, and put it in the free list
+static void BlockCache_release(BlockCache *c, int slot) {
+    BlockCacheEntry *e = &c->entries[slot];
+    int *link = &c->buckets[BlockCache_bucket(c, e->block_num)];
+    while(*link != slot) link = &c->entries[*link].hash_next;
+    *link = e->hash_next;
+
+    BlockCache_unlink(c, slot);
+    e->block_num = -1;
+    e->dirty = 0;
+    e->hash_next = -1;
+    e->next = c->free_slot;
+    c->free_slot = slot;
+}
+
+void BlockCache_init(BlockCache *c, int capacity, int block_size, BlockCache_writebackFn writeback, void *ctx) {
+    bzero(c, sizeof(BlockCache));
+    c->capacity = max(capacity, 0);
+    c->block_size = block_size;
+    c->writeback = writeback;
+    c->ctx = ctx;
+    c->head = c->tail = c->free_slot = -1;
+
+    if(c->capacity == 0) return;
+
+    c->num_buckets = 1;
+    while(c->num_buckets < 2 * c->capacity) c->num_buckets <<= 1;
+    c->buckets = (int *) malloc(c->num_buckets * sizeof(int));
+    ONERROR(c->buckets == NULL, "malloc failed");
+    memset(c->buckets, -1, c->num_buckets * sizeof(int));
+
+    c->entries = (BlockCacheEntry *) calloc(c->capacity, sizeof(BlockCacheEntry));
+    ONERROR(c->entries == NULL, "calloc failed");
+    for(int i = c->capacity - 1; i >= 0; i--) {
+        c->entries[i].data = (char *) malloc(block_size);
+        ONERROR(c->entries[i].data == NULL, "malloc failed");
+        c->entries[i].block_num = -1;
+        c->entries[i].prev = -1;
+        c->entries[i].hash_next = -1;
+        c->entries[i].next = c->free_slot;
+        c->free_slot = i;
+    }
+}
+
+int BlockCache_destroy(BlockCache *c) {
+    int res = BlockCache_flush(c);
+    for(int i = 0; i < c->capacity; i++) {
+        free(c->entries[i].data);
+    }
+    free(c->entries);
+    free(c->buckets);
+    c->entries = NULL;
+    c->buckets = NULL;
+    c->capacity = 0;
+    return res;
+}
+
+char *BlockCache_get(BlockCache *c, int block_num) {
+    if(c->capacity == 0) return NULL;
+
+    int slot = BlockCache_find(c, block_num);
+    if(slot == -1) {
+        c->misses++;
+        return NULL;
+    }
+
+    c->hits++;
+    BlockCache_unlink(c, slot);
+    BlockCache_pushFront(c, slot);
+    return c->entries[slot].data;
+}
+
+int BlockCache_put(BlockCache *c, int block_num, const void *data, int dirty) {
+    if(c->capacity == 0) return -1;
+
+    int slot = BlockCache_find(c, block_num);
+    if(slot != -1) {
+        BlockCache_unlink(c, slot);
+    } else {
+        if(c->free_slot == -1) {
+            // Evict the least recently used block
+            int victim = c->tail;
+            BlockCacheEntry *v = &c->entries[victim];
+            if(v->dirty) {
+                if(c->writeback(c->ctx, v->block_num, v->data) == -1) return -1;
+                c->writebacks++;
+            }
+            BlockCache_release(c, victim);
+        }
+
+        slot = c->free_slot;
+        c->free_slot = c->entries[slot].next;
+
+        int bucket = BlockCache_bucket(c, block_num);
+        c->entries[slot].block_num = block_num;
+        c->entries[slot].dirty = 0;
+        c->entries[slot].hash_next = c->buckets[bucket];
+        c->buckets[bucket] = slot;
+    }
+
+    BlockCacheEntry *e = &c->entries[slot];
+    memcpy(e->data, data, c->block_size);
+    e->dirty |= dirty;
+    BlockCache_pushFront(c, slot);
+    return 0;
+}
+
+void BlockCache_invalidate(BlockCache *c, int block_num) {
+    if(c->capacity == 0) return;
+
+    int slot = BlockCache_find(c, block_num);
+    if(slot != -1) BlockCache_release(c, slot);
+}
+
+int BlockCache_evict(BlockCache *c, int block_num) {
+    if(c->capacity == 0) return 0;
+
+    int slot = BlockCache_find(c, block_num);
+    if(slot == -1) return 0;
+
+    BlockCacheEntry *e = &c->entries[slot];
+    if(e->dirty) {
+        if(c->writeback(c->ctx, e->block_num, e->data) == -1) return -1;
+        c->writebacks++;
+    }
+    BlockCache_release(c, slot);
+    return 0;
+}
+
+int BlockCache_flush(BlockCache *c) {
+    for(int slot = c->head; slot != -1; slot = c->entries[slot].next) {
+        BlockCacheEntry *e = &c->entries[slot];
+        if(!e->dirty) continue;
+        if(c->writeback(c->ctx, e->block_num, e->data) == -1) return -1;
+        e->dirty = 0;
+        c->writebacks++;
+    }
+    return 0;
+}
+
+void BlockCache_print(BlockCache *c) {
+    int used = 0, dirty = 0;
+    for(int slot = c->head; slot != -1; slot = c->entries[slot].next) {
+        used++;
+        if(c->entries[slot].dirty) dirty++;
+    }
+
+    printf("BlockCache(\n");
+    printf("  capacity = %d,\n", c->capacity);
+    printf("  used = %d,\n", used);
+    printf("  dirty = %d,\n", dirty);
+    printf("  hits = %ld,\n", c->hits);
+    printf("  misses = %ld,\n", c->misses);
+    printf("  writebacks = %ld\n", c->writebacks);
+    printf(")\n");
+}
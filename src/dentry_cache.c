@@ -0,0 +1,167 @@
+#include "dentry_cache.h"
+#include "util.h"
+#include <stdio.h>
+#include <string.h>
+
+static int DentryCache_bucket(DentryCache *c, int parent, unsigned int hash) {
+    // Mix the parent into the name hash, the table size is a power of 2
+    return (hash ^ ((unsigned int) parent * 2654435761u)) & (c->num_buckets - 1);
+}
+
+// Remove the slot from the LRU list
+static void DentryCache_unlink(DentryCache *c, int slot) {
+    DentryCacheEntry *e = &c->entries[slot];
+    if(e->prev != -1) c->entries[e->prev].next = e->next;
+    else c->head = e->next;
+    if(e->next != -1) c->entries[e->next].prev = e->prev;
+    else c->tail = e->prev;
+    e->prev = e->next = -1;
+}
+
+// Insert the slot at the front of the LRU list
+static void DentryCache_pushFront(DentryCache *c, int slot) {
+    DentryCacheEntry *e = &c->entries[slot];
+    e->prev = -1;
+    e->next = c->head;
+    if(c->head != -1) c->entries[c->head].prev = slot;
+    c->head = slot;
+    if(c->tail == -1) c->tail = slot;
+}
+
+static int DentryCache_find(DentryCache *c, int parent, const char *name, unsigned int hash) {
+    int slot = c->buckets[DentryCache_bucket(c, parent, hash)];
+    while(slot != -1) {
+        DentryCacheEntry *e = &c->entries[slot];
+        if(e->parent == parent && e->hash == hash && !strcmp(e->name, name)) break;
+        slot = e->hash_next;
+    }
+    return slot;
+}
+
+// Remove the slot from the hash table and from the LRU list, and put it in the free list
+static void DentryCache_release(DentryCache *c, int slot) {
+    DentryCacheEntry *e = &c->entries[slot];
+    int *link = &c->buckets[DentryCache_bucket(c, e->parent, e->hash)];
+    while(*link != slot) link = &c->entries[*link].hash_next;
+    *link = e->hash_next;
+
+    DentryCache_unlink(c, slot);
+    e->parent = -1;
+    e->hash_next = -1;
+    e->next = c->free_slot;
+    c->free_slot = slot;
+}
+
+void DentryCache_init(DentryCache *c, int capacity) {
+    bzero(c, sizeof(DentryCache));
+    c->capacity = max(capacity, 0);
+    c->head = c->tail = c->free_slot = -1;
+
+    if(c->capacity == 0) return;
+
+    c->num_buckets = 1;
+    while(c->num_buckets < 2 * c->capacity) c->num_buckets <<= 1;
+    c->buckets = (int *) malloc(c->num_buckets * sizeof(int));
+    ONERROR(c->buckets == NULL, "malloc failed");
+
+    c->entries = (DentryCacheEntry *) calloc(c->capacity, sizeof(DentryCacheEntry));
+    ONERROR(c->entries == NULL, "calloc failed");
+    DentryCache_clear(c);
+}
+
+void DentryCache_destroy(DentryCache *c) {
+    free(c->entries);
+    free(c->buckets);
+    c->entries = NULL;
+    c->buckets = NULL;
+    c->capacity = 0;
+}
+
+DentryCacheEntry *DentryCache_get(DentryCache *c, int parent, const char *name, unsigned int hash) {
+    if(c->capacity == 0) return NULL;
+
+    int slot = DentryCache_find(c, parent, name, hash);
+    if(slot == -1) {
+        c->misses++;
+        return NULL;
+    }
+
+    c->hits++;
+    DentryCache_unlink(c, slot);
+    DentryCache_pushFront(c, slot);
+    return &c->entries[slot];
+}
+
+void DentryCache_put(DentryCache *c, int parent, const char *name, unsigned int hash, int block, int is_dir, int size_in_bytes) {
+    if(c->capacity == 0 || strlen(name) >= DENTRY_NAME_LEN) return;
+
+    int slot = DentryCache_find(c, parent, name, hash);
+    if(slot != -1) {
+        DentryCache_unlink(c, slot);
+    } else {
+        // Replace the least recently used entry if the cache is full
+        if(c->free_slot == -1) DentryCache_release(c, c->tail);
+
+        slot = c->free_slot;
+        c->free_slot = c->entries[slot].next;
+
+        int bucket = DentryCache_bucket(c, parent, hash);
+        DentryCacheEntry *e = &c->entries[slot];
+        e->parent = parent;
+        e->hash = hash;
+        strcpy(e->name, name);
+        e->hash_next = c->buckets[bucket];
+        c->buckets[bucket] = slot;
+    }
+
+    DentryCacheEntry *e = &c->entries[slot];
+    e->block = block;
+    e->is_dir = is_dir;
+    e->size_in_bytes = size_in_bytes;
+    DentryCache_pushFront(c, slot);
+}
+
+void DentryCache_invalidate(DentryCache *c, int parent, const char *name, unsigned int hash) {
+    if(c->capacity == 0) return;
+
+    int slot = DentryCache_find(c, parent, name, hash);
+    if(slot != -1) DentryCache_release(c, slot);
+}
+
+void DentryCache_invalidateDir(DentryCache *c, int parent) {
+    for(int slot = c->head; slot != -1; ) {
+        int next = c->entries[slot].next;
+        if(c->entries[slot].parent == parent) DentryCache_release(c, slot);
+        slot = next;
+    }
+}
+
+void DentryCache_clear(DentryCache *c) {
+    if(c->capacity == 0) return;
+
+    memset(c->buckets, -1, c->num_buckets * sizeof(int));
+    c->head = c->tail = c->free_slot = -1;
+    for(int i = c->capacity - 1; i >= 0; i--) {
+        c->entries[i].parent = -1;
+        c->entries[i].prev = -1;
+        c->entries[i].hash_next = -1;
+        c->entries[i].next = c->free_slot;
+        c->free_slot = i;
+    }
+}
+
+void DentryCache_print(DentryCache *c) {
+    int used = 0, negative = 0;
+    for(int slot = c->head; slot != -1; slot = c->entries[slot].next) {
+        used++;
+        if(c->entries[slot].block == -1) negative++;
+    }
+
+    printf("DentryCache(\n");
+    printf("  capacity = %d,\n", c->capacity);
+    printf("  used = %d,\n", used);
+    printf("  negative = %d,\n", negative);
+    printf("  hits = %ld,\n", c->hits);
+    printf("  misses = %ld\n", c->misses);
+    printf(")\n");
+}
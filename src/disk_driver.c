@@ -7,16 +7,258 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+// Offset of a block in the backing file
+static off_t DiskDriver_offset(DiskDriver* disk, int block_num) {
+    return disk->metadata_size + (off_t) block_num * disk->block_size;
+}
+
+// Address of a block inside the mmapped image
+static char* DiskDriver_blockAddress(DiskDriver* disk, int block_num) {
+    return (char *) disk->header + DiskDriver_offset(disk, block_num);
+}
+
+// Whether the block is mapped. The pins can be dropped at any time without
+// the lock, but the first one is only taken with the lock held
+static bool DiskDriver_pinned(DiskDriver* disk, int block_num) {
+    return __atomic_load_n(&disk->pins[block_num], __ATOMIC_ACQUIRE) > 0;
+}
+
+// Transfer the buffers in iov from/to the backing file, starting at offset.
+// Short transfers are resumed where they stopped, so iov is modified
+static int DiskDriver_transfer(DiskDriver* disk, struct iovec* iov, int iovcnt, off_t offset, bool is_write) {
+    while(iovcnt > 0) {
+        ssize_t res;
+        if(is_write) res = pwritev(disk->fd, iov, iovcnt, offset);
+        else res = preadv(disk->fd, iov, iovcnt, offset);
+
+        if(res == -1 && (errno == EAGAIN || errno == EINTR)) continue;
+        if(res <= 0) return -1;
+        offset += res;
+
+        // Skip the buffers that were transferred completely
+        while(iovcnt > 0 && (size_t) res >= iov->iov_len) {
+            res -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if(iovcnt > 0) {
+            iov->iov_base += res;
+            iov->iov_len -= res;
+        }
+    }
+    return 0;
+}
+
+// Read a block from the backing file, bypassing the cache
+static int DiskDriver_loadBlock(DiskDriver* disk, void* dest, int block_num) {
+    struct iovec iov = { dest, disk->block_size };
+    return DiskDriver_transfer(disk, &iov, 1, DiskDriver_offset(disk, block_num), false);
+}
+
+// Write a block to the backing file, bypassing the cache. Also used
+// by the cache to write back dirty blocks
+static int DiskDriver_storeBlock(void* ctx, int block_num, const void* src) {
+    DiskDriver* disk = (DiskDriver *) ctx;
+    struct iovec iov = { (void *) src, disk->block_size };
+    return DiskDriver_transfer(disk, &iov, 1, DiskDriver_offset(disk, block_num), true);
+}
+
+// Transfer a run of contiguous blocks starting at offset. The run is queued
+// on the ring if available, otherwise it's transferred right away. In both
+// cases errors are reported by DiskDriver_complete
+static void DiskDriver_submitRun(DiskDriver* disk, struct iovec* iov, int iovcnt, off_t offset, bool is_write) {
+    if(IoRing_queue(&disk->ring, disk->fd, iov, iovcnt, offset, is_write) == 0) return;
+    if(DiskDriver_transfer(disk, iov, iovcnt, offset, is_write) == -1) disk->io_failed = true;
+}
+
+static int DiskDriver_completeLocked(DiskDriver* disk);
+static int DiskDriver_getFreeBlockLocked(DiskDriver* disk, int start);
+
+// Transfer count blocks from/to the buffers in bufs, merging the runs
+// of contiguous blocks in a single request, and wait for the transfer.
+// If tails isn't NULL, only the first split bytes of each block are in bufs[i],
+// the rest of the block is in tails[i].
+// If use_cache is set, the cached blocks are copied from the cache
+// and aren't part of the runs
+static int DiskDriver_transferBlocks(DiskDriver* disk, void** bufs, void** tails, int split, const int* block_nums,
+        int count, bool is_write, bool use_cache) {
+    struct iovec iov[IO_RING_MAX_IOV];
+    int iovcnt = 0, last_block = -1;
+    int iov_per_block = tails ? 2 : 1;
+    off_t offset = 0;
+
+    for(int i = 0; i < count; i++) {
+        if(use_cache) {
+            char *cached = BlockCache_get(&disk->cache, block_nums[i]);
+            if(cached) {
+                memcpy(bufs[i], cached, disk->block_size);
+                continue;
+            }
+        }
+
+        // Submit the current run if this block can't be appended to it
+        if(iovcnt > 0 && (block_nums[i] != last_block + 1 || iovcnt + iov_per_block > IO_RING_MAX_IOV)) {
+            DiskDriver_submitRun(disk, iov, iovcnt, offset, is_write);
+            iovcnt = 0;
+        }
+
+        if(iovcnt == 0) offset = DiskDriver_offset(disk, block_nums[i]);
+        if(tails) {
+            iov[iovcnt++] = (struct iovec) { bufs[i], split };
+            iov[iovcnt++] = (struct iovec) { tails[i], disk->block_size - split };
+        } else {
+            iov[iovcnt++] = (struct iovec) { bufs[i], disk->block_size };
+        }
+        last_block = block_nums[i];
+    }
+
+    if(iovcnt > 0) DiskDriver_submitRun(disk, iov, iovcnt, offset, is_write);
+    return DiskDriver_completeLocked(disk);
+}
+
+// Slot of the calling thread in DiskDriver.cursors. The first thread
+// gets slot 0, the next ones the other slots in turn
+static int DiskDriver_slot(void) {
+    static int next_slot = 0;
+    static __thread int slot = -1;
+    if(slot == -1) slot = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED) % DISK_ALLOC_SLOTS;
+    return slot;
+}
+
+// The counters of the free blocks and the cursors are updated with atomic
+// operations, as DiskDriver_allocBlockNear doesn't take the lock
+
+static int DiskDriver_groupFree(DiskDriver* disk, int group) {
+    return __atomic_load_n(&disk->group_free[group], __ATOMIC_RELAXED);
+}
+
+// Update the free blocks counters after block_num was claimed in the bitmap.
+// The next allocation without a hint of this thread starts looking after it
+static void DiskDriver_claimed(DiskDriver* disk, int block_num) {
+    __atomic_fetch_sub(&disk->header->free_blocks, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&disk->group_free[block_num / DISK_GROUP_BLOCKS], 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&disk->cursors[DiskDriver_slot()], (block_num + 1) % disk->bitmap.num_bits, __ATOMIC_RELAXED);
+}
+
+// Mark a free block as used, keeping the free blocks counters in sync with the bitmap
+// returns false if the block was already used
+static bool DiskDriver_markUsed(DiskDriver* disk, int block_num) {
+    if(BitMap_testAndSet(&disk->bitmap, block_num, 1) != 0) return false;
+    DiskDriver_claimed(disk, block_num);
+    return true;
+}
+
+// Where to start looking for free blocks, given an allocation hint
+static int DiskDriver_hintStart(DiskDriver* disk, int hint) {
+    if(hint == DISK_NO_HINT) return __atomic_load_n(&disk->cursors[DiskDriver_slot()], __ATOMIC_RELAXED);
+    if(hint < 0 || hint >= disk->bitmap.num_bits) return 0;
+    return hint;
+}
+
+// Mark a used block as free, keeping the free blocks counters in sync with the bitmap
+static void DiskDriver_markFree(DiskDriver* disk, int block_num) {
+    if(BitMap_testAndSet(&disk->bitmap, block_num, 0) != 1) return;
+    __atomic_fetch_add(&disk->header->free_blocks, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&disk->group_free[block_num / DISK_GROUP_BLOCKS], 1, __ATOMIC_RELAXED);
+}
+
+// Mark the len blocks from pos as used. Some of them may have been taken by
+// DiskDriver_allocBlockNear (which doesn't take the lock) since they were
+// found free: the run is cut short before the first one taken, or
+// released if it would be shorter than min_len
+// returns false if the run was released
+static bool DiskDriver_markRun(DiskDriver* disk, int pos, int min_len, int *len) {
+    for(int i = 0; i < *len; i++) {
+        if(DiskDriver_markUsed(disk, pos + i)) continue;
+
+        if(i >= min_len) {
+            *len = i;
+            return true;
+        }
+        while(i-- > 0) DiskDriver_markFree(disk, pos + i);
+        return false;
+    }
+    return true;
+}
+
+// Count the free blocks in each group
+static void DiskDriver_buildSummary(DiskDriver* disk) {
+    int num_blocks = disk->bitmap.num_bits;
+    disk->num_groups = (num_blocks + DISK_GROUP_BLOCKS - 1) / DISK_GROUP_BLOCKS;
+    disk->group_free = (int *) malloc(disk->num_groups * sizeof(int));
+    ONERROR(disk->group_free == NULL, "malloc failed");
+
+    for(int group = 0; group < disk->num_groups; group++) {
+        int first = group * DISK_GROUP_BLOCKS;
+        int count = min(DISK_GROUP_BLOCKS, num_blocks - first);
+        disk->group_free[group] = BitMap_countRange(&disk->bitmap, first, count, 0);
+    }
+}
+
+static bool DiskDriver_validBlockSize(int block_size) {
+    // Powers of 2 only, so that blocks and memory pages are aligned to each other
+    return block_size >= DISK_MIN_BLOCK_SIZE && block_size <= DISK_MAX_BLOCK_SIZE &&
+        (block_size & (block_size - 1)) == 0;
+}
+
+// Size of the metadata before the data blocks, rounded up to a whole block
+static int DiskDriver_metadataSize(int bitmap_size, int header_size, int block_size) {
+    return ((bitmap_size + header_size + block_size - 1) / block_size) * block_size;
+}
+
+// The disks created before the block size and the version were stored have a
+// header of 4 ints, the second one a copy of num_blocks, with the bitmap right
+// after it. The block size field is then the start of the bitmap, which can't be
+// a valid size: the bitmap is empty or has block 0 (the top level directory) used
+static bool DiskDriver_isUnversioned(DiskHeader* header) {
+    return header->free_queue == header->num_blocks && !DiskDriver_validBlockSize(header->block_size);
+}
+
+// Move the bitmap of an unversioned disk behind the full header, and the data
+// blocks too if the larger header makes the metadata take one more block.
+// The result is a disk of version 1, which had the same blocks of BLOCK_SIZE bytes
+static void DiskDriver_upgradeUnversioned(int fd, DiskHeader* header) {
+    DBGPRINT("moving the bitmap of an unversioned disk");
+    int num_blocks = header->num_blocks;
+    int bitmap_size = (num_blocks + 7) / 8;
+    int old_metadata_size = DiskDriver_metadataSize(bitmap_size, DISK_UNVERSIONED_HEADER_SIZE, BLOCK_SIZE);
+    int metadata_size = DiskDriver_metadataSize(bitmap_size, sizeof(DiskHeader), BLOCK_SIZE);
+    ssize_t res;
+
+    // From the last block, so that none is overwritten before it's moved
+    if(metadata_size != old_metadata_size) {
+        char block[BLOCK_SIZE];
+        for(int i = num_blocks - 1; i >= 0; i--) {
+            res = pread(fd, block, BLOCK_SIZE, old_metadata_size + (off_t) i * BLOCK_SIZE);
+            ONERROR(res != BLOCK_SIZE, "Can't read block %d", i);
+            res = pwrite(fd, block, BLOCK_SIZE, metadata_size + (off_t) i * BLOCK_SIZE);
+            ONERROR(res != BLOCK_SIZE, "Can't write block %d", i);
+        }
+    }
+
+    char *bitmap = (char *) malloc(bitmap_size);
+    ONERROR(bitmap == NULL, "malloc failed");
+    res = pread(fd, bitmap, bitmap_size, DISK_UNVERSIONED_HEADER_SIZE);
+    ONERROR(res != bitmap_size, "Can't read the bitmap");
+    res = pwrite(fd, bitmap, bitmap_size, sizeof(DiskHeader));
+    ONERROR(res != bitmap_size, "Can't write the bitmap");
+    free(bitmap);
+
+    header->block_size = BLOCK_SIZE;
+    header->version = 1;
+    res = pwrite(fd, header, sizeof(DiskHeader), 0);
+    ONERROR(res != sizeof(DiskHeader), "Can't write the disk header");
+}
+
 void DiskDriver_init(DiskDriver* disk, const char* filename, int num_blocks) {
+    DiskDriver_initWithBlockSize(disk, filename, num_blocks, BLOCK_SIZE);
+}
 
-    int bitmap_size = (num_blocks + 7) / 8; // round up
-    int metadata_size = bitmap_size + sizeof(DiskHeader);
-    // Round the metadata size so that the data blocks are BLOCK_SIZE bytes aligned
-    metadata_size = ((metadata_size + BLOCK_SIZE - 1) / BLOCK_SIZE) * BLOCK_SIZE;
-    int total_size = metadata_size + num_blocks * BLOCK_SIZE;
+void DiskDriver_initWithBlockSize(DiskDriver* disk, const char* filename, int num_blocks, int block_size) {
 
     bool is_new_file = false;
 
@@ -25,13 +267,40 @@ void DiskDriver_init(DiskDriver* disk, const char* filename, int num_blocks) {
     if(fd != -1) {
         // New file
         DBGPRINT("creating new file");
-        int res = ftruncate(fd, total_size);
-        ONERROR(res == -1, "Can't resize file");
+        ONERROR(!DiskDriver_validBlockSize(block_size), "invalid block size %d", block_size);
         is_new_file = true;
     } else {
         DBGPRINT("opening existing file");
         fd = open(filename, O_RDWR);
         ONERROR(fd == -1, "Can't open backing file");
+
+        // The block size of an existing disk is the one chosen when it was created
+        DiskHeader header;
+        ssize_t res = pread(fd, &header, sizeof(DiskHeader), 0);
+        ONERROR(res != sizeof(DiskHeader), "Can't read the disk header");
+        if(DiskDriver_isUnversioned(&header)) DiskDriver_upgradeUnversioned(fd, &header);
+        ONERROR(header.version < DISK_MIN_VERSION || header.version > DISK_VERSION,
+            "unsupported disk format (version %d, expected %d to %d)",
+            header.version, DISK_MIN_VERSION, DISK_VERSION);
+        ONERROR(!DiskDriver_validBlockSize(header.block_size), "file has an invalid block size (%d)",
+            header.block_size);
+        block_size = header.block_size;
+    }
+
+    int bitmap_size = (num_blocks + 7) / 8; // round up
+    // Round the metadata size so that the data blocks are block_size bytes aligned
+    int metadata_size = DiskDriver_metadataSize(bitmap_size, sizeof(DiskHeader), block_size);
+    size_t total_size = metadata_size + (size_t) num_blocks * block_size;
+
+    if(is_new_file) {
+        int res = ftruncate(fd, total_size);
+        ONERROR(res == -1, "Can't resize file");
+    } else {
+        struct stat st;
+        int res = fstat(fd, &st);
+        ONERROR(res == -1, "Can't stat backing file");
+        ONERROR(st.st_size < total_size, "file is too small (%ld bytes, expected %zu)",
+            (long) st.st_size, total_size);
     }
 
     char *metadata = mmap(NULL, total_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
@@ -41,13 +310,27 @@ void DiskDriver_init(DiskDriver* disk, const char* filename, int num_blocks) {
     disk->header = (DiskHeader *) metadata;
     disk->bitmap.entries = metadata + sizeof(DiskHeader);
     disk->bitmap.num_bits = num_blocks;
+    disk->block_size = block_size;
     disk->metadata_size = metadata_size;
+    disk->map_size = total_size;
+    disk->pins = (uint16_t *) calloc(num_blocks, sizeof(uint16_t));
+    ONERROR(disk->pins == NULL, "calloc failed");
+    BlockCache_init(&disk->cache, DISK_CACHE_BLOCKS, block_size, DiskDriver_storeBlock, disk);
+    disk->io_failed = false;
+    disk->blocks_written = 0;
+    disk->blocks_prefetched = 0;
+    pthread_mutex_init(&disk->lock, NULL);
+    if(IoRing_init(&disk->ring) == 0) {
+        DBGPRINT("using io_uring");
+    }
 
     if(is_new_file) {
         disk->header->num_blocks = num_blocks;
         disk->header->free_blocks = num_blocks;
         disk->header->bitmap_entries = bitmap_size;
-        disk->header->bitmap_blocks = num_blocks;
+        disk->header->free_queue = -1;
+        disk->header->block_size = block_size;
+        disk->header->version = DISK_VERSION;
 
         bzero(disk->bitmap.entries, bitmap_size);
     } else {
@@ -56,84 +339,473 @@ void DiskDriver_init(DiskDriver* disk, const char* filename, int num_blocks) {
             disk->header->num_blocks, num_blocks);
         ONERROR(disk->header->free_blocks > num_blocks, "file has more free blocks (%d) than total blocks (%d)",
             disk->header->free_blocks, num_blocks);
-        ONERROR(disk->header->bitmap_blocks != num_blocks, "bitmap size (%d) doesn't match total number of blocks (%d)",
-            disk->header->bitmap_blocks, num_blocks);
+        ONERROR(disk->header->version < 4 && disk->header->free_queue != num_blocks,
+            "bitmap size (%d) doesn't match total number of blocks (%d)", disk->header->free_queue, num_blocks);
+        ONERROR(disk->header->version >= 4 && disk->header->free_queue >= num_blocks,
+            "invalid free queue (%d)", disk->header->free_queue);
+    }
+
+    DiskDriver_buildSummary(disk);
+    // The threads start from different parts of the disk
+    for(int slot = 0; slot < DISK_ALLOC_SLOTS; slot++) {
+        disk->cursors[slot] = (int) ((long) slot * num_blocks / DISK_ALLOC_SLOTS);
     }
 }
 
-int DiskDriver_readBlock(DiskDriver* disk, void* dest, int block_num) {
+int DiskDriver_close(DiskDriver* disk) {
+    int res = DiskDriver_flush(disk);
+    IoRing_destroy(&disk->ring);
+    BlockCache_destroy(&disk->cache);
+    free(disk->pins);
+    disk->pins = NULL;
+    free(disk->group_free);
+    disk->group_free = NULL;
+    pthread_mutex_destroy(&disk->lock);
+    munmap(disk->header, disk->map_size);
+    close(disk->fd);
+    disk->header = NULL;
+    disk->bitmap.entries = NULL;
+    disk->fd = -1;
+    return res;
+}
+
+static int DiskDriver_setCacheCapacityLocked(DiskDriver* disk, int capacity) {
+    // Nothing is dropped until all the dirty blocks are on the disk,
+    // a failed resize leaves the old cache as it was
+    if(BlockCache_flush(&disk->cache) == -1) return -1;
+    BlockCache_destroy(&disk->cache);
+    BlockCache_init(&disk->cache, capacity, disk->block_size, DiskDriver_storeBlock, disk);
+    return 0;
+}
+
+static int DiskDriver_readBlockLocked(DiskDriver* disk, void* dest, int block_num) {
 
     int status = BitMap_get(&disk->bitmap, block_num);
     if(status == 1) {
-        
-        int to_read = BLOCK_SIZE;
-        lseek(disk->fd, disk->metadata_size + block_num * BLOCK_SIZE, SEEK_SET);
-        while(to_read > 0) {
-            int res = read(disk->fd, dest, to_read);
-            if(res == -1 && errno == EAGAIN) continue;
-            if(res == -1) return -1;
-
-            to_read -= res;
-            dest += res;
+
+        // Mapped blocks are never cached, copy them from the mapping
+        if(DiskDriver_pinned(disk, block_num)) {
+            memcpy(dest, DiskDriver_blockAddress(disk, block_num), disk->block_size);
+            return 0;
         }
 
+        char *cached = BlockCache_get(&disk->cache, block_num);
+        if(cached) {
+            memcpy(dest, cached, disk->block_size);
+            return 0;
+        }
+
+        if(DiskDriver_loadBlock(disk, dest, block_num) == -1) return -1;
+        if(disk->cache.capacity > 0 && BlockCache_put(&disk->cache, block_num, dest, 0) == -1) return -1;
+
         return 0;
     }
 
     return -1;
 }
 
-int DiskDriver_writeBlock(DiskDriver* disk, void* src, int block_num) {
+static int DiskDriver_readBlocksLocked(DiskDriver* disk, void** dest, const int* block_nums, int count) {
+
+    for(int i = 0; i < count; i++) {
+        if(BitMap_get(&disk->bitmap, block_nums[i]) != 1) return -1;
+    }
+
+    // The missing blocks aren't added to the cache, so that a large
+    // transfer doesn't evict the frequently used ones
+    return DiskDriver_transferBlocks(disk, dest, NULL, 0, block_nums, count, false, true);
+}
+
+static int DiskDriver_writeBlocksLocked(DiskDriver* disk, void** src, void** tails, int split, const int* block_nums, int count) {
+
+    for(int i = 0; i < count; i++) {
+        if(BitMap_get(&disk->bitmap, block_nums[i]) == -1) return -1;
+    }
+
+    // The blocks go straight to the disk, drop the stale cached copies
+    for(int i = 0; i < count; i++) {
+        BlockCache_invalidate(&disk->cache, block_nums[i]);
+    }
+    if(DiskDriver_transferBlocks(disk, src, tails, split, block_nums, count, true, false) == -1) return -1;
+    disk->blocks_written += count;
+
+    for(int i = 0; i < count; i++) {
+        if(BitMap_get(&disk->bitmap, block_nums[i]) == 0) {
+            DiskDriver_markUsed(disk, block_nums[i]);
+        }
+    }
+    return 0;
+}
+
+static int DiskDriver_writeBlockLocked(DiskDriver* disk, void* src, int block_num) {
 
     int status = BitMap_get(&disk->bitmap, block_num);
     if(status == -1) return -1;
 
-    int to_write = BLOCK_SIZE;
-    lseek(disk->fd, disk->metadata_size + block_num * BLOCK_SIZE, SEEK_SET);
-    while(to_write > 0) {
-        int res = write(disk->fd, src, to_write);
-        if(res == -1 && errno == EAGAIN) continue;
-        if(res == -1) return -1;
+    if(DiskDriver_pinned(disk, block_num)) {
+        // Mapped blocks are updated in place
+        void *dest = DiskDriver_blockAddress(disk, block_num);
+        if(dest != src) memcpy(dest, src, disk->block_size);
+    } else if(disk->cache.capacity > 0) {
+        if(BlockCache_put(&disk->cache, block_num, src, 1) == -1) return -1;
+    } else {
+        if(DiskDriver_storeBlock(disk, block_num, src) == -1) return -1;
+    }
+    disk->blocks_written++;
+
+    if(status == 0) {
+        DiskDriver_markUsed(disk, block_num);
+    }
+    return 0;
+}
+
+static int DiskDriver_submitReadLocked(DiskDriver* disk, void* dest, int block_num) {
+
+    if(BitMap_get(&disk->bitmap, block_num) != 1) return -1;
+
+    if(DiskDriver_pinned(disk, block_num)) {
+        memcpy(dest, DiskDriver_blockAddress(disk, block_num), disk->block_size);
+        return 0;
+    }
+
+    char *cached = BlockCache_get(&disk->cache, block_num);
+    if(cached) {
+        memcpy(dest, cached, disk->block_size);
+        return 0;
+    }
+
+    struct iovec iov = { dest, disk->block_size };
+    DiskDriver_submitRun(disk, &iov, 1, DiskDriver_offset(disk, block_num), false);
+    return 0;
+}
+
+static int DiskDriver_submitWriteLocked(DiskDriver* disk, void* src, int block_num) {
 
-        to_write -= res;
-        src += res;
+    int status = BitMap_get(&disk->bitmap, block_num);
+    if(status == -1) return -1;
+
+    if(DiskDriver_pinned(disk, block_num)) {
+        void *dest = DiskDriver_blockAddress(disk, block_num);
+        if(dest != src) memcpy(dest, src, disk->block_size);
+    } else {
+        BlockCache_invalidate(&disk->cache, block_num);
+        struct iovec iov = { src, disk->block_size };
+        DiskDriver_submitRun(disk, &iov, 1, DiskDriver_offset(disk, block_num), true);
     }
+    disk->blocks_written++;
 
     if(status == 0) {
-        disk->header->free_blocks--;
+        DiskDriver_markUsed(disk, block_num);
     }
-    BitMap_set(&disk->bitmap, block_num, 1);
     return 0;
 }
 
-int DiskDriver_freeBlock(DiskDriver* disk, int block_num) {
+static int DiskDriver_completeLocked(DiskDriver* disk) {
+    bool failed = disk->io_failed;
+    disk->io_failed = false;
+    if(disk->ring.ring_fd != -1 && IoRing_wait(&disk->ring) == -1) failed = true;
+    return failed ? -1 : 0;
+}
+
+static int DiskDriver_allocBlockLocked(DiskDriver* disk, int block_num) {
 
-    int prev = BitMap_get(&disk->bitmap, block_num);
-    int res = BitMap_set(&disk->bitmap, block_num, 0);
-    if(res != -1 && prev == 1) {
-        disk->header->free_blocks++;
+    if(BitMap_get(&disk->bitmap, block_num) != 0) return -1;
+
+    return DiskDriver_markUsed(disk, block_num) ? 0 : -1;
+}
+
+static int DiskDriver_allocExtentLocked(DiskDriver* disk, int hint, int min_len, int max_len, int *len) {
+    hint = DiskDriver_hintStart(disk, hint);
+
+    int pos;
+    do {
+        if(min_len > __atomic_load_n(&disk->header->free_blocks, __ATOMIC_RELAXED)) return -1;
+
+        pos = -1;
+        int start = DiskDriver_getFreeBlockLocked(disk, hint);
+        if(start != -1) pos = BitMap_findRun(&disk->bitmap, start, 0, min_len, max_len, len);
+
+        // Wrap around to the beginning of the disk
+        if(pos == -1 && hint > 0) {
+            start = DiskDriver_getFreeBlockLocked(disk, 0);
+            if(start != -1) pos = BitMap_findRun(&disk->bitmap, start, 0, min_len, max_len, len);
+        }
+        if(pos == -1) return -1;
+    } while(!DiskDriver_markRun(disk, pos, min_len, len));
+
+    return pos;
+}
+
+// Add a pin to a block that is already mapped. Only the first pin has to
+// check the cache, the others are taken with an atomic compare-and-swap
+// (like the bits in BitMap_claim) without the lock
+// returns false if the block isn't mapped
+static bool DiskDriver_addPin(DiskDriver* disk, int block_num) {
+    uint16_t pins = __atomic_load_n(&disk->pins[block_num], __ATOMIC_RELAXED);
+    while(pins > 0) {
+        ONERROR(pins == UINT16_MAX, "block %d mapped too many times", block_num);
+        if(__atomic_compare_exchange_n(&disk->pins[block_num], &pins, pins + 1,
+            false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return true;
+        }
     }
-    return res;
+    return false;
 }
 
-int DiskDriver_getFreeBlock(DiskDriver* disk, int start) {
+static void* DiskDriver_mapBlockLocked(DiskDriver* disk, int block_num) {
+
+    if(BitMap_get(&disk->bitmap, block_num) != 1) return NULL;
+
+    if(!DiskDriver_addPin(disk, block_num)) {
+        // The mapping has to see the latest content of the block. No one else
+        // can take the first pin in the meantime, as that needs the lock
+        if(BlockCache_evict(&disk->cache, block_num) == -1) return NULL;
+        __atomic_store_n(&disk->pins[block_num], 1, __ATOMIC_RELEASE);
+    }
+
+    return DiskDriver_blockAddress(disk, block_num);
+}
+
+// The pins are dropped without the lock: a block that isn't mapped anymore
+// is just read and written through the cache again
+void DiskDriver_unmapBlock(DiskDriver* disk, int block_num) {
+    ONERROR(block_num < 0 || block_num >= disk->bitmap.num_bits, "block %d isn't mapped", block_num);
+    uint16_t pins = __atomic_fetch_sub(&disk->pins[block_num], 1, __ATOMIC_RELEASE);
+    ONERROR(pins == 0, "block %d isn't mapped", block_num);
+}
+
+// Ask the kernel to start reading count blocks from first into the page cache
+static void DiskDriver_adviseRun(DiskDriver* disk, int first, int count) {
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t) DiskDriver_blockAddress(disk, first) & ~(page - 1);
+    uintptr_t end = (uintptr_t) DiskDriver_blockAddress(disk, first + count);
+    madvise((void *) start, end - start, MADV_WILLNEED);
+}
+
+void DiskDriver_prefetchBlocks(DiskDriver* disk, const int* block_nums, int count) {
+    int first = -1, len = 0;
+    for(int i = 0; i < count; i++) {
+        int block_num = block_nums[i];
+        if(block_num < 0 || block_num >= disk->bitmap.num_bits) continue;
+        if(first != -1 && block_num == first + len) {
+            len++;
+            continue;
+        }
+        if(first != -1) DiskDriver_adviseRun(disk, first, len);
+        first = block_num;
+        len = 1;
+    }
+    if(first != -1) DiskDriver_adviseRun(disk, first, len);
+    __atomic_fetch_add(&disk->blocks_prefetched, count, __ATOMIC_RELAXED);
+}
+
+static int DiskDriver_freeBlockLocked(DiskDriver* disk, int block_num) {
+
+    int status = BitMap_get(&disk->bitmap, block_num);
+    if(status == -1) return -1;
+
+    // The content of a free block is meaningless, no need to write it back.
+    // Dropped before the block is freed, as it can be allocated again right away
+    BlockCache_invalidate(&disk->cache, block_num);
+    if(status == 1) {
+        DiskDriver_markFree(disk, block_num);
+    }
+    return 0;
+}
+
+static int DiskDriver_getFreeBlockLocked(DiskDriver* disk, int start) {
+    if(start < 0 || start >= disk->bitmap.num_bits) return -1;
+
+    // The group of start may have free blocks only before start
+    int group = start / DISK_GROUP_BLOCKS;
+    int group_end = min((group + 1) * DISK_GROUP_BLOCKS, disk->bitmap.num_bits);
+    if(DiskDriver_groupFree(disk, group) == 0 || BitMap_countRange(&disk->bitmap, start, group_end - start, 0) == 0) {
+        // Jump to the next group with free blocks, without looking at the bitmap
+        do {
+            if(++group == disk->num_groups) return -1;
+        } while(DiskDriver_groupFree(disk, group) == 0);
+        start = group * DISK_GROUP_BLOCKS;
+    }
 
     return BitMap_find(&disk->bitmap, start, 0);
 }
 
-int DiskDriver_flush(DiskDriver* disk) {
-    int res = msync(disk->header, disk->metadata_size, MS_SYNC);
+static int DiskDriver_getFreeBlockNearLocked(DiskDriver* disk, int hint) {
+    hint = DiskDriver_hintStart(disk, hint);
+
+    int pos = DiskDriver_getFreeBlockLocked(disk, hint);
+    // Wrap around to the beginning of the disk
+    if(pos == -1 && hint > 0) pos = DiskDriver_getFreeBlockLocked(disk, 0);
+    return pos;
+}
+
+static int DiskDriver_flushLocked(DiskDriver* disk) {
+    if(BlockCache_flush(&disk->cache) == -1) return -1;
+
+    // The blocks modified through a mapping are in the mmapped region too
+    int res = msync(disk->header, disk->map_size, MS_SYNC);
     ONERROR(res == -1, "msync failed");
 
     return 0;
 }
 
+// The public functions below only take the lock of the driver, the work is
+// done by the Locked versions above
+
+int DiskDriver_setCacheCapacity(DiskDriver* disk, int capacity) {
+    pthread_mutex_lock(&disk->lock);
+    int res = DiskDriver_setCacheCapacityLocked(disk, capacity);
+    pthread_mutex_unlock(&disk->lock);
+    return res;
+}
+
+int DiskDriver_readBlock(DiskDriver* disk, void* dest, int block_num) {
+    pthread_mutex_lock(&disk->lock);
+    int res = DiskDriver_readBlockLocked(disk, dest, block_num);
+    pthread_mutex_unlock(&disk->lock);
+    return res;
+}
+
+int DiskDriver_readBlocks(DiskDriver* disk, void** dest, const int* block_nums, int count) {
+    pthread_mutex_lock(&disk->lock);
+    int res = DiskDriver_readBlocksLocked(disk, dest, block_nums, count);
+    pthread_mutex_unlock(&disk->lock);
+    return res;
+}
+
+int DiskDriver_writeBlocks(DiskDriver* disk, void** src, const int* block_nums, int count) {
+    pthread_mutex_lock(&disk->lock);
+    int res = DiskDriver_writeBlocksLocked(disk, src, NULL, 0, block_nums, count);
+    pthread_mutex_unlock(&disk->lock);
+    return res;
+}
+
+int DiskDriver_writeSplitBlocks(DiskDriver* disk, void** heads, void** tails, int split, const int* block_nums, int count) {
+    pthread_mutex_lock(&disk->lock);
+    int res = DiskDriver_writeBlocksLocked(disk, heads, tails, split, block_nums, count);
+    pthread_mutex_unlock(&disk->lock);
+    return res;
+}
+
+int DiskDriver_writeBlock(DiskDriver* disk, void* src, int block_num) {
+    pthread_mutex_lock(&disk->lock);
+    int res = DiskDriver_writeBlockLocked(disk, src, block_num);
+    pthread_mutex_unlock(&disk->lock);
+    return res;
+}
+
+int DiskDriver_submitRead(DiskDriver* disk, void* dest, int block_num) {
+    pthread_mutex_lock(&disk->lock);
+    int res = DiskDriver_submitReadLocked(disk, dest, block_num);
+    pthread_mutex_unlock(&disk->lock);
+    return res;
+}
+
+int DiskDriver_submitWrite(DiskDriver* disk, void* src, int block_num) {
+    pthread_mutex_lock(&disk->lock);
+    int res = DiskDriver_submitWriteLocked(disk, src, block_num);
+    pthread_mutex_unlock(&disk->lock);
+    return res;
+}
+
+int DiskDriver_complete(DiskDriver* disk) {
+    pthread_mutex_lock(&disk->lock);
+    int res = DiskDriver_completeLocked(disk);
+    pthread_mutex_unlock(&disk->lock);
+    return res;
+}
+
+int DiskDriver_allocBlock(DiskDriver* disk, int block_num) {
+    pthread_mutex_lock(&disk->lock);
+    int res = DiskDriver_allocBlockLocked(disk, block_num);
+    pthread_mutex_unlock(&disk->lock);
+    return res;
+}
+
+int DiskDriver_allocExtent(DiskDriver* disk, int hint, int min_len, int max_len, int *len) {
+    pthread_mutex_lock(&disk->lock);
+    int res = DiskDriver_allocExtentLocked(disk, hint, min_len, max_len, len);
+    pthread_mutex_unlock(&disk->lock);
+    return res;
+}
+
+void* DiskDriver_mapBlock(DiskDriver* disk, int block_num) {
+    // Mapping a block that is already mapped doesn't need the lock
+    if(BitMap_get(&disk->bitmap, block_num) == 1 && DiskDriver_addPin(disk, block_num)) {
+        return DiskDriver_blockAddress(disk, block_num);
+    }
+    pthread_mutex_lock(&disk->lock);
+    void* res = DiskDriver_mapBlockLocked(disk, block_num);
+    pthread_mutex_unlock(&disk->lock);
+    return res;
+}
+
+int DiskDriver_freeBlock(DiskDriver* disk, int block_num) {
+    pthread_mutex_lock(&disk->lock);
+    int res = DiskDriver_freeBlockLocked(disk, block_num);
+    pthread_mutex_unlock(&disk->lock);
+    return res;
+}
+
+int DiskDriver_getFreeBlock(DiskDriver* disk, int start) {
+    pthread_mutex_lock(&disk->lock);
+    int res = DiskDriver_getFreeBlockLocked(disk, start);
+    pthread_mutex_unlock(&disk->lock);
+    return res;
+}
+
+int DiskDriver_getFreeBlockNear(DiskDriver* disk, int hint) {
+    pthread_mutex_lock(&disk->lock);
+    int res = DiskDriver_getFreeBlockNearLocked(disk, hint);
+    pthread_mutex_unlock(&disk->lock);
+    return res;
+}
+
+int DiskDriver_flush(DiskDriver* disk) {
+    pthread_mutex_lock(&disk->lock);
+    int res = DiskDriver_flushLocked(disk);
+    pthread_mutex_unlock(&disk->lock);
+    return res;
+}
+
+// Doesn't take the lock: the block is claimed with a compare-and-swap on
+// its word of the bitmap, and the counters are updated atomically
+int DiskDriver_allocBlockNear(DiskDriver* disk, int hint) {
+    int num_blocks = disk->bitmap.num_bits;
+    int start = DiskDriver_hintStart(disk, hint);
+    int first_group = start / DISK_GROUP_BLOCKS;
+
+    // The groups from the one of start to the end of the disk, then from the
+    // beginning of the disk back to start
+    for(int i = 0; i <= disk->num_groups; i++) {
+        int group = (first_group + i) % disk->num_groups;
+        int from = i == 0 ? start : group * DISK_GROUP_BLOCKS;
+        int to = i == disk->num_groups ? start : min((group + 1) * DISK_GROUP_BLOCKS, num_blocks);
+        if(from >= to || DiskDriver_groupFree(disk, group) == 0) continue;
+
+        int pos = BitMap_claim(&disk->bitmap, from, to);
+        if(pos != -1) {
+            DiskDriver_claimed(disk, pos);
+            return pos;
+        }
+    }
+    return -1;
+}
+
 void DiskDriver_print(DiskDriver *disk) {
+    pthread_mutex_lock(&disk->lock);
     printf("Diskdriver(\n");
+    printf("  block_size = %d,\n", disk->block_size);
     printf("  metadata_size = %d,\n", disk->metadata_size);
     printf("  num_blocks = %d,\n", disk->header->num_blocks);
-    printf("  bitmap_blocks = %d,\n", disk->header->bitmap_blocks);
+    printf("  free_queue = %d,\n", disk->header->free_queue);
     printf("  bitmap_entries = %d,\n", disk->header->bitmap_entries);
-    printf("  free_blocks = %d\n", disk->header->free_blocks);
+    printf("  free_blocks = %d,\n", disk->header->free_blocks);
+    printf("  cache_capacity = %d,\n", disk->cache.capacity);
+    printf("  cache_hits = %ld,\n", disk->cache.hits);
+    printf("  cache_misses = %ld,\n", disk->cache.misses);
+    printf("  blocks_written = %ld,\n", disk->blocks_written);
+    printf("  blocks_prefetched = %ld,\n", disk->blocks_prefetched);
+    printf("  io_backend = %s\n", disk->ring.ring_fd != -1 ? "io_uring" : "synchronous");
     printf(")\n");
+    pthread_mutex_unlock(&disk->lock);
 }
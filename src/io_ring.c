@@ -0,0 +1,175 @@
+#define _GNU_SOURCE
+#include "io_ring.h"
+#include "util.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(DISK_IO_URING)
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// No liburing, talk to the kernel directly
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int IoRing_init(IoRing *r) {
+    struct io_uring_params p;
+    bzero(r, sizeof(IoRing));
+    bzero(&p, sizeof(p));
+
+    r->ring_fd = io_uring_setup(IO_RING_ENTRIES, &p);
+    if(r->ring_fd == -1) {
+        DBGPRINT("io_uring not available (%s)", strerror(errno));
+        return -1;
+    }
+
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    // Newer kernels map both rings with a single mmap
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->sq_ring_size = r->cq_ring_size = max(r->sq_ring_size, r->cq_ring_size);
+    }
+
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->ring_fd, IORING_OFF_SQ_RING);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else if(r->sq_ring != MAP_FAILED) {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->ring_fd, IORING_OFF_CQ_RING);
+    }
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->ring_fd, IORING_OFF_SQES);
+
+    if(r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+        DBGPRINT("can't map the io_uring queues");
+        if(r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_size);
+        if(r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_size);
+        if(r->sq_ring != MAP_FAILED) munmap(r->sq_ring, r->sq_ring_size);
+        close(r->ring_fd);
+        r->ring_fd = -1;
+        return -1;
+    }
+
+    r->sq_head = (unsigned *) (r->sq_ring + p.sq_off.head);
+    r->sq_tail = (unsigned *) (r->sq_ring + p.sq_off.tail);
+    r->sq_mask = (unsigned *) (r->sq_ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *) (r->sq_ring + p.sq_off.array);
+    r->cq_head = (unsigned *) (r->cq_ring + p.cq_off.head);
+    r->cq_tail = (unsigned *) (r->cq_ring + p.cq_off.tail);
+    r->cq_mask = (unsigned *) (r->cq_ring + p.cq_off.ring_mask);
+    r->cqes = r->cq_ring + p.cq_off.cqes;
+
+    r->requests = (IoRingRequest *) calloc(IO_RING_ENTRIES, sizeof(IoRingRequest));
+    ONERROR(r->requests == NULL, "calloc failed");
+    for(int i = 0; i < IO_RING_ENTRIES; i++) {
+        r->free_requests[i] = IO_RING_ENTRIES - 1 - i;
+    }
+    r->num_free = IO_RING_ENTRIES;
+    return 0;
+}
+
+void IoRing_destroy(IoRing *r) {
+    if(r->ring_fd == -1) return;
+
+    IoRing_wait(r);
+    free(r->requests);
+    munmap(r->sqes, r->sqes_size);
+    if(r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_size);
+    munmap(r->sq_ring, r->sq_ring_size);
+    close(r->ring_fd);
+    r->ring_fd = -1;
+}
+
+// Submit the queued requests and reap completions until nothing is in flight.
+// Failures are recorded in r->failed
+static void IoRing_drain(IoRing *r) {
+    while(r->to_submit > 0 || r->in_flight > 0) {
+        int res = io_uring_enter(r->ring_fd, r->to_submit, r->to_submit + r->in_flight, IORING_ENTER_GETEVENTS);
+        if(res == -1 && (errno == EINTR || errno == EAGAIN || errno == EBUSY)) continue;
+        ONERROR(res == -1, "io_uring_enter failed: %s", strerror(errno));
+        r->in_flight += res;
+        r->to_submit -= res;
+
+        // Reap the completions
+        unsigned head = *r->cq_head;
+        unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for(; head != tail; head++) {
+            struct io_uring_cqe *cqe = &((struct io_uring_cqe *) r->cqes)[head & *r->cq_mask];
+            IoRingRequest *req = &r->requests[cqe->user_data];
+            if(cqe->res < 0 || (size_t) cqe->res != req->expected) {
+                r->failed = true;
+            }
+            r->free_requests[r->num_free++] = cqe->user_data;
+            r->in_flight--;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+int IoRing_queue(IoRing *r, int fd, const struct iovec *iov, int iovcnt, off_t offset, bool is_write) {
+    if(r->ring_fd == -1 || iovcnt > IO_RING_MAX_IOV) return -1;
+    if(r->num_free == 0) IoRing_drain(r);
+
+    int id = r->free_requests[--r->num_free];
+    IoRingRequest *req = &r->requests[id];
+    memcpy(req->iov, iov, iovcnt * sizeof(struct iovec));
+    req->iovcnt = iovcnt;
+    req->expected = 0;
+    for(int i = 0; i < iovcnt; i++) req->expected += iov[i].iov_len;
+
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &((struct io_uring_sqe *) r->sqes)[idx];
+    bzero(sqe, sizeof(struct io_uring_sqe));
+    sqe->opcode = is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) req->iov;
+    sqe->len = iovcnt;
+    sqe->off = offset;
+    sqe->user_data = id;
+
+    r->sq_array[idx] = idx;
+    // The kernel must see the entry before the new tail
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->to_submit++;
+    return 0;
+}
+
+int IoRing_wait(IoRing *r) {
+    if(r->ring_fd == -1) return -1;
+
+    IoRing_drain(r);
+    bool failed = r->failed;
+    r->failed = false;
+    return failed ? -1 : 0;
+}
+
+#else
+
+int IoRing_init(IoRing *r) {
+    bzero(r, sizeof(IoRing));
+    r->ring_fd = -1;
+    return -1;
+}
+
+void IoRing_destroy(IoRing *r) {
+}
+
+int IoRing_queue(IoRing *r, int fd, const struct iovec *iov, int iovcnt, off_t offset, bool is_write) {
+    return -1;
+}
+
+int IoRing_wait(IoRing *r) {
+    return -1;
+}
+
+#endif
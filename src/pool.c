@@ -0,0 +1,70 @@
+#include "pool.h"
+#include "util.h"
+#include <stdio.h>
+#include <string.h>
+
+void Pool_init(Pool *p, size_t object_size, int max_free) {
+    bzero(p, sizeof(Pool));
+    // The released objects store the link of the free list
+    p->object_size = max(object_size, sizeof(void *));
+    p->max_free = max(max_free, 0);
+    pthread_mutex_init(&p->lock, NULL);
+}
+
+void Pool_destroy(Pool *p) {
+    while(p->free_list) {
+        void *next = *(void **) p->free_list;
+        free(p->free_list);
+        p->free_list = next;
+    }
+    p->num_free = 0;
+    pthread_mutex_destroy(&p->lock);
+}
+
+void *Pool_alloc(Pool *p) {
+    pthread_mutex_lock(&p->lock);
+    p->allocs++;
+    void *obj = p->free_list;
+    if(obj) {
+        p->free_list = *(void **) obj;
+        p->num_free--;
+    } else {
+        p->mallocs++;
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    if(!obj) {
+        obj = calloc(1, p->object_size);
+        ONERROR(!obj, "calloc failed");
+    } else {
+        memset(obj, 0, p->object_size);
+    }
+    return obj;
+}
+
+void Pool_free(Pool *p, void *obj) {
+    if(!obj) return;
+    pthread_mutex_lock(&p->lock);
+    p->frees++;
+    if(p->num_free < p->max_free) {
+        *(void **) obj = p->free_list;
+        p->free_list = obj;
+        p->num_free++;
+        obj = NULL;
+    }
+    pthread_mutex_unlock(&p->lock);
+    free(obj);
+}
+
+void Pool_print(Pool *p) {
+    pthread_mutex_lock(&p->lock);
+    printf("Pool(\n");
+    printf("  object_size = %zu,\n", p->object_size);
+    printf("  free = %d,\n", p->num_free);
+    printf("  max_free = %d,\n", p->max_free);
+    printf("  allocs = %ld,\n", p->allocs);
+    printf("  mallocs = %ld,\n", p->mallocs);
+    printf("  frees = %ld\n", p->frees);
+    printf(")\n");
+    pthread_mutex_unlock(&p->lock);
+}
@@ -4,34 +4,110 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <limits.h>
+
+// Number of files in a FirstDirectoryBlock and in a DirectoryBlock, and of data
+// bytes in a FirstFileBlock and in a FileBlock, for the block size of the disk
+#define FILES_IN_FIRST_DB(disk) ((int) (((disk)->block_size - sizeof(FirstDirectoryBlock)) / sizeof(DirectoryEntry)))
+#define FILES_IN_DB(disk) ((int) (((disk)->block_size - sizeof(DirectoryBlock)) / sizeof(DirectoryEntry)))
+#define BYTES_IN_FIRST_FB(disk) ((int) ((disk)->block_size - sizeof(FirstFileBlock)))
+#define BYTES_IN_FB(disk) ((int) ((disk)->block_size - sizeof(FileBlock)))
+// Number of entries in an index block and in a bucket of a directory hash index
+#define INDEX_ENTRIES(disk) ((disk)->block_size / (int) sizeof(int))
+#define ENTRIES_IN_BUCKET(disk) ((int) (((disk)->block_size - sizeof(DirectoryHashBucket)) / sizeof(DirectoryEntry)))
+// Largest power of 2 that fits in the root of a hash index (the block size is a power of 2 too)
+#define MAX_HASH_BUCKETS(disk) ((disk)->block_size / (int) sizeof(int) / 2)
+
+
+static void SimpleFS_upgrade(SimpleFS *fs);
+static void DirectoryHandle_write(DirectoryHandle *d);
+static int SimpleFS_freeTail(DiskDriver *disk, FirstFileBlock *ffb, int max_blocks);
+static int SimpleFS_freeFirst(DiskDriver *disk, FirstFileBlock *ffb);
+static int SimpleFS_queueNext(DiskDriver *disk, int block);
+static void SimpleFS_freeUnlinked(SimpleFS *fs, FirstFileBlock *ffb);
+
+// Allocate a zeroed buffer holding a block of the disk
+static void *SimpleFS_newBlock(SimpleFS *fs) {
+    return Pool_alloc(&fs->block_pool);
+}
 
-#define sizeof_field(structure, field) sizeof(((structure *)0)->field)
-#define numelements_field(structure, arrayname) (sizeof_field(structure, arrayname)/sizeof_field(structure, arrayname[0]))
+// Release a buffer returned by SimpleFS_newBlock
+static void SimpleFS_freeBlock(SimpleFS *fs, void *block) {
+    Pool_free(&fs->block_pool, block);
+}
 
-// Number of files in a FirstDirectoryBlock and in a DirectoryBlock
-#define FILES_IN_FIRST_DB numelements_field(FirstDirectoryBlock, file_blocks)
-#define FILES_IN_DB numelements_field(DirectoryBlock, file_blocks)
-#define BYTES_IN_FIRST_FB sizeof_field(FirstFileBlock, data)
-#define BYTES_IN_FB sizeof_field(FileBlock, data)
+// Same as DiskDriver_allocBlockNear, but when the disk is full the blocks
+// in the free queue are reclaimed one at a time before giving up
+static int SimpleFS_allocBlockNear(SimpleFS *fs, int hint) {
+    int pos = DiskDriver_allocBlockNear(fs->disk, hint);
+    while(pos == -1 && SimpleFS_reclaim(fs, 1) > 0) {
+        pos = DiskDriver_allocBlockNear(fs->disk, hint);
+    }
+    return pos;
+}
 
-static DirectoryHandle cwd; // current directory
+// Same as DiskDriver_allocExtent, reclaiming up to max_len blocks of the free
+// queue at a time when the disk is full
+static int SimpleFS_allocExtent(SimpleFS *fs, int hint, int min_len, int max_len, int *len) {
+    int pos = DiskDriver_allocExtent(fs->disk, hint, min_len, max_len, len);
+    while(pos == -1 && SimpleFS_reclaim(fs, max_len) > 0) {
+        pos = DiskDriver_allocExtent(fs->disk, hint, min_len, max_len, len);
+    }
+    return pos;
+}
 
-typedef struct {
+// Returns whether count blocks are free, reclaiming the free queue if needed.
+// Other threads may still take them in the meantime
+static bool SimpleFS_hasFree(SimpleFS *fs, int count) {
+    int free_blocks;
+    while((free_blocks = __atomic_load_n(&fs->disk->header->free_blocks, __ATOMIC_RELAXED)) < count) {
+        if(SimpleFS_reclaim(fs, count - free_blocks) == 0) return false;
+    }
+    return true;
+}
+
+// Allocate an empty index block near hint
+// returns -1 if there's no space left
+static int SimpleFS_newIndexBlock(SimpleFS *fs, int hint) {
+    DiskDriver *disk = fs->disk;
+    int pos = SimpleFS_allocBlockNear(fs, hint);
+    if(pos == -1) return -1;
+
+    int *node = (int *) DiskDriver_mapBlock(disk, pos);
+    ONERROR(!node, "map failed");
+    bzero(node, disk->block_size);
+    DiskDriver_unmapBlock(disk, pos);
+    return pos;
+}
+
+// FNV-1a hash of a file name
+static unsigned int SimpleFS_hash(const char *name) {
+    unsigned int hash = 2166136261u;
+    for(; *name; name++) {
+        hash = (hash ^ (unsigned char) *name) * 16777619u;
+    }
+    return hash;
+}
+
+// Iterates over the files in a directory. The blocks are accessed
+// through their mapping in the disk image, so nothing is copied
+struct FileIterator {
     DirectoryHandle *dir;
     DiskDriver *disk;
-    FirstFileBlock ffb; // current file
-    DirectoryBlock db;  // current directory block
+    FirstFileBlock *ffb; // current file (mapped)
+    DirectoryBlock *db;  // current directory block (mapped), NULL in the first block
+    int ffb_block;       // position of ffb on the disk, -1 if not mapped
     int pos;
     int relative_pos;
     int cur_dir_block;
     int next_dir_block;
-} FileIterator;
+};
 
 FileIterator *FileIterator_new(DirectoryHandle *dir) {
-    FileIterator *it = (FileIterator *) calloc(1, sizeof(FileIterator));
-    ONERROR(it == NULL, "calloc failed");
+    FileIterator *it = (FileIterator *) Pool_alloc(&dir->sfs->iterator_pool);
     it->dir = dir;
     it->disk = dir->sfs->disk;
+    it->ffb_block = -1;
     it->pos = -1;
     it->relative_pos = -1;
     it->cur_dir_block = dir->dcb->fcb.block_in_disk;
@@ -40,103 +116,214 @@ FileIterator *FileIterator_new(DirectoryHandle *dir) {
 }
 
 void FileIterator_close(FileIterator *it) {
-    free(it);
+    if(it->ffb) DiskDriver_unmapBlock(it->disk, it->ffb_block);
+    if(it->db) DiskDriver_unmapBlock(it->disk, it->cur_dir_block);
+    Pool_free(&it->dir->sfs->iterator_pool, it);
 }
 
-// Returns the index of the next file's control block
-int FileIterator_nextidx(FileIterator *it) {
-    int res;
-    int file_block;
+// Returns the next entry of the directory, NULL at the end
+DirectoryEntry *FileIterator_nextEntry(FileIterator *it) {
+    DirectoryEntry *entry;
 
     ++it->pos;
-    if(it->pos == it->dir->dcb->num_entries) {
-        return -1; // end of iteration
+    // The blocks of a removed directory may be reclaimed already
+    if(it->dir->unlinked || it->pos == it->dir->dcb->num_entries) {
+        return NULL; // end of iteration
     }
 
-    if(it->pos < FILES_IN_FIRST_DB) {
+    if(it->pos < FILES_IN_FIRST_DB(it->disk)) {
         // This is one of the files stored directly in the first block
-        file_block = it->dir->dcb->file_blocks[it->pos];
+        entry = &it->dir->dcb->entries[it->pos];
     } else {
-        // Otherwise, it's in one of the other blocks. Read the next
+        // Otherwise, it's in one of the other blocks. Map the next
         // block if necessary
-        if(it->relative_pos == -1 || it->relative_pos == FILES_IN_DB) {
+        if(it->relative_pos == -1 || it->relative_pos == FILES_IN_DB(it->disk)) {
             it->relative_pos = 0;
 
-            res = DiskDriver_readBlock(it->disk, &it->db, it->next_dir_block);
-            ONERROR(res == -1, "read failed");
+            DirectoryBlock *db = (DirectoryBlock *) DiskDriver_mapBlock(it->disk, it->next_dir_block);
+            ONERROR(db == NULL, "map failed");
+            if(it->db) DiskDriver_unmapBlock(it->disk, it->cur_dir_block);
+            it->db = db;
             it->cur_dir_block = it->next_dir_block;
-            it->next_dir_block = it->db.header.next_block;
+            it->next_dir_block = it->db->header.next_block;
         }
-        file_block = it->db.file_blocks[it->relative_pos];
+        entry = &it->db->entries[it->relative_pos];
         it->relative_pos++;
     }
     
-    return file_block;
+    return entry;
+}
+
+// Returns the index of the next file's control block
+int FileIterator_nextidx(FileIterator *it) {
+    DirectoryEntry *entry = FileIterator_nextEntry(it);
+    return entry ? entry->block : -1;
+}
+
+// Maps the first block of the file in the given entry
+static FirstFileBlock *FileIterator_load(FileIterator *it, int file_block) {
+    FirstFileBlock *ffb = (FirstFileBlock *) DiskDriver_mapBlock(it->disk, file_block);
+    ONERROR(ffb == NULL, "map failed");
+    if(it->ffb) DiskDriver_unmapBlock(it->disk, it->ffb_block);
+    it->ffb = ffb;
+    it->ffb_block = file_block;
+    return it->ffb;
 }
 
 FirstFileBlock *FileIterator_next(FileIterator *it) {
-    int res;
     int file_block = FileIterator_nextidx(it);
     if(file_block == -1) return NULL;
-    res = DiskDriver_readBlock(it->disk, &it->ffb, file_block);
-    ONERROR(res == -1, "read failed");
-    return &it->ffb;
+    return FileIterator_load(it, file_block);
 }
 
-int FileIterator_update(FileIterator *it, int new_child_idx) {
+// Moves to the file called name, which has the given hash. Only the files
+// whose names have the same hash are read
+// returns NULL if there's no such file
+FirstFileBlock *FileIterator_find(FileIterator *it, const char *name, unsigned int hash) {
+    DirectoryEntry *entry;
+    while((entry = FileIterator_nextEntry(it))) {
+        if(entry->hash != hash) continue;
+
+        FirstFileBlock *ffb = FileIterator_load(it, entry->block);
+        if(!strcmp(ffb->fcb.name, name)) return ffb;
+    }
+    return NULL;
+}
+
+int FileIterator_update(FileIterator *it, DirectoryEntry new_entry) {
+    if(it->pos < FILES_IN_FIRST_DB(it->disk)) {
+        it->dir->dcb->entries[it->pos] = new_entry;
+        DirectoryHandle_write(it->dir);
+    } else {
+        // relative_pos was already moved past the current entry
+        it->db->entries[it->relative_pos - 1] = new_entry;
+    }
+    return 0;
+}
+
+// Move the handle to the directory whose first block is block
+// returns -1 if it isn't a directory
+static int DirectoryHandle_load(DirectoryHandle *d, int block) {
     int res;
-    if(it->cur_dir_block == it->dir->dcb->fcb.block_in_disk) {
-        it->dir->dcb->file_blocks[it->pos] = new_child_idx;
-        res = DiskDriver_writeBlock(it->disk, it->dir->dcb, it->cur_dir_block);
-        ONERROR(res == -1, "write failed");
+
+    // Here we use the fact that the layout for directory/file first
+    // blocks is identical up to the fcb, so we can safely read
+    // is_dir and cast to a directory block
+    FirstDirectoryBlock *fdb = (FirstDirectoryBlock *) SimpleFS_newBlock(d->sfs);
+    res = DiskDriver_readBlock(d->sfs->disk, fdb, block);
+    ONERROR(res == -1, "read failed");
+    if(!fdb->fcb.is_dir) {
+        SimpleFS_freeBlock(d->sfs, fdb);
+        return -1;
+    }
+
+    // Keep the current directory if it's the parent of the new one,
+    // otherwise read the parent again (there's none for the top level directory)
+    FirstDirectoryBlock *parent = NULL;
+    if(d->dcb && !d->unlinked && fdb->fcb.directory_block == d->dcb->fcb.block_in_disk) {
+        parent = d->dcb;
     } else {
-        it->db.file_blocks[it->relative_pos] = new_child_idx;
-        res = DiskDriver_writeBlock(it->disk, &it->db, it->cur_dir_block);
-        ONERROR(res == -1, "write failed");
+        SimpleFS_freeBlock(d->sfs, d->dcb);
+        if(fdb->fcb.directory_block != -1) {
+            parent = (FirstDirectoryBlock *) SimpleFS_newBlock(d->sfs);
+            res = DiskDriver_readBlock(d->sfs->disk, parent, fdb->fcb.directory_block);
+            ONERROR(res == -1, "read failed");
+        }
     }
+
+    SimpleFS_freeBlock(d->sfs, d->directory);
+    d->directory = parent;
+    d->dcb = fdb;
+    d->current_block = &fdb->header;
+    d->pos_in_dir = 0;
+    d->pos_in_block = 0;
+    d->unlinked = 0;
     return 0;
 }
 
-void free_cwd(void) {
-    if(cwd.dcb) {
-        free(cwd.dcb);
-        cwd.dcb = NULL;
+// Open a new handle to the directory whose first block is block
+// returns NULL if it isn't a directory
+static DirectoryHandle *DirectoryHandle_new(SimpleFS *fs, int block) {
+    DirectoryHandle *d = (DirectoryHandle *) Pool_alloc(&fs->dir_handle_pool);
+    d->sfs = fs;
+    if(DirectoryHandle_load(d, block) == -1) {
+        Pool_free(&fs->dir_handle_pool, d);
+        return NULL;
     }
-    if(cwd.directory) {
-        free(cwd.directory);
-        cwd.directory = NULL;
+
+    d->next = fs->handles;
+    if(fs->handles) fs->handles->prev = d;
+    fs->handles = d;
+    return d;
+}
+
+// Write the first block of the directory of d, and copy it to the other
+// handles open on the same directory. Removed directories aren't written,
+// their blocks may belong to something else by now
+static void DirectoryHandle_write(DirectoryHandle *d) {
+    if(d->unlinked) return;
+    int block = d->dcb->fcb.block_in_disk;
+    int res = DiskDriver_writeBlock(d->sfs->disk, d->dcb, block);
+    ONERROR(res == -1, "write failed");
+
+    for(DirectoryHandle *h = d->sfs->handles; h; h = h->next) {
+        if(h != d && !h->unlinked && h->dcb->fcb.block_in_disk == block) {
+            memcpy(h->dcb, d->dcb, d->sfs->disk->block_size);
+        }
     }
 }
 
 DirectoryHandle *SimpleFS_init(SimpleFS *fs, DiskDriver *disk) {
-    int res;
     fs->disk = disk;
     fs->current_directory_block = 0;
-
-    FirstDirectoryBlock *dcb = (FirstDirectoryBlock *) malloc(sizeof(FirstDirectoryBlock));
-    ONERROR(dcb == NULL, "malloc failed");
+    fs->reclaimer_running = 0;
+    pthread_cond_init(&fs->reclaim_cond, NULL);
+    fs->handles = NULL;
+    fs->open_files = NULL;
+    fs->readahead_max = FILE_READAHEAD_MAX;
+    DentryCache_init(&fs->dentries, DENTRY_CACHE_ENTRIES);
+    Pool_init(&fs->block_pool, disk->block_size, SIMPLEFS_POOL_MAX_FREE);
+    Pool_init(&fs->file_handle_pool, sizeof(FileHandle), SIMPLEFS_POOL_MAX_FREE);
+    Pool_init(&fs->open_file_pool, sizeof(OpenFile), SIMPLEFS_POOL_MAX_FREE);
+    Pool_init(&fs->dir_handle_pool, sizeof(DirectoryHandle), SIMPLEFS_POOL_MAX_FREE);
+    Pool_init(&fs->iterator_pool, sizeof(FileIterator), SIMPLEFS_POOL_MAX_FREE);
+
+    // Recursive, as the allocation functions reclaim the free queue
+    // both from operations holding the lock and from SimpleFS_write
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&fs->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    FirstDirectoryBlock *dcb = (FirstDirectoryBlock *) SimpleFS_newBlock(fs);
     if(DiskDriver_readBlock(disk, dcb, 0) != 0) {
         DBGPRINT("The disk seems to be empty. Formatting...");
-
         SimpleFS_format(fs);
-        res = DiskDriver_readBlock(disk, dcb, 0);
-        ONERROR(res == -1, "read failed");
+    } else if(disk->header->version < DISK_VERSION) {
+        SimpleFS_upgrade(fs);
     }
+    SimpleFS_freeBlock(fs, dcb);
 
-    cwd.sfs = fs;
-    cwd.dcb = dcb;
-    cwd.directory = NULL;
-    cwd.current_block = &dcb->header;
-    cwd.pos_in_block = 0;
-    cwd.pos_in_dir = 0;
-
-    atexit(free_cwd);
+    return DirectoryHandle_new(fs, 0);
+}
 
-    return &cwd;
+void SimpleFS_destroy(SimpleFS *fs) {
+    SimpleFS_stopReclaimer(fs);
+    while(fs->handles) SimpleFS_closeDirectory(fs->handles);
+    DentryCache_destroy(&fs->dentries);
+    Pool_destroy(&fs->block_pool);
+    Pool_destroy(&fs->file_handle_pool);
+    Pool_destroy(&fs->open_file_pool);
+    Pool_destroy(&fs->dir_handle_pool);
+    Pool_destroy(&fs->iterator_pool);
+    pthread_cond_destroy(&fs->reclaim_cond);
+    pthread_mutex_destroy(&fs->lock);
 }
 
 void SimpleFS_format(SimpleFS *fs) {
     int res;
+    pthread_mutex_lock(&fs->lock);
 
     // Deallocate all blocks on disk
     for(int i = 0; i < fs->disk->header->num_blocks; i++) {
@@ -144,24 +331,202 @@ void SimpleFS_format(SimpleFS *fs) {
         ONERROR(res == -1, "free failed");
     }
 
-    FirstDirectoryBlock dcb;
-    bzero(&dcb, sizeof(FirstDirectoryBlock));
+    fs->disk->header->version = DISK_VERSION;
+    fs->disk->header->free_queue = -1;
+    DentryCache_clear(&fs->dentries);
 
-    dcb.header.previous_block = 0;
-    dcb.header.next_block = 0;
-    dcb.header.block_in_file = 0;
+    FirstDirectoryBlock *dcb = (FirstDirectoryBlock *) SimpleFS_newBlock(fs);
 
-    dcb.fcb.directory_block = -1;
-    dcb.fcb.block_in_disk = 0;
-    strcpy(dcb.fcb.name, "/");
-    dcb.fcb.size_in_bytes = 0;
-    dcb.fcb.size_in_blocks = 1;
-    dcb.fcb.is_dir = 1;
+    dcb->header.previous_block = 0;
+    dcb->header.next_block = 0;
+    dcb->header.block_in_file = 0;
 
-    dcb.num_entries = 0;
+    dcb->fcb.directory_block = -1;
+    dcb->fcb.block_in_disk = 0;
+    strcpy(dcb->fcb.name, "/");
+    dcb->fcb.size_in_bytes = 0;
+    dcb->fcb.size_in_blocks = 1;
+    dcb->fcb.is_dir = 1;
+    dcb->fcb.index_block = -1;
+    dcb->fcb.index_depth = 0;
 
-    res = DiskDriver_writeBlock(fs->disk, &dcb, 0);
+    dcb->num_entries = 0;
+
+    res = DiskDriver_writeBlock(fs->disk, dcb, 0);
     ONERROR(res == -1, "write failed");
+    SimpleFS_freeBlock(fs, dcb);
+
+    for(DirectoryHandle *d = fs->handles; d; d = d->next) {
+        DirectoryHandle_load(d, 0);
+    }
+    pthread_mutex_unlock(&fs->lock);
+}
+
+// Returns the first bucket of the chain holding the entries with the given hash,
+// 0 if the bucket is empty. If root_entry is given, the root stays mapped and
+// root_entry points to the start of the chain
+static int SimpleFS_hashBucket(DiskDriver *disk, FileControlBlock *fcb, unsigned int hash, int **root_entry) {
+    DirectoryHashIndex *root = (DirectoryHashIndex *) DiskDriver_mapBlock(disk, fcb->index_block);
+    ONERROR(!root, "map failed");
+    int *entry = &root->buckets[hash & (root->num_buckets - 1)];
+    int bucket = *entry;
+    if(root_entry) *root_entry = entry;
+    else DiskDriver_unmapBlock(disk, fcb->index_block);
+    return bucket;
+}
+
+// Returns the number of buckets needed to index num_entries entries, so
+// that the buckets are half full on average
+static int SimpleFS_hashBuckets(DiskDriver *disk, int num_entries) {
+    int num_buckets = 1;
+    while(num_buckets < MAX_HASH_BUCKETS(disk) && num_entries > num_buckets * ENTRIES_IN_BUCKET(disk) / 2) {
+        num_buckets <<= 1;
+    }
+    return num_buckets;
+}
+
+// Add an entry to the hash index of the directory
+// returns -1 if there's no space left for a new bucket
+static int SimpleFS_hashIndexAdd(SimpleFS *fs, FileControlBlock *fcb, DirectoryEntry entry) {
+    DiskDriver *disk = fs->disk;
+    int *link;
+    int bucket_block = SimpleFS_hashBucket(disk, fcb, entry.hash, &link);
+    int link_block = fcb->index_block;
+
+    // Look for a bucket with some space left in the chain
+    while(bucket_block != 0) {
+        DirectoryHashBucket *bucket = (DirectoryHashBucket *) DiskDriver_mapBlock(disk, bucket_block);
+        ONERROR(!bucket, "map failed");
+        if(bucket->num_entries < ENTRIES_IN_BUCKET(disk)) {
+            bucket->entries[bucket->num_entries++] = entry;
+            DiskDriver_unmapBlock(disk, bucket_block);
+            DiskDriver_unmapBlock(disk, link_block);
+            return 0;
+        }
+        DiskDriver_unmapBlock(disk, link_block);
+        link = &bucket->next_bucket;
+        link_block = bucket_block;
+        bucket_block = bucket->next_bucket;
+    }
+
+    // All full (or no bucket yet), add one at the end of the chain
+    bucket_block = SimpleFS_newIndexBlock(fs, link_block + 1);
+    if(bucket_block != -1) {
+        DirectoryHashBucket *bucket = (DirectoryHashBucket *) DiskDriver_mapBlock(disk, bucket_block);
+        ONERROR(!bucket, "map failed");
+        bucket->entries[bucket->num_entries++] = entry;
+        DiskDriver_unmapBlock(disk, bucket_block);
+        *link = bucket_block;
+    }
+    DiskDriver_unmapBlock(disk, link_block);
+    return bucket_block == -1 ? -1 : 0;
+}
+
+// Remove the entry of the given block from the hash index of the directory
+static void SimpleFS_hashIndexRemove(DiskDriver *disk, FileControlBlock *fcb, DirectoryEntry entry) {
+    int bucket_block = SimpleFS_hashBucket(disk, fcb, entry.hash, NULL);
+    while(bucket_block != 0) {
+        DirectoryHashBucket *bucket = (DirectoryHashBucket *) DiskDriver_mapBlock(disk, bucket_block);
+        ONERROR(!bucket, "map failed");
+        for(int i = 0; i < bucket->num_entries; i++) {
+            if(bucket->entries[i].block == entry.block) {
+                // Fill the hole with the last entry of the bucket
+                bucket->entries[i] = bucket->entries[--bucket->num_entries];
+                DiskDriver_unmapBlock(disk, bucket_block);
+                return;
+            }
+        }
+        int next_bucket = bucket->next_bucket;
+        DiskDriver_unmapBlock(disk, bucket_block);
+        bucket_block = next_bucket;
+    }
+    ONERROR(1, "block %d isn't in the hash index of %s", entry.block, fcb->name);
+}
+
+// Returns the first block of the file called name in the directory, using its hash index
+// returns -1 if there's no such file
+static int SimpleFS_hashIndexFind(DiskDriver *disk, FileControlBlock *fcb, const char *name, unsigned int hash) {
+    int bucket_block = SimpleFS_hashBucket(disk, fcb, hash, NULL);
+    while(bucket_block != 0) {
+        DirectoryHashBucket *bucket = (DirectoryHashBucket *) DiskDriver_mapBlock(disk, bucket_block);
+        ONERROR(!bucket, "map failed");
+        for(int i = 0; i < bucket->num_entries; i++) {
+            if(bucket->entries[i].hash != hash) continue;
+
+            int block = bucket->entries[i].block;
+            FirstFileBlock *ffb = (FirstFileBlock *) DiskDriver_mapBlock(disk, block);
+            ONERROR(!ffb, "map failed");
+            bool found = !strcmp(ffb->fcb.name, name);
+            DiskDriver_unmapBlock(disk, block);
+            if(found) {
+                DiskDriver_unmapBlock(disk, bucket_block);
+                return block;
+            }
+        }
+        int next_bucket = bucket->next_bucket;
+        DiskDriver_unmapBlock(disk, bucket_block);
+        bucket_block = next_bucket;
+    }
+    return -1;
+}
+
+// Free all the blocks of the hash index of the directory
+// returns the number of blocks freed
+static int SimpleFS_hashIndexFree(DiskDriver *disk, FileControlBlock *fcb) {
+    if(fcb->index_block == -1) return 0;
+
+    int freed = 1;
+    DirectoryHashIndex *root = (DirectoryHashIndex *) DiskDriver_mapBlock(disk, fcb->index_block);
+    ONERROR(!root, "map failed");
+    for(int i = 0; i < root->num_buckets; i++) {
+        for(int bucket_block = root->buckets[i]; bucket_block != 0; ) {
+            DirectoryHashBucket *bucket = (DirectoryHashBucket *) DiskDriver_mapBlock(disk, bucket_block);
+            ONERROR(!bucket, "map failed");
+            int next_bucket = bucket->next_bucket;
+            DiskDriver_unmapBlock(disk, bucket_block);
+
+            int res = DiskDriver_freeBlock(disk, bucket_block);
+            ONERROR(res == -1, "free failed");
+            bucket_block = next_bucket;
+            freed++;
+        }
+    }
+    DiskDriver_unmapBlock(disk, fcb->index_block);
+
+    int res = DiskDriver_freeBlock(disk, fcb->index_block);
+    ONERROR(res == -1, "free failed");
+    fcb->index_block = -1;
+    fcb->index_depth = 0;
+    return freed;
+}
+
+// Build the hash index of the directory from its entries, replacing the
+// current one if there's any
+// returns -1 if there's no space left for it
+static int SimpleFS_hashIndexBuild(DirectoryHandle *d) {
+    DiskDriver *disk = d->sfs->disk;
+    FileControlBlock *fcb = &d->dcb->fcb;
+
+    SimpleFS_hashIndexFree(disk, fcb);
+    fcb->index_block = SimpleFS_newIndexBlock(d->sfs, fcb->block_in_disk);
+    if(fcb->index_block == -1) return -1;
+    fcb->index_depth = 1;
+
+    DirectoryHashIndex *root = (DirectoryHashIndex *) DiskDriver_mapBlock(disk, fcb->index_block);
+    ONERROR(!root, "map failed");
+    root->num_buckets = SimpleFS_hashBuckets(disk, d->dcb->num_entries);
+    DiskDriver_unmapBlock(disk, fcb->index_block);
+
+    FileIterator *it = FileIterator_new(d);
+    DirectoryEntry *entry;
+    int res = 0;
+    while(res != -1 && (entry = FileIterator_nextEntry(it))) {
+        res = SimpleFS_hashIndexAdd(d->sfs, fcb, *entry);
+    }
+    FileIterator_close(it);
+
+    if(res == -1) SimpleFS_hashIndexFree(disk, fcb);
+    return res;
 }
 
 int SimpleFS_newDirBlock(DirectoryHandle *d) {
@@ -169,226 +534,1005 @@ int SimpleFS_newDirBlock(DirectoryHandle *d) {
     DiskDriver *disk = d->sfs->disk;
     BlockHeader *cur_block = (BlockHeader *) d->dcb;
     int start_block_num = d->dcb->fcb.block_in_disk;
-    int cur_block_num = start_block_num;
-    char block[BLOCK_SIZE];
+    int cur_block_num = d->dcb->header.previous_block;
+    char *block = (char *) SimpleFS_newBlock(d->sfs);
 
-    while(cur_block->next_block != start_block_num) {
-        cur_block_num = cur_block->next_block;
-        res = DiskDriver_readBlock(disk, block, cur_block->next_block);
+    // The last block in the list is the previous one of the first block
+    if(cur_block_num != start_block_num) {
+        res = DiskDriver_readBlock(disk, block, cur_block_num);
         ONERROR(res == -1, "read failed");
         cur_block = (BlockHeader *)block;
     }
 
-    // Now cur_block is the last block in the list
-
-    DirectoryBlock db;
-    bzero(&db, sizeof(db));
-    db.header.block_in_file = cur_block->block_in_file + 1;
-    db.header.next_block = start_block_num;
-    db.header.previous_block = cur_block_num;
-    
-    int new_pos = DiskDriver_getFreeBlock(disk, 0);
+    // Keep the blocks of the directory close to each other
+    int new_pos = SimpleFS_allocBlockNear(d->sfs, cur_block_num + 1);
     if(new_pos == -1) {
+        SimpleFS_freeBlock(d->sfs, block);
         return -1;
     }
 
-    res = DiskDriver_writeBlock(disk, &db, new_pos);
+    DirectoryBlock *db = (DirectoryBlock *) SimpleFS_newBlock(d->sfs);
+    db->header.block_in_file = cur_block->block_in_file + 1;
+    db->header.next_block = start_block_num;
+    db->header.previous_block = cur_block_num;
+
+    res = DiskDriver_writeBlock(disk, db, new_pos);
     ONERROR(res == -1, "write failed");
+    SimpleFS_freeBlock(d->sfs, db);
 
     cur_block->next_block = new_pos;
     res = DiskDriver_writeBlock(disk, cur_block, cur_block_num);
     ONERROR(res == -1, "write failed");
+    SimpleFS_freeBlock(d->sfs, block);
 
     d->dcb->header.previous_block = new_pos;
     d->dcb->fcb.size_in_blocks++;
-    res = DiskDriver_writeBlock(disk, d->dcb, start_block_num);
-    ONERROR(res == -1, "write failed");
+    DirectoryHandle_write(d);
 
     return new_pos;
 }
 
-// Add the given block as a children of the directory d
-int SimpleFS_addToDirectory(DirectoryHandle *d, int child_pos) {
+// Add the given block, holding a file called name, as a children of the directory d
+int SimpleFS_addToDirectory(DirectoryHandle *d, int child_pos, const char *name) {
     int res;
     DiskDriver *disk = d->sfs->disk;
-    char block[BLOCK_SIZE];
+    DirectoryEntry entry = { child_pos, SimpleFS_hash(name) };
 
-    if(d->dcb->num_entries < FILES_IN_FIRST_DB) {
-        d->dcb->file_blocks[d->dcb->num_entries] = child_pos;
+    if(d->dcb->num_entries < FILES_IN_FIRST_DB(disk)) {
+        d->dcb->entries[d->dcb->num_entries] = entry;
     } else {
+        // The entry goes in the last DirectoryBlock (the previous block of
+        // the first one), or in a new block if that one is full. The last
+        // block is never empty, so the position in it follows from num_entries
+        int cur_block_num = d->dcb->header.previous_block;
+        int relative_pos = (d->dcb->num_entries - FILES_IN_FIRST_DB(disk)) % FILES_IN_DB(disk);
 
-        int cur_block_num = d->dcb->header.next_block;
-        int relative_pos = d->dcb->num_entries - FILES_IN_FIRST_DB;
-
-        // Allocate the first DirectoryBlock if it isn't there already
-        if(cur_block_num == d->dcb->fcb.block_in_disk) {
+        if(relative_pos == 0) {
             cur_block_num = SimpleFS_newDirBlock(d);
             if(cur_block_num == -1) return -1; // out of space
         }
 
-        res = DiskDriver_readBlock(disk, block, cur_block_num);
+        DirectoryBlock *cur_db = (DirectoryBlock *) DiskDriver_mapBlock(disk, cur_block_num);
+        ONERROR(!cur_db, "map failed");
+        cur_db->entries[relative_pos] = entry;
+        DiskDriver_unmapBlock(disk, cur_block_num);
+    }
+    
+    d->dcb->num_entries++;
+
+    // The hash index only speeds up lookups, so if there's no space
+    // for it the directory is left without. It's rebuilt with twice the
+    // buckets when they get too full, so that the chains stay short
+    res = 0;
+    if(d->dcb->fcb.index_block != -1) {
+        DirectoryHashIndex *root = (DirectoryHashIndex *) DiskDriver_mapBlock(disk, d->dcb->fcb.index_block);
+        ONERROR(!root, "map failed");
+        bool grow = SimpleFS_hashBuckets(disk, d->dcb->num_entries) > root->num_buckets;
+        DiskDriver_unmapBlock(disk, d->dcb->fcb.index_block);
+
+        if(grow) res = SimpleFS_hashIndexBuild(d);
+        else if(SimpleFS_hashIndexAdd(d->sfs, &d->dcb->fcb, entry) == -1) {
+            SimpleFS_hashIndexFree(disk, &d->dcb->fcb);
+            res = -1;
+        }
+    } else if(d->dcb->num_entries > FILES_IN_FIRST_DB(disk)) {
+        res = SimpleFS_hashIndexBuild(d);
+    }
+    if(res == -1) DBGPRINT("no space left for the hash index of %s", d->dcb->fcb.name);
+
+    DirectoryHandle_write(d);
+
+    return 0;
+}
+
+// Control block of the disks before version 2, which had no block index
+typedef struct {
+    int directory_block;
+    int block_in_disk;
+    char name[MAX_FILENAME_LEN];
+    int size_in_bytes;
+    int size_in_blocks;
+    int is_dir;
+} FileControlBlockV1;
+
+typedef struct {
+    BlockHeader header;
+    FileControlBlockV1 fcb;
+    char data[];
+} FirstFileBlockV1;
+
+typedef struct {
+    BlockHeader header;
+    FileControlBlockV1 fcb;
+    int num_entries;
+    int file_blocks[];
+} FirstDirectoryBlockV1;
+
+// Bytes taken from the data of a first block by the fields added in version 2
+#define FCB_V2_GROWTH ((int) (sizeof(FileControlBlock) - sizeof(FileControlBlockV1)))
+
+// Directory blocks of the disks before version 3, where the entries were just
+// the first blocks of the files
+typedef struct {
+    BlockHeader header;
+    FileControlBlock fcb;
+    int num_entries;
+    int file_blocks[];
+} FirstDirectoryBlockV2;
+
+typedef struct {
+    BlockHeader header;
+    int file_blocks[];
+} DirectoryBlockV2;
+
+// Rewrite the file in block, from a disk before version 2, with the control
+// block of version 2. The data moves forward by FCB_V2_GROWTH bytes along the
+// whole chain: the last bytes of each block go to the start of the next one,
+// and to a new last block if the old one had no room left for them
+static void SimpleFS_upgradeFile(SimpleFS *fs, int block) {
+    int res;
+    DiskDriver *disk = fs->disk;
+    char carry[FCB_V2_GROWTH], next_carry[FCB_V2_GROWTH];
+
+    FirstFileBlock *ffb = (FirstFileBlock *) DiskDriver_mapBlock(disk, block);
+    ONERROR(!ffb, "map failed");
+    FirstFileBlockV1 *old = (FirstFileBlockV1 *) ffb;
+    int old_in_first = disk->block_size - (int) sizeof(FirstFileBlockV1);
+    memcpy(carry, old->data + old_in_first - FCB_V2_GROWTH, FCB_V2_GROWTH);
+    memmove(ffb->data, old->data, old_in_first - FCB_V2_GROWTH);
+    ffb->fcb.index_block = -1;
+    ffb->fcb.index_depth = 0;
+
+    int last = block, num_blocks = 1;
+    for(int b = ffb->header.next_block; b != block; num_blocks++) {
+        FileBlock *fb = (FileBlock *) DiskDriver_mapBlock(disk, b);
+        ONERROR(!fb, "map failed");
+        memcpy(next_carry, fb->data + BYTES_IN_FB(disk) - FCB_V2_GROWTH, FCB_V2_GROWTH);
+        memmove(fb->data + FCB_V2_GROWTH, fb->data, BYTES_IN_FB(disk) - FCB_V2_GROWTH);
+        memcpy(fb->data, carry, FCB_V2_GROWTH);
+        memcpy(carry, next_carry, FCB_V2_GROWTH);
+
+        last = b;
+        b = fb->header.next_block;
+        DiskDriver_unmapBlock(disk, last);
+    }
+    ffb->fcb.size_in_blocks = num_blocks;
+
+    if(ffb->fcb.size_in_bytes > BYTES_IN_FIRST_FB(disk) + (num_blocks - 1) * BYTES_IN_FB(disk)) {
+        int pos = SimpleFS_allocBlockNear(fs, last + 1);
+        ONERROR(pos == -1, "not enough space to upgrade %s", ffb->fcb.name);
+        FileBlock *fb = (FileBlock *) SimpleFS_newBlock(fs);
+        fb->header.previous_block = last;
+        fb->header.next_block = block;
+        fb->header.block_in_file = num_blocks;
+        memcpy(fb->data, carry, FCB_V2_GROWTH);
+        res = DiskDriver_writeBlock(disk, fb, pos);
+        ONERROR(res == -1, "write failed");
+        SimpleFS_freeBlock(fs, fb);
+
+        if(last == block) {
+            ffb->header.next_block = pos;
+        } else {
+            BlockHeader *prev = (BlockHeader *) DiskDriver_mapBlock(disk, last);
+            ONERROR(!prev, "map failed");
+            prev->next_block = pos;
+            DiskDriver_unmapBlock(disk, last);
+        }
+        ffb->header.previous_block = pos;
+        ffb->fcb.size_in_blocks++;
+    }
+    DiskDriver_unmapBlock(disk, block);
+}
+
+// Rewrite the directory in dir_block, and all the ones below it, with the
+// entries of version 3. The old directory blocks are freed and the children
+// added again, which also builds the hash index of large directories.
+// On a disk of version 1 the files get the control block of version 2 too
+static void SimpleFS_upgradeDir(SimpleFS *fs, int dir_block, int version) {
+    int res;
+    DiskDriver *disk = fs->disk;
+    int in_db = (int) ((disk->block_size - sizeof(DirectoryBlockV2)) / sizeof(int));
+
+    FirstDirectoryBlockV2 *old = (FirstDirectoryBlockV2 *) SimpleFS_newBlock(fs);
+    res = DiskDriver_readBlock(disk, old, dir_block);
+    ONERROR(res == -1, "read failed");
+
+    // Collect the children. Before version 2 the control block was shorter,
+    // so the entries in the first block start earlier
+    FirstDirectoryBlockV1 *old_v1 = (FirstDirectoryBlockV1 *) old;
+    int num_entries = version < 2 ? old_v1->num_entries : old->num_entries;
+    int *first_entries = version < 2 ? old_v1->file_blocks : old->file_blocks;
+    int in_first = (int) ((disk->block_size - (version < 2 ? sizeof(FirstDirectoryBlockV1) :
+        sizeof(FirstDirectoryBlockV2))) / sizeof(int));
+    int *children = (int *) malloc(max(num_entries, 1) * sizeof(int));
+    ONERROR(!children, "malloc failed");
+    int count = min(num_entries, in_first);
+    memcpy(children, first_entries, count * sizeof(int));
+
+    DirectoryBlockV2 *db = (DirectoryBlockV2 *) SimpleFS_newBlock(fs);
+    for(int block = old->header.next_block; block != dir_block; ) {
+        res = DiskDriver_readBlock(disk, db, block);
         ONERROR(res == -1, "read failed");
-        DirectoryBlock *cur_db = (DirectoryBlock *)block;
+        int n = min(num_entries - count, in_db);
+        memcpy(children + count, db->file_blocks, n * sizeof(int));
+        count += n;
 
-        while(relative_pos >= FILES_IN_DB) {
-            
-            // Is this the end of the list? Allocate a new block if so
-            if(cur_db->header.next_block == d->dcb->fcb.block_in_disk) {
-                cur_block_num = SimpleFS_newDirBlock(d);
-                if(cur_block_num == -1) return -1; // out of space
-            } else {
-                cur_block_num = cur_db->header.next_block;
-            }
+        res = DiskDriver_freeBlock(disk, block);
+        ONERROR(res == -1, "free failed");
+        block = db->header.next_block;
+    }
+    SimpleFS_freeBlock(fs, db);
+
+    // Start again from an empty directory. The fields of version 1 are at the
+    // same place, the ones added later are set here
+    FirstDirectoryBlock *dcb = (FirstDirectoryBlock *) old;
+    dcb->header.next_block = dir_block;
+    dcb->header.previous_block = dir_block;
+    dcb->fcb.size_in_blocks = 1;
+    dcb->fcb.index_block = -1;
+    dcb->fcb.index_depth = 0;
+    dcb->num_entries = 0;
+    res = DiskDriver_writeBlock(disk, dcb, dir_block);
+    ONERROR(res == -1, "write failed");
 
-            res = DiskDriver_readBlock(disk, block, cur_block_num);
-            ONERROR(res == -1, "read failed");
-            
-            relative_pos -= FILES_IN_DB;
+    DirectoryHandle d = { .sfs = fs, .dcb = dcb, .current_block = &dcb->header };
+    FirstFileBlock *child = (FirstFileBlock *) SimpleFS_newBlock(fs);
+    for(int i = 0; i < count; i++) {
+        res = DiskDriver_readBlock(disk, child, children[i]);
+        ONERROR(res == -1, "read failed");
+        res = SimpleFS_addToDirectory(&d, children[i], child->fcb.name);
+        ONERROR(res == -1, "not enough space to upgrade %s", dcb->fcb.name);
+
+        if(child->fcb.is_dir) SimpleFS_upgradeDir(fs, children[i], version);
+        else if(version < 2) SimpleFS_upgradeFile(fs, children[i]);
+    }
+
+    SimpleFS_freeBlock(fs, child);
+    free(children);
+    SimpleFS_freeBlock(fs, dcb);
+}
+
+static void SimpleFS_upgrade(SimpleFS *fs) {
+    DBGPRINT("Upgrading the disk from version %d to %d", fs->disk->header->version, DISK_VERSION);
+    int version = fs->disk->header->version;
+
+    // Version 4 added the free queue, the field used to be a copy of num_blocks
+    if(version < 4) fs->disk->header->free_queue = -1;
+    // Version 3 added the hashes of the names to the directory entries, and
+    // version 2 the block index to the control blocks
+    if(version < 3) SimpleFS_upgradeDir(fs, 0, version);
+
+    fs->disk->header->version = DISK_VERSION;
+}
+
+// Remember the current size of the file in the dentry cache
+static void SimpleFS_cacheFcb(SimpleFS *fs, FileControlBlock *fcb) {
+    DentryCache_put(&fs->dentries, fcb->directory_block, fcb->name, SimpleFS_hash(fcb->name),
+        fcb->block_in_disk, fcb->is_dir, fcb->size_in_bytes);
+}
+
+// Look name up in the directory d, after it wasn't found in the dentry cache.
+// The cache is updated with the result (found or not)
+static int SimpleFS_lookupDisk(DirectoryHandle *d, const char *name, unsigned int hash, int *is_dir) {
+    DiskDriver *disk = d->sfs->disk;
+    int block;
+    if(d->dcb->fcb.index_block != -1) {
+        block = SimpleFS_hashIndexFind(disk, &d->dcb->fcb, name, hash);
+    } else {
+        FileIterator *it = FileIterator_new(d);
+        block = FileIterator_find(it, name, hash) ? it->ffb_block : -1;
+        FileIterator_close(it);
+    }
+
+    if(block == -1) {
+        DentryCache_put(&d->sfs->dentries, d->dcb->fcb.block_in_disk, name, hash, -1, 0, 0);
+        return -1;
+    }
+
+    FirstFileBlock *ffb = (FirstFileBlock *) DiskDriver_mapBlock(disk, block);
+    ONERROR(!ffb, "map failed");
+    SimpleFS_cacheFcb(d->sfs, &ffb->fcb);
+    if(is_dir) *is_dir = ffb->fcb.is_dir;
+    DiskDriver_unmapBlock(disk, block);
+    return block;
+}
+
+// Returns the first block of the file (or directory) called name in d, and
+// whether it's a directory in is_dir (unless it's NULL). The dentry cache is
+// checked first, and updated with the result (found or not)
+// returns -1 if there's no such file
+static int SimpleFS_lookup(DirectoryHandle *d, const char *name, int *is_dir) {
+    if(d->unlinked) return -1;
+    unsigned int hash = SimpleFS_hash(name);
+    DentryCacheEntry *e = DentryCache_get(&d->sfs->dentries, d->dcb->fcb.block_in_disk, name, hash);
+    if(e) {
+        if(is_dir) *is_dir = e->is_dir;
+        return e->block;
+    }
+    return SimpleFS_lookupDisk(d, name, hash, is_dir);
+}
+
+// Names can't contain '/', and "." and ".." are reserved for paths
+static bool SimpleFS_validName(const char *name) {
+    return name[0] && strlen(name) < MAX_FILENAME_LEN && !strchr(name, '/') &&
+        strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+// Returns the first block of the file (or directory) at path, and whether it's
+// a directory in is_dir. The path is relative to d unless it starts with '/'.
+// Names are looked up in the dentry cache, and the directories along the path
+// are read (through the block cache) only when a name isn't cached
+// returns -1 if there's no such file
+static int SimpleFS_walk(DirectoryHandle *d, const char *path, int *is_dir) {
+    DiskDriver *disk = d->sfs->disk;
+    if(path[0] != '/' && d->unlinked) return -1;
+    int block = path[0] == '/' ? 0 : d->dcb->fcb.block_in_disk;
+    char name[MAX_FILENAME_LEN];
+    *is_dir = 1;
+
+    while(*path) {
+        // Split the next name, repeated slashes are ignored
+        while(*path == '/') path++;
+        int len = strcspn(path, "/");
+        if(len == 0) break;
+        if(len >= MAX_FILENAME_LEN || !*is_dir) return -1;
+        memcpy(name, path, len);
+        name[len] = '\0';
+        path += len;
+
+        if(!strcmp(name, ".")) continue;
+
+        if(!strcmp(name, "..")) {
+            FirstDirectoryBlock *fdb = (FirstDirectoryBlock *) DiskDriver_mapBlock(disk, block);
+            ONERROR(!fdb, "map failed");
+            int parent = fdb->fcb.directory_block;
+            DiskDriver_unmapBlock(disk, block);
+            if(parent == -1) return -1; // the top level directory has no parent
+            block = parent;
+            continue;
         }
 
-        cur_db->file_blocks[relative_pos] = child_pos;
-        res = DiskDriver_writeBlock(disk, cur_db, cur_block_num);
-        ONERROR(res == -1, "write failed");
+        unsigned int hash = SimpleFS_hash(name);
+        DentryCacheEntry *e = DentryCache_get(&d->sfs->dentries, block, name, hash);
+        if(e) {
+            *is_dir = e->is_dir;
+            block = e->block;
+        } else if(block == d->dcb->fcb.block_in_disk) {
+            block = SimpleFS_lookupDisk(d, name, hash, is_dir);
+        } else {
+            DirectoryHandle dir = { .sfs = d->sfs };
+            dir.dcb = (FirstDirectoryBlock *) DiskDriver_mapBlock(disk, block);
+            ONERROR(!dir.dcb, "map failed");
+            int child = SimpleFS_lookupDisk(&dir, name, hash, is_dir);
+            DiskDriver_unmapBlock(disk, block);
+            block = child;
+        }
+        if(block == -1) return -1;
     }
+
+    return block;
+}
+
+// Returns the open file whose first block is block, NULL if it isn't open
+static OpenFile *SimpleFS_findOpenFile(SimpleFS *fs, int block) {
+    for(OpenFile *file = fs->open_files; file; file = file->next) {
+        if(file->ffb->fcb.block_in_disk == block) return file;
+    }
+    return NULL;
+}
+
+// Add a file to the open files of fs, ffb is owned by the open file from now on
+static OpenFile *SimpleFS_addOpenFile(SimpleFS *fs, FirstFileBlock *ffb) {
+    OpenFile *file = (OpenFile *) Pool_alloc(&fs->open_file_pool);
+    file->ffb = ffb;
+    pthread_rwlock_init(&file->lock, NULL);
+
+    file->next = fs->open_files;
+    if(fs->open_files) fs->open_files->prev = file;
+    fs->open_files = file;
+    return file;
+}
+
+// Open a new handle on file through the directory handle d
+static FileHandle *FileHandle_new(DirectoryHandle *d, OpenFile *file) {
+    FileHandle *fh = (FileHandle *) Pool_alloc(&d->sfs->file_handle_pool);
+    file->refs++;
+    fh->sfs = d->sfs;
+    fh->file = file;
+    fh->fcb = file->ffb;
+    fh->directory = d->dcb;
+    fh->current_block = &fh->fcb->header;
+    fh->current_block_pos = fh->fcb->fcb.block_in_disk;
+    fh->pos_in_file = 0;
+    for(int i = 0; i < FILE_SEEK_CHECKPOINTS; i++) fh->checkpoints[i].block_in_file = -1;
+    return fh;
+}
+
+static FileHandle *SimpleFS_createFileLocked(DirectoryHandle *d, const char *filename) {
+    int res;
+    if(d->unlinked || !SimpleFS_validName(filename)) return NULL;
+    if(SimpleFS_lookup(d, filename, NULL) != -1) {
+        DBGPRINT("found duplicate filename");
+        return NULL; // File exists
+    }
+
+    // There's no duplicate. Let's create the file
     
-    d->dcb->num_entries++;
-    res = DiskDriver_writeBlock(disk, d->dcb, d->dcb->fcb.block_in_disk);
+    DiskDriver *disk = d->sfs->disk;
+
+    int pos;
+    if((pos = SimpleFS_allocBlockNear(d->sfs, DISK_NO_HINT)) == -1) {
+        return NULL; // No space left on disk
+    }
+
+    FirstFileBlock *ffb = (FirstFileBlock *) SimpleFS_newBlock(d->sfs);
+    ffb->header.block_in_file = 0;
+    ffb->header.next_block = pos;
+    ffb->header.previous_block = pos;
+    ffb->fcb.directory_block = d->dcb->fcb.block_in_disk;
+    ffb->fcb.block_in_disk = pos;
+    strcpy(ffb->fcb.name, filename);
+    ffb->fcb.size_in_bytes = 0;
+    ffb->fcb.size_in_blocks = 1;
+    ffb->fcb.is_dir = 0;
+    ffb->fcb.index_block = -1;
+    ffb->fcb.index_depth = 0;
+
+    res = DiskDriver_writeBlock(disk, ffb, pos);
     ONERROR(res == -1, "write failed");
+    res = SimpleFS_addToDirectory(d, pos, filename);
+    if(res == -1) {
+        // No space left on device to expand the directory
+        res = DiskDriver_freeBlock(disk, pos);
+        ONERROR(res == -1, "free failed");
+        SimpleFS_freeBlock(d->sfs, ffb);
+        return NULL;
+    }
+    SimpleFS_cacheFcb(d->sfs, &ffb->fcb);
+
+    return FileHandle_new(d, SimpleFS_addOpenFile(d->sfs, ffb));
+}
+
+FileHandle *SimpleFS_createFile(DirectoryHandle *d, const char *filename) {
+    pthread_mutex_lock(&d->sfs->lock);
+    FileHandle *res = SimpleFS_createFileLocked(d, filename);
+    pthread_mutex_unlock(&d->sfs->lock);
+    return res;
+}
+
+int SimpleFS_readDir(char **names, DirectoryHandle *d) {
+    int names_len = 0;
+    
+    pthread_mutex_lock(&d->sfs->lock);
+    FileIterator *it = FileIterator_new(d);
+    FirstFileBlock *ffb;
+    while((ffb = FileIterator_next(it))) {
+        names[names_len++] = strdup(ffb->fcb.name);
+    }
+    FileIterator_close(it);
+    pthread_mutex_unlock(&d->sfs->lock);
+
+    return names_len;
+}
+
+int SimpleFS_readDirPlus(FileInfo *infos, DirectoryHandle *d) {
+    int num_infos = 0;
+
+    pthread_mutex_lock(&d->sfs->lock);
+    FileIterator *it = SimpleFS_openDir(d);
+    while(SimpleFS_nextDir(it, &infos[num_infos])) {
+        FileInfo *info = &infos[num_infos++];
+        // Listing a directory is often followed by opening something in it
+        DentryCache_put(&d->sfs->dentries, d->dcb->fcb.block_in_disk, info->name, SimpleFS_hash(info->name),
+            info->block, info->is_dir, info->size_in_bytes);
+    }
+    SimpleFS_closeDir(it);
+    pthread_mutex_unlock(&d->sfs->lock);
+
+    return num_infos;
+}
+
+// Fill info from the control block of a file on the disk. An open file may
+// have grown since its first block was written back, so the sizes come from
+// the one in memory. They're read atomically, a write may be changing them
+static void FileInfo_fill(SimpleFS *fs, FileInfo *info, FileControlBlock *fcb) {
+    OpenFile *file = fcb->is_dir ? NULL : SimpleFS_findOpenFile(fs, fcb->block_in_disk);
+    if(file) fcb = &file->ffb->fcb;
+    strcpy(info->name, fcb->name);
+    info->is_dir = fcb->is_dir;
+    info->size_in_bytes = __atomic_load_n(&fcb->size_in_bytes, __ATOMIC_RELAXED);
+    info->size_in_blocks = __atomic_load_n(&fcb->size_in_blocks, __ATOMIC_RELAXED);
+    info->block = fcb->block_in_disk;
+}
+
+FileIterator *SimpleFS_openDir(DirectoryHandle *d) {
+    pthread_mutex_lock(&d->sfs->lock);
+    FileIterator *it = FileIterator_new(d);
+    pthread_mutex_unlock(&d->sfs->lock);
+    return it;
+}
+
+int SimpleFS_nextDir(FileIterator *it, FileInfo *info) {
+    pthread_mutex_lock(&it->dir->sfs->lock);
+    FirstFileBlock *ffb = FileIterator_next(it);
+    if(ffb) FileInfo_fill(it->dir->sfs, info, &ffb->fcb);
+    pthread_mutex_unlock(&it->dir->sfs->lock);
+    return ffb != NULL;
+}
 
+void SimpleFS_closeDir(FileIterator *it) {
+    SimpleFS *fs = it->dir->sfs;
+    pthread_mutex_lock(&fs->lock);
+    FileIterator_close(it);
+    pthread_mutex_unlock(&fs->lock);
+}
+
+// Open the file whose first block is block through the handle d. The
+// handles on the same file share its first block, which is read only once
+static FileHandle *SimpleFS_openBlock(DirectoryHandle *d, int block) {
+    int res;
+    OpenFile *file = SimpleFS_findOpenFile(d->sfs, block);
+    if(file) return FileHandle_new(d, file);
+
+    FirstFileBlock *ffb = (FirstFileBlock *) SimpleFS_newBlock(d->sfs);
+    res = DiskDriver_readBlock(d->sfs->disk, ffb, block);
+    ONERROR(res == -1, "read failed");
+    if(ffb->fcb.is_dir) {
+        SimpleFS_freeBlock(d->sfs, ffb);
+        return NULL;
+    }
+    return FileHandle_new(d, SimpleFS_addOpenFile(d->sfs, ffb));
+}
+
+FileHandle *SimpleFS_openFile(DirectoryHandle *d, const char *filename) {
+    int is_dir;
+    FileHandle *fh = NULL;
+    pthread_mutex_lock(&d->sfs->lock);
+    int block = SimpleFS_lookup(d, filename, &is_dir);
+    if(block != -1 && !is_dir) {
+        fh = SimpleFS_openBlock(d, block);
+    }
+    pthread_mutex_unlock(&d->sfs->lock);
+    return fh;
+}
+
+FileHandle *SimpleFS_openPath(DirectoryHandle *d, const char *path) {
+    int is_dir;
+    FileHandle *fh = NULL;
+    pthread_mutex_lock(&d->sfs->lock);
+    int block = SimpleFS_walk(d, path, &is_dir);
+    if(block != -1 && !is_dir) {
+        fh = SimpleFS_openBlock(d, block);
+    }
+    pthread_mutex_unlock(&d->sfs->lock);
+    return fh;
+}
+
+static int SimpleFS_statPathLocked(DirectoryHandle *d, const char *path, FileInfo *info) {
+    int is_dir;
+    int block = SimpleFS_walk(d, path, &is_dir);
+    if(block == -1) return -1;
+
+    // The handle may hold changes to its directory that aren't on the disk yet
+    if(block == d->dcb->fcb.block_in_disk) {
+        FileInfo_fill(d->sfs, info, &d->dcb->fcb);
+        return 0;
+    }
+
+    FirstFileBlock *ffb = (FirstFileBlock *) DiskDriver_mapBlock(d->sfs->disk, block);
+    ONERROR(!ffb, "map failed");
+    FileInfo_fill(d->sfs, info, &ffb->fcb);
+    DiskDriver_unmapBlock(d->sfs->disk, block);
     return 0;
 }
 
-FileHandle *SimpleFS_createFile(DirectoryHandle *d, const char *filename) {
-    int res;
-    {
-        FileIterator *it = FileIterator_new(d);
-        FirstFileBlock *ffb;
-        while((ffb = FileIterator_next(it))) {
-            if(!strcmp(ffb->fcb.name, filename)) {
-                DBGPRINT("found duplicate filename");
-                FileIterator_close(it);
-                return NULL; // File exists
-            }
+int SimpleFS_statPath(DirectoryHandle *d, const char *path, FileInfo *info) {
+    pthread_mutex_lock(&d->sfs->lock);
+    int res = SimpleFS_statPathLocked(d, path, info);
+    pthread_mutex_unlock(&d->sfs->lock);
+    return res;
+}
+
+// Release current_block, unless it's the first block (owned by the handle)
+static void FileHandle_releaseBlock(FileHandle *f) {
+    if(f->current_block != (BlockHeader *) f->fcb) {
+        DiskDriver_unmapBlock(f->sfs->disk, f->current_block_pos);
+    }
+}
+
+// Move the handle to the block following current_block
+static void FileHandle_nextBlock(FileHandle *f) {
+    int next_block = f->current_block->next_block;
+    BlockHeader *next = (BlockHeader *) DiskDriver_mapBlock(f->sfs->disk, next_block);
+    ONERROR(!next, "map failed");
+    FileHandle_releaseBlock(f);
+    f->current_block = next;
+    f->current_block_pos = next_block;
+}
+
+// Move the handle to the block of the file in position block
+static void FileHandle_jump(FileHandle *f, int block) {
+    if(block == f->current_block_pos) return;
+    FileHandle_releaseBlock(f);
+    if(block == f->fcb->fcb.block_in_disk) {
+        f->current_block = &f->fcb->header;
+    } else {
+        f->current_block = (BlockHeader *) DiskDriver_mapBlock(f->sfs->disk, block);
+        ONERROR(!f->current_block, "map failed");
+    }
+    f->current_block_pos = block;
+}
+
+// Number of blocks covered by each entry of the root of the index
+static long SimpleFS_indexSpan(DiskDriver *disk, FileControlBlock *fcb) {
+    long span = 1;
+    for(int level = 1; level < fcb->index_depth; level++) span *= INDEX_ENTRIES(disk);
+    return span;
+}
+
+// Store in blocks the disk blocks of count blocks of the file from first on,
+// the file must have an index. The index is walked down once for each leaf
+// holding them, and the entries are copied from the leaf
+static void SimpleFS_indexGetRange(DiskDriver *disk, FileControlBlock *fcb, int first, int count, int *blocks) {
+    for(int i = 0; i < count; ) {
+        int block_in_file = first + i;
+        int node = fcb->index_block;
+        for(long span = SimpleFS_indexSpan(disk, fcb); span > 1; span /= INDEX_ENTRIES(disk)) {
+            int *entries = (int *) DiskDriver_mapBlock(disk, node);
+            ONERROR(!entries, "map failed");
+            int next = entries[(block_in_file / span) % INDEX_ENTRIES(disk)];
+            DiskDriver_unmapBlock(disk, node);
+
+            ONERROR(next == 0, "block %d of %s isn't in the index", block_in_file, fcb->name);
+            node = next;
+        }
+
+        int *leaf = (int *) DiskDriver_mapBlock(disk, node);
+        ONERROR(!leaf, "map failed");
+        for(int pos = block_in_file % INDEX_ENTRIES(disk); pos < INDEX_ENTRIES(disk) && i < count; pos++) {
+            ONERROR(leaf[pos] == 0, "block %d of %s isn't in the index", first + i, fcb->name);
+            blocks[i++] = leaf[pos];
+        }
+        DiskDriver_unmapBlock(disk, node);
+    }
+}
+
+// Returns the disk block of the given block of the file, which must have an index
+static int SimpleFS_indexGet(DiskDriver *disk, FileControlBlock *fcb, int block_in_file) {
+    int block;
+    SimpleFS_indexGetRange(disk, fcb, block_in_file, 1, &block);
+    return block;
+}
+
+// Prefetch the blocks after current_block, when the handle is about to move
+// to the next one. The window starts at FILE_READAHEAD_MIN blocks after a seek
+// and doubles every time the cursor reaches its second half, so that the
+// next window is loading while the current one is read
+static void FileHandle_readahead(FileHandle *f) {
+    DiskDriver *disk = f->sfs->disk;
+    FileControlBlock *fcb = &f->fcb->fcb;
+    int max_window = min(f->sfs->readahead_max, FILE_READAHEAD_MAX);
+
+    // Files without an index have a few blocks, and their chain can't be
+    // followed without reading the blocks
+    if(fcb->index_block == -1 || max_window <= 0) return;
+    int next = f->current_block->block_in_file + 1;
+    if(next < f->readahead_end - f->readahead_window / 2) return;
+
+    f->readahead_window = min(max(2 * f->readahead_window, FILE_READAHEAD_MIN), max_window);
+    int start = max(next, f->readahead_end);
+    int end = min(next + f->readahead_window, fcb->size_in_blocks);
+    if(start >= end) return;
+
+    int blocks[FILE_READAHEAD_MAX];
+    SimpleFS_indexGetRange(disk, fcb, start, end - start, blocks);
+    DiskDriver_prefetchBlocks(disk, blocks, end - start);
+    f->readahead_end = end;
+}
+
+// Record block_num as the disk block of the given block of the file,
+// adding index blocks as needed
+// returns -1 if there's no space left for them
+static int SimpleFS_indexSet(SimpleFS *fs, FileControlBlock *fcb, int block_in_file, int block_num) {
+    DiskDriver *disk = fs->disk;
+    if(fcb->index_block == -1) {
+        fcb->index_block = SimpleFS_newIndexBlock(fs, fcb->block_in_disk);
+        if(fcb->index_block == -1) return -1;
+        fcb->index_depth = 1;
+    }
+
+    // Add levels on top of the root until block_in_file is covered
+    long span = SimpleFS_indexSpan(disk, fcb);
+    while(block_in_file / span >= INDEX_ENTRIES(disk)) {
+        int root = SimpleFS_newIndexBlock(fs, fcb->index_block);
+        if(root == -1) return -1;
+
+        int *entries = (int *) DiskDriver_mapBlock(disk, root);
+        ONERROR(!entries, "map failed");
+        entries[0] = fcb->index_block;
+        DiskDriver_unmapBlock(disk, root);
+
+        fcb->index_block = root;
+        fcb->index_depth++;
+        span *= INDEX_ENTRIES(disk);
+    }
+
+    int node = fcb->index_block;
+    for(; ; span /= INDEX_ENTRIES(disk)) {
+        int *entries = (int *) DiskDriver_mapBlock(disk, node);
+        ONERROR(!entries, "map failed");
+        int *entry = &entries[(block_in_file / span) % INDEX_ENTRIES(disk)];
+
+        if(span == 1) {
+            *entry = block_num;
+            DiskDriver_unmapBlock(disk, node);
+            return 0;
+        }
+        if(*entry == 0) {
+            int child = SimpleFS_newIndexBlock(fs, node + 1);
+            if(child == -1) {
+                DiskDriver_unmapBlock(disk, node);
+                return -1;
+            }
+            *entry = child;
+        }
+        int next = *entry;
+        DiskDriver_unmapBlock(disk, node);
+        node = next;
+    }
+}
+
+static int SimpleFS_indexFreeNode(DiskDriver *disk, int node, int depth) {
+    int freed = 1;
+    if(depth > 1) {
+        int *entries = (int *) DiskDriver_mapBlock(disk, node);
+        ONERROR(!entries, "map failed");
+        for(int i = 0; i < INDEX_ENTRIES(disk); i++) {
+            if(entries[i] > 0) freed += SimpleFS_indexFreeNode(disk, entries[i], depth - 1);
+        }
+        DiskDriver_unmapBlock(disk, node);
+    }
+    int res = DiskDriver_freeBlock(disk, node);
+    ONERROR(res == -1, "free failed");
+    return freed;
+}
+
+// Free all the blocks of the index of the file
+// returns the number of blocks freed
+static int SimpleFS_indexFree(DiskDriver *disk, FileControlBlock *fcb) {
+    if(fcb->index_block == -1) return 0;
+    int freed = SimpleFS_indexFreeNode(disk, fcb->index_block, fcb->index_depth);
+    fcb->index_block = -1;
+    fcb->index_depth = 0;
+    return freed;
+}
+
+// Free the block index of a file, or the hash index of a directory
+// returns the number of blocks freed
+static int SimpleFS_freeIndex(DiskDriver *disk, FileControlBlock *fcb) {
+    if(fcb->is_dir) return SimpleFS_hashIndexFree(disk, fcb);
+    return SimpleFS_indexFree(disk, fcb);
+}
+
+// Add the len blocks appended to the file, starting from first_pos on the
+// disk, to its index, building the whole index if the file just became large enough.
+// The index only speeds up seeks, so if there's no space for it the file is left without
+static void SimpleFS_indexAppend(SimpleFS *fs, FirstFileBlock *ffb, int first_pos, int len) {
+    DiskDriver *disk = fs->disk;
+    int res = 0;
+    int first_block = ffb->fcb.block_in_disk;
+
+    if(ffb->fcb.index_block != -1) {
+        int block_in_file = ffb->fcb.size_in_blocks - len;
+        for(int i = 0; i < len && res != -1; i++) {
+            res = SimpleFS_indexSet(fs, &ffb->fcb, block_in_file + i, first_pos + i);
+        }
+    } else if(ffb->fcb.size_in_blocks > FILE_INDEX_MIN_BLOCKS) {
+        // Follow the chain once to index the blocks already in the file
+        for(int cur = ffb->header.next_block; cur != first_block && res != -1; ) {
+            BlockHeader *h = (BlockHeader *) DiskDriver_mapBlock(disk, cur);
+            ONERROR(!h, "map failed");
+            int block_in_file = h->block_in_file, next_block = h->next_block;
+            DiskDriver_unmapBlock(disk, cur);
+
+            res = SimpleFS_indexSet(fs, &ffb->fcb, block_in_file, cur);
+            cur = next_block;
+        }
+    }
+
+    if(res == -1) {
+        DBGPRINT("no space left for the index of %s", ffb->fcb.name);
+        SimpleFS_indexFree(disk, &ffb->fcb);
+    }
+}
+
+// Write back the first block of the file, if it was changed.
+// Called with the lock of the file held for writing.
+// A removed file is never read again, so it isn't written either
+// Write back the first block of the file, if it was changed. The first block of
+// a removed file is only written back when its blocks changed (with chain set),
+// so that the ones added after the removal are freed from the copy on the disk.
+// The free queue is linked through its directory_block there, which is kept
+static void OpenFile_flush(SimpleFS *fs, OpenFile *file, bool chain) {
+    if(!file->dirty) return;
+    // The file can't be removed and queued while it's written back
+    pthread_mutex_lock(&fs->lock);
+    if(!file->unlinked || chain) {
+        if(file->unlinked) {
+            file->ffb->fcb.directory_block = SimpleFS_queueNext(fs->disk, file->ffb->fcb.block_in_disk);
+        }
+        int res = DiskDriver_writeBlock(fs->disk, file->ffb, file->ffb->fcb.block_in_disk);
+        ONERROR(res == -1, "write failed");
+        file->dirty = 0;
+    }
+    pthread_mutex_unlock(&fs->lock);
+}
+
+int SimpleFS_fsync(FileHandle *f) {
+    pthread_rwlock_wrlock(&f->file->lock);
+    OpenFile_flush(f->sfs, f->file, false);
+    pthread_rwlock_unlock(&f->file->lock);
+    return DiskDriver_flush(f->sfs->disk);
+}
+
+int SimpleFS_close(FileHandle* f) {
+    if(f) {
+        SimpleFS *fs = f->sfs;
+        OpenFile *file = f->file;
+        pthread_rwlock_wrlock(&file->lock);
+        OpenFile_flush(fs, file, false);
+        pthread_rwlock_unlock(&file->lock);
+        FileHandle_releaseBlock(f);
+        Pool_free(&fs->file_handle_pool, f);
+
+        // The last handle on the file releases it, and frees its blocks if
+        // the file was removed in the meantime (see SimpleFS_removeLocked)
+        pthread_mutex_lock(&fs->lock);
+        if(--file->refs == 0) {
+            if(file->prev) file->prev->next = file->next;
+            else fs->open_files = file->next;
+            if(file->next) file->next->prev = file->prev;
+
+            if(file->unlinked) SimpleFS_freeUnlinked(fs, file->ffb);
+
+            pthread_rwlock_destroy(&file->lock);
+            SimpleFS_freeBlock(fs, file->ffb);
+            Pool_free(&fs->open_file_pool, file);
         }
-        FileIterator_close(it);
+        pthread_mutex_unlock(&fs->lock);
     }
+    return 0;
+}
 
-    // There's no duplicate. Let's create the file
-    
-    DiskDriver *disk = d->sfs->disk;
+// Append up to count empty blocks at the end of the file and move the handle
+// to the first one. current_block must be the last block of the file
+// returns -1 if there's no space left
+static int SimpleFS_appendBlocks(FileHandle *f, int count) {
+    DiskDriver *disk = f->sfs->disk;
 
-    int pos;
-    if((pos = DiskDriver_getFreeBlock(disk, 0)) == -1) {
-        return NULL; // No space left on disk
+    // Allocate the blocks contiguously after the current last block, if possible
+    int len;
+    int first_pos = SimpleFS_allocExtent(f->sfs, f->current_block_pos + 1, 1, count, &len);
+    if(first_pos == -1) {
+        return -1; // no space left
     }
 
-    if(strlen(filename) >= MAX_FILENAME_LEN) return NULL;
+    int first_block = f->fcb->fcb.block_in_disk;
+    BlockHeader *first_new = NULL;
+    for(int i = 0; i < len; i++) {
+        int fb_pos = first_pos + i;
+        FileBlock *fb = (FileBlock *) DiskDriver_mapBlock(disk, fb_pos);
+        ONERROR(!fb, "map failed");
 
-    FirstFileBlock *ffb = (FirstFileBlock *) calloc(1, sizeof(FirstFileBlock));
-    ONERROR(!ffb, "calloc failed");
-    ffb->header.block_in_file = 0;
-    ffb->header.next_block = pos;
-    ffb->header.previous_block = pos;
-    ffb->fcb.directory_block = d->dcb->fcb.block_in_disk;
-    ffb->fcb.block_in_disk = pos;
-    strcpy(ffb->fcb.name, filename);
-    ffb->fcb.size_in_bytes = 0;
-    ffb->fcb.size_in_blocks = 1;
-    ffb->fcb.is_dir = 0;
+        bzero(fb, disk->block_size);
+        fb->header.block_in_file = f->current_block->block_in_file + 1 + i;
+        fb->header.next_block = i == len - 1 ? first_block : fb_pos + 1;
+        fb->header.previous_block = i == 0 ? f->current_block_pos : fb_pos - 1;
 
-    res = DiskDriver_writeBlock(disk, ffb, pos);
-    ONERROR(res == -1, "write failed");
-    res = SimpleFS_addToDirectory(d, pos);
-    if(res == -1) {
-        // No space left on device to expand the directory
-        res = DiskDriver_freeBlock(disk, pos);
-        ONERROR(res == -1, "free failed");
-        return NULL;
+        if(i == 0) first_new = &fb->header;
+        else DiskDriver_unmapBlock(disk, fb_pos);
     }
 
-    FileHandle *fh = (FileHandle *) calloc(1, sizeof(FileHandle));
-    ONERROR(!fh, "calloc failed");
-    fh->sfs = d->sfs;
-    fh->fcb = ffb;
-    fh->directory = d->dcb;
-    fh->current_block = &ffb->header;
-    fh->current_block_pos = ffb->fcb.block_in_disk;
-    fh->pos_in_file = 0;
-    return fh;
+    // current_block is either mapped or the first block,
+    // which is written back by SimpleFS_write
+    f->current_block->next_block = first_pos;
+    f->fcb->header.previous_block = first_pos + len - 1;
+    f->fcb->fcb.size_in_blocks += len;
+    SimpleFS_indexAppend(f->sfs, f->fcb, first_pos, len);
+
+    // Move to the first new block, which is still mapped
+    FileHandle_releaseBlock(f);
+    f->current_block = first_new;
+    f->current_block_pos = first_pos;
+    return 0;
 }
 
-int SimpleFS_readDir(char **names, DirectoryHandle *d) {
-    int names_len = 0;
-    
-    FileIterator *it = FileIterator_new(d);
-    FirstFileBlock *ffb;
-    while((ffb = FileIterator_next(it))) {
-        names[names_len++] = strdup(ffb->fcb.name);
+// Append up to FILE_BULK_BATCH_BLOCKS blocks of data to the file, when the
+// handle is at the end of its last block. The blocks are reserved first, then
+// linked in memory and written with their data in a single batch of vectored
+// writes (the data isn't copied, apart from the last partial block).
+// The handle is left in the last new block
+// returns the number of bytes written, -1 if there isn't enough space or the
+// write fails, without changing the file
+static int SimpleFS_appendBulk(FileHandle *f, void *data, int size) {
+    SimpleFS *fs = f->sfs;
+    DiskDriver *disk = fs->disk;
+    int blocks[FILE_BULK_BATCH_BLOCKS];
+    BlockHeader headers[FILE_BULK_BATCH_BLOCKS];
+    void *heads[FILE_BULK_BATCH_BLOCKS], *tails[FILE_BULK_BATCH_BLOCKS];
+    int count = min((size + BYTES_IN_FB(disk) - 1) / BYTES_IN_FB(disk), FILE_BULK_BATCH_BLOCKS);
+    size = min(size, count * BYTES_IN_FB(disk));
+
+    // Reserve all the blocks, in as few extents as possible after the last block
+    int reserved = 0, len;
+    while(reserved < count) {
+        int pos = SimpleFS_allocExtent(fs, reserved ? blocks[reserved - 1] + 1 : f->current_block_pos + 1,
+            1, count - reserved, &len);
+        if(pos == -1) break;
+        for(int i = 0; i < len; i++) blocks[reserved++] = pos + i;
     }
-    FileIterator_close(it);
-
-    return names_len;
-}
-
-FileHandle *SimpleFS_openFile(DirectoryHandle *d, const char *filename) {
-    FileIterator *it = FileIterator_new(d);
-    FirstFileBlock *ffb;
-    while((ffb = FileIterator_next(it))) {
-        if(!strcmp(ffb->fcb.name, filename)) {
-
-            if(ffb->fcb.is_dir) {
-                FileIterator_close(it);
-                return NULL;
-            }
-            
-            // Copy so that we can free the iterator
-            FirstFileBlock *ffb_copy = (FirstFileBlock *) calloc(1, sizeof(FirstFileBlock));
-            ONERROR(!ffb_copy, "calloc failed");
-            memcpy(ffb_copy, ffb, sizeof(FirstFileBlock));
-            
-            FileHandle *fh = (FileHandle *) calloc(1, sizeof(FileHandle));
-            ONERROR(!fh, "calloc failed");
-            fh->sfs = d->sfs;
-            fh->fcb = ffb_copy;
-            fh->directory = d->dcb;
-            fh->current_block = &ffb_copy->header;
-            fh->current_block_pos = ffb_copy->fcb.block_in_disk;
-            fh->pos_in_file = 0;
 
-            FileIterator_close(it);
-            return fh;
+    int res = 0;
+    if(reserved == count) {
+        int first_block = f->fcb->fcb.block_in_disk;
+        int last_size = size - (count - 1) * BYTES_IN_FB(disk);
+        char *last = NULL;
+        for(int i = 0; i < count; i++) {
+            headers[i].block_in_file = f->current_block->block_in_file + 1 + i;
+            headers[i].previous_block = i == 0 ? f->current_block_pos : blocks[i - 1];
+            headers[i].next_block = i == count - 1 ? first_block : blocks[i + 1];
+            heads[i] = &headers[i];
+            tails[i] = (char *) data + (long) i * BYTES_IN_FB(disk);
         }
+        if(last_size < BYTES_IN_FB(disk)) {
+            last = (char *) SimpleFS_newBlock(fs);
+            memcpy(last, tails[count - 1], last_size);
+            tails[count - 1] = last;
+        }
+        res = DiskDriver_writeSplitBlocks(disk, heads, tails, sizeof(FileBlock), blocks, count);
+        SimpleFS_freeBlock(fs, last);
+    }
+    if(reserved < count || res == -1) {
+        for(int i = 0; i < reserved; i++) {
+            int res = DiskDriver_freeBlock(disk, blocks[i]);
+            ONERROR(res == -1, "free failed");
+        }
+        return -1;
     }
-    FileIterator_close(it);
-
-    // Not found
-    return NULL;
-}
 
-int SimpleFS_close(FileHandle* f) {
-    if(f) {
-        if(f->current_block != (BlockHeader *) f->fcb) free(f->current_block);
-        free(f->fcb);
-        free(f);
+    // Link the new blocks to the file, and index them one extent at a time
+    f->current_block->next_block = blocks[0];
+    f->fcb->header.previous_block = blocks[count - 1];
+    for(int i = 0; i < count; i += len) {
+        for(len = 1; i + len < count && blocks[i + len] == blocks[i] + len; len++);
+        f->fcb->fcb.size_in_blocks += len;
+        SimpleFS_indexAppend(fs, f->fcb, blocks[i], len);
     }
-    return 0;
+
+    FileHandle_jump(f, blocks[count - 1]);
+    f->pos_in_file += size;
+    f->fcb->fcb.size_in_bytes = max(f->fcb->fcb.size_in_bytes, f->pos_in_file);
+    return size;
 }
 
 // pos_in_file points to the next position to read/write in the file
 // current_block is the last block written to. If pos_in_file is just
 // after a block boundary, a block allocation may be needed if current_block
 // doesn't have a successor
+// All the blocks except the first one are modified in place through
+// their mapping, the first one is written back at the end
 
-int SimpleFS_write(FileHandle *f, void *data, int size) {
-    int res;
+static int SimpleFS_writeLocked(FileHandle *f, void *data, int size) {
     DiskDriver *disk = f->sfs->disk;
     int bytes_written = size;
+    int size_in_blocks = f->fcb->fcb.size_in_blocks;
+    if(size > 0) f->file->dirty = 1;
 
     while(size > 0) {
 
         // Fill up the current block
-        if(f->pos_in_file < BYTES_IN_FIRST_FB) {
-            int bytes_to_write = min(BYTES_IN_FIRST_FB - f->pos_in_file, size);
+        if(f->pos_in_file < BYTES_IN_FIRST_FB(disk)) {
+            int bytes_to_write = min(BYTES_IN_FIRST_FB(disk) - f->pos_in_file, size);
             memcpy(f->fcb->data + f->pos_in_file, data, bytes_to_write);
             f->fcb->fcb.size_in_bytes = max(
                 f->fcb->fcb.size_in_bytes,
@@ -400,55 +1544,32 @@ int SimpleFS_write(FileHandle *f, void *data, int size) {
             f->pos_in_file += bytes_to_write;
             
         } else {
-            int pos_in_block = (f->pos_in_file - BYTES_IN_FIRST_FB) % BYTES_IN_FB;
-            int bytes_to_write = min(size, BYTES_IN_FB - pos_in_block);
-
-            // Allocate a new block if needed
-            if(pos_in_block == 0 && f->current_block->next_block == f->fcb->fcb.block_in_disk) {
-                int cur_block_pos = f->fcb->header.previous_block;
-                
-                FileBlock *fb = (FileBlock *) calloc(1, sizeof(FileBlock));
-                fb->header.block_in_file = f->current_block->block_in_file + 1;
-                fb->header.next_block = f->current_block->next_block;
-                fb->header.previous_block = f->fcb->header.previous_block;
-                
-                int fb_pos = DiskDriver_getFreeBlock(disk, 0);
-                if(fb_pos == -1) {
+            int pos_in_block = (f->pos_in_file - BYTES_IN_FIRST_FB(disk)) % BYTES_IN_FB(disk);
+            int bytes_to_write = min(size, BYTES_IN_FB(disk) - pos_in_block);
+
+            // Allocate the blocks for the rest of the data if needed. Large
+            // appends write the new blocks in batches
+            int new_blocks = (size + BYTES_IN_FB(disk) - 1) / BYTES_IN_FB(disk);
+            if(pos_in_block == 0 && f->current_block->next_block == f->fcb->fcb.block_in_disk &&
+                    new_blocks >= FILE_BULK_WRITE_BLOCKS) {
+                // No batch is written if the disk can't hold all of them
+                int written = SimpleFS_hasFree(f->sfs, new_blocks) ? SimpleFS_appendBulk(f, data, size) : -1;
+                if(written == -1) {
                     return -1; // no space left
                 }
-                f->current_block->next_block = fb_pos;
-                f->fcb->header.previous_block = fb_pos;
-
-                f->fcb->fcb.size_in_blocks++;
-
-                res = DiskDriver_writeBlock(disk, f->current_block, cur_block_pos);
-                ONERROR(res == -1, "write failed");
-                res = DiskDriver_writeBlock(disk, fb, fb_pos);
-                ONERROR(res == -1, "write failed");
-                
-                if(f->current_block != (BlockHeader *) f->fcb) {
-                    free(f->current_block);
+                size -= written;
+                data += written;
+                continue;
+            } else if(pos_in_block == 0 && f->current_block->next_block == f->fcb->fcb.block_in_disk) {
+                if(SimpleFS_appendBlocks(f, new_blocks) == -1) {
+                    return -1; // no space left
                 }
-                f->current_block = (BlockHeader *) fb;
-                f->current_block_pos = fb_pos;
-
             } else if(pos_in_block == 0) {
                 // Move to the next block
-                int next_block = f->current_block->next_block;
-                FileBlock *fb = (FileBlock *) calloc(1, sizeof(FileBlock));
-                ONERROR(!fb, "calloc failed");
-                res = DiskDriver_readBlock(disk, fb, next_block);
-                ONERROR(res == -1, "read failed");
-                if(f->current_block != (BlockHeader *) f->fcb) {
-                    free(f->current_block);
-                }
-                f->current_block_pos = next_block;
-                f->current_block = (BlockHeader *) fb;
+                FileHandle_nextBlock(f);
             }
 
             memcpy(((FileBlock *)f->current_block)->data + pos_in_block, data, bytes_to_write);
-            res = DiskDriver_writeBlock(disk, f->current_block, f->current_block_pos);
-            ONERROR(res == -1, "write failed");
             
             f->fcb->fcb.size_in_bytes = max(
                 f->fcb->fcb.size_in_bytes,
@@ -461,14 +1582,26 @@ int SimpleFS_write(FileHandle *f, void *data, int size) {
         }
     }
 
-    res = DiskDriver_writeBlock(f->sfs->disk, f->fcb, f->fcb->fcb.block_in_disk);
-    ONERROR(res == -1, "write failed");
+    // Small writes only change the first block in memory, it's written back
+    // when the file gets new blocks, so that the chain on the disk is complete
+    if(f->fcb->fcb.size_in_blocks != size_in_blocks) OpenFile_flush(f->sfs, f->file, true);
+    // The name of a removed file must not come back
+    pthread_mutex_lock(&f->sfs->lock);
+    if(!f->file->unlinked) SimpleFS_cacheFcb(f->sfs, &f->fcb->fcb);
+    pthread_mutex_unlock(&f->sfs->lock);
     return bytes_written;
 }
 
+int SimpleFS_write(FileHandle *f, void *data, int size) {
+    pthread_rwlock_wrlock(&f->file->lock);
+    int res = SimpleFS_writeLocked(f, data, size);
+    pthread_rwlock_unlock(&f->file->lock);
+    return res;
+}
+
 int SimpleFS_read(FileHandle *f, void *data, int size) {
-    int res;
     DiskDriver *disk = f->sfs->disk;
+    pthread_rwlock_rdlock(&f->file->lock);
 
     // If we don't have that many bytes, truncate the request
     if(f->pos_in_file + size > f->fcb->fcb.size_in_bytes) {
@@ -478,8 +1611,8 @@ int SimpleFS_read(FileHandle *f, void *data, int size) {
 
     while(size > 0) {
 
-        if(f->pos_in_file < BYTES_IN_FIRST_FB) {
-            int bytes_to_read = min(BYTES_IN_FIRST_FB - f->pos_in_file, size);
+        if(f->pos_in_file < BYTES_IN_FIRST_FB(disk)) {
+            int bytes_to_read = min(BYTES_IN_FIRST_FB(disk) - f->pos_in_file, size);
             memcpy(data, f->fcb->data + f->pos_in_file, bytes_to_read);
 
             size -= bytes_to_read;
@@ -487,8 +1620,8 @@ int SimpleFS_read(FileHandle *f, void *data, int size) {
             f->pos_in_file += bytes_to_read;
             
         } else {
-            int pos_in_block = (f->pos_in_file - BYTES_IN_FIRST_FB) % BYTES_IN_FB;
-            int bytes_to_read = min(size, BYTES_IN_FB - pos_in_block);
+            int pos_in_block = (f->pos_in_file - BYTES_IN_FIRST_FB(disk)) % BYTES_IN_FB(disk);
+            int bytes_to_read = min(size, BYTES_IN_FB(disk) - pos_in_block);
 
             // Load the next block
             if(pos_in_block == 0) {
@@ -497,16 +1630,8 @@ int SimpleFS_read(FileHandle *f, void *data, int size) {
                 ONERROR(f->current_block->next_block == f->fcb->fcb.block_in_disk,
                     "read: end of file reached while reading data");
                 
-                int next_block = f->current_block->next_block;
-                FileBlock *fb = (FileBlock *) calloc(1, sizeof(FileBlock));
-                ONERROR(!fb, "calloc failed");
-                res = DiskDriver_readBlock(disk, fb, next_block);
-                ONERROR(res == -1, "read failed");
-                if(f->current_block != (BlockHeader *) f->fcb) {
-                    free(f->current_block);
-                }
-                f->current_block_pos = next_block;
-                f->current_block = (BlockHeader *) fb;
+                FileHandle_readahead(f);
+                FileHandle_nextBlock(f);
             }
 
             memcpy(data, ((FileBlock *)f->current_block)->data + pos_in_block, bytes_to_read);
@@ -517,162 +1642,134 @@ int SimpleFS_read(FileHandle *f, void *data, int size) {
         }
     }
 
+    pthread_rwlock_unlock(&f->file->lock);
     return bytes_read;
 }
 
-int SimpleFS_seek(FileHandle *f, int pos) {
-    int res;
+// Returns the block of the file holding the byte before pos, which is
+// the current block of a handle whose cursor is at pos
+static int SimpleFS_blockOfPos(DiskDriver *disk, int pos) {
+    if(pos <= BYTES_IN_FIRST_FB(disk)) return 0;
+    return 1 + (pos - BYTES_IN_FIRST_FB(disk) - 1) / BYTES_IN_FB(disk);
+}
+
+// Remember the current block of the handle as a starting point for the next seeks
+static void FileHandle_addCheckpoint(FileHandle *f) {
+    int block_in_file = f->current_block->block_in_file;
+    // The first and the last block are always known
+    if(block_in_file == 0 || block_in_file == f->fcb->fcb.size_in_blocks - 1) return;
+    for(int i = 0; i < FILE_SEEK_CHECKPOINTS; i++) {
+        if(f->checkpoints[i].block_in_file == block_in_file) return;
+    }
+    f->checkpoints[f->next_checkpoint] = (SeekCheckpoint) { block_in_file, f->current_block_pos };
+    f->next_checkpoint = (f->next_checkpoint + 1) % FILE_SEEK_CHECKPOINTS;
+}
+
+static int SimpleFS_seekLocked(FileHandle *f, int pos) {
     DiskDriver *disk = f->sfs->disk;
+    FileControlBlock *fcb = &f->fcb->fcb;
 
     // If we don't have that many bytes, truncate the request
-    if(pos > f->fcb->fcb.size_in_bytes || pos < 0) {
+    if(pos > fcb->size_in_bytes || pos < 0) {
         return -1;
     }
     int moved_by = pos - f->pos_in_file;
-
-    // If we need to rewind, go back
-    if(pos < f->pos_in_file) {
-        if(f->current_block == (BlockHeader *) f->fcb) {
-            f->pos_in_file = 0;
-        } else {
-            free(f->current_block);
-            f->current_block = &f->fcb->header;
-            f->current_block_pos = f->fcb->fcb.block_in_disk;
-            f->pos_in_file = 0;
+    f->readahead_window = 0;
+    f->readahead_end = 0;
+    f->pos_in_file = pos;
+
+    // Start from the closest block whose position on the disk is known.
+    // The files don't shrink, so the checkpoints stay valid
+    int target = SimpleFS_blockOfPos(disk, pos);
+    int from = f->current_block->block_in_file, from_block = f->current_block_pos;
+    SeekCheckpoint known[FILE_SEEK_CHECKPOINTS + 2] = {
+        { 0, fcb->block_in_disk },
+        { fcb->size_in_blocks - 1, f->fcb->header.previous_block }
+    };
+    memcpy(known + 2, f->checkpoints, sizeof(f->checkpoints));
+    for(int i = 0; i < FILE_SEEK_CHECKPOINTS + 2; i++) {
+        if(known[i].block_in_file == -1) continue;
+        if(abs(target - known[i].block_in_file) < abs(target - from)) {
+            from = known[i].block_in_file;
+            from_block = known[i].block;
         }
-    } else {
-        pos -= f->pos_in_file;
     }
 
-
-    while(pos > 0) {
-
-        if(f->pos_in_file < BYTES_IN_FIRST_FB) {
-            int bytes_to_read = min(BYTES_IN_FIRST_FB - f->pos_in_file, pos);
-
-            pos -= bytes_to_read;
-            f->pos_in_file += bytes_to_read;
-            
-        } else {
-            int pos_in_block = (f->pos_in_file - BYTES_IN_FIRST_FB) % BYTES_IN_FB;
-            int bytes_to_read = min(pos, BYTES_IN_FB - pos_in_block);
-
-            // Load the next block
-            if(pos_in_block == 0) {
-
-                // We should never reach the end of the file with more data to read, as we truncated the request before
-                ONERROR(f->current_block->next_block == f->fcb->fcb.block_in_disk,
-                    "seek: end of file reached while moving");
-                
-                int next_block = f->current_block->next_block;
-                FileBlock *fb = (FileBlock *) calloc(1, sizeof(FileBlock));
-                ONERROR(!fb, "calloc failed");
-                res = DiskDriver_readBlock(disk, fb, next_block);
-                ONERROR(res == -1, "read failed");
-                if(f->current_block != (BlockHeader *) f->fcb) {
-                    free(f->current_block);
-                }
-                f->current_block_pos = next_block;
-                f->current_block = (BlockHeader *) fb;
-            }
-
-            pos -= bytes_to_read;
-            f->pos_in_file += bytes_to_read;
-        }
+    // Large files go straight to the block through their index, unless
+    // following the chain takes fewer blocks
+    if(fcb->index_block != -1 && abs(target - from) > fcb->index_depth) {
+        FileHandle_jump(f, SimpleFS_indexGet(disk, fcb, target));
+        return moved_by;
     }
 
+    FileHandle_jump(f, from_block);
+    while(f->current_block->block_in_file < target) {
+        FileHandle_nextBlock(f);
+    }
+    while(f->current_block->block_in_file > target) {
+        FileHandle_jump(f, f->current_block->previous_block);
+    }
+    FileHandle_addCheckpoint(f);
     return moved_by;
 }
 
-int SimpleFS_changeDir(DirectoryHandle *d, char *dirname) {
-    int res;
-
-    if(!strcmp(".", dirname)) {
-        return 0;
-    }
-
-    if(!strcmp("..", dirname)) {
-        if(d->directory != NULL) {
-            
-            free(d->dcb);
-            d->dcb = d->directory;
-            d->current_block = &d->directory->header;
-            d->pos_in_dir = 0;
-            d->pos_in_block = 0;
-
-            if(d->dcb->fcb.directory_block != -1) {
-                FirstDirectoryBlock *fdb = (FirstDirectoryBlock *) calloc(1, sizeof(FirstDirectoryBlock));
-                ONERROR(!fdb, "calloc failed");
-                res = DiskDriver_readBlock(d->sfs->disk, fdb, d->dcb->fcb.directory_block);
-                ONERROR(res == -1, "read failed");
-                d->directory = fdb;
-            } else {
-                d->directory = NULL;
-            }
-
-            return 0;
+int SimpleFS_seek(FileHandle *f, int pos) {
+    pthread_rwlock_rdlock(&f->file->lock);
+    int res = SimpleFS_seekLocked(f, pos);
+    pthread_rwlock_unlock(&f->file->lock);
+    return res;
+}
 
-        } else return -1;
+static int SimpleFS_changeDirLocked(DirectoryHandle *d, char *dirname) {
+    int is_dir;
+    int block = SimpleFS_walk(d, dirname, &is_dir);
+    if(block == -1 || !is_dir) {
+        return -1; // not found
     }
-
-    if(!strcmp("/", dirname)) {
-        free(d->dcb);
-        if(d->directory) free(d->directory);
-        d->directory = NULL;
-        d->pos_in_dir = 0;
-        d->pos_in_block = 0;
-
-        FirstDirectoryBlock *fdb = (FirstDirectoryBlock *) calloc(1, sizeof(FirstDirectoryBlock));
-        ONERROR(!fdb, "calloc failed");
-        res = DiskDriver_readBlock(d->sfs->disk, fdb, 0);
-        ONERROR(res == -1, "read failed");
-        d->dcb = fdb;
-        d->current_block = &fdb->header;
+    if(block == d->dcb->fcb.block_in_disk) {
         return 0;
     }
+    return DirectoryHandle_load(d, block);
+}
 
-    FileIterator *it = FileIterator_new(d);
-    FirstFileBlock *ffb;
-    while((ffb = FileIterator_next(it))) {
-        if(ffb->fcb.is_dir && !strcmp(ffb->fcb.name, dirname)) {
-            
-            // Copy so that we can free the iterator
-            // Here we use the fact that the layout for directory/file first
-            // blocks is identical up to the fcb, so we can safely read
-            // is_dir/name and cast to a directory block
-            FirstDirectoryBlock *fdb_copy = (FirstDirectoryBlock *) calloc(1, sizeof(FirstDirectoryBlock));
-            ONERROR(!fdb_copy, "calloc failed");
-            memcpy(fdb_copy, ffb, sizeof(FirstDirectoryBlock));
-            
-            free(d->directory);
-            d->directory = d->dcb;
-            d->dcb = fdb_copy;
-            d->current_block = &fdb_copy->header;
-            d->pos_in_dir = 0;
-            d->pos_in_block = 0;
-
-            FileIterator_close(it);
-            return 0;
-        }
+int SimpleFS_changeDir(DirectoryHandle *d, char *dirname) {
+    pthread_mutex_lock(&d->sfs->lock);
+    int res = SimpleFS_changeDirLocked(d, dirname);
+    pthread_mutex_unlock(&d->sfs->lock);
+    return res;
+}
+
+DirectoryHandle *SimpleFS_openDirectory(DirectoryHandle *d, const char *path) {
+    int is_dir;
+    DirectoryHandle *handle = NULL;
+    pthread_mutex_lock(&d->sfs->lock);
+    int block = SimpleFS_walk(d, path, &is_dir);
+    if(block != -1 && is_dir) {
+        handle = DirectoryHandle_new(d->sfs, block);
     }
-    FileIterator_close(it);
+    pthread_mutex_unlock(&d->sfs->lock);
+    return handle;
+}
 
-    return -1; // not found
+void SimpleFS_closeDirectory(DirectoryHandle *d) {
+    SimpleFS *fs = d->sfs;
+    pthread_mutex_lock(&fs->lock);
+    if(d->prev) d->prev->next = d->next;
+    else fs->handles = d->next;
+    if(d->next) d->next->prev = d->prev;
+    pthread_mutex_unlock(&fs->lock);
+
+    SimpleFS_freeBlock(fs, d->dcb);
+    SimpleFS_freeBlock(fs, d->directory);
+    Pool_free(&fs->dir_handle_pool, d);
 }
 
-int SimpleFS_mkDir(DirectoryHandle *d, char *dirname) {
+static int SimpleFS_mkDirLocked(DirectoryHandle *d, char *dirname) {
     int res;
-    {
-        FileIterator *it = FileIterator_new(d);
-        FirstFileBlock *ffb;
-        while((ffb = FileIterator_next(it))) {
-            if(!strcmp(ffb->fcb.name, dirname)) {
-                DBGPRINT("found duplicate filename");
-                FileIterator_close(it);
-                return -1; // File exists
-            }
-        }
-        FileIterator_close(it);
+    if(d->unlinked || !SimpleFS_validName(dirname)) return -1;
+    if(SimpleFS_lookup(d, dirname, NULL) != -1) {
+        DBGPRINT("found duplicate filename");
+        return -1; // File exists
     }
 
     // There's no duplicate. Let's create the directory
@@ -680,153 +1777,422 @@ int SimpleFS_mkDir(DirectoryHandle *d, char *dirname) {
     DiskDriver *disk = d->sfs->disk;
 
     int pos;
-    if((pos = DiskDriver_getFreeBlock(disk, 0)) == -1) {
+    if((pos = SimpleFS_allocBlockNear(d->sfs, DISK_NO_HINT)) == -1) {
         return -1; // No space left on disk
     }
 
-    if(strlen(dirname) >= MAX_FILENAME_LEN) return -1;
-
-    FirstDirectoryBlock ffb = {0};
-    ffb.header.block_in_file = 0;
-    ffb.header.next_block = pos;
-    ffb.header.previous_block = pos;
-    ffb.fcb.directory_block = d->dcb->fcb.block_in_disk;
-    ffb.fcb.block_in_disk = pos;
-    strcpy(ffb.fcb.name, dirname);
-    ffb.fcb.size_in_bytes = 0;
-    ffb.fcb.size_in_blocks = 1;
-    ffb.fcb.is_dir = 1;
+    FirstDirectoryBlock *ffb = (FirstDirectoryBlock *) SimpleFS_newBlock(d->sfs);
+    ffb->header.block_in_file = 0;
+    ffb->header.next_block = pos;
+    ffb->header.previous_block = pos;
+    ffb->fcb.directory_block = d->dcb->fcb.block_in_disk;
+    ffb->fcb.block_in_disk = pos;
+    strcpy(ffb->fcb.name, dirname);
+    ffb->fcb.size_in_bytes = 0;
+    ffb->fcb.size_in_blocks = 1;
+    ffb->fcb.is_dir = 1;
+    ffb->fcb.index_block = -1;
+    ffb->fcb.index_depth = 0;
 
-    res = DiskDriver_writeBlock(disk, &ffb, pos);
+    res = DiskDriver_writeBlock(disk, ffb, pos);
     ONERROR(res == -1, "write failed");
-    res = SimpleFS_addToDirectory(d, pos);
+    res = SimpleFS_addToDirectory(d, pos, dirname);
     if(res == -1) {
         // No space left to expand directory
         res = DiskDriver_freeBlock(disk, pos);
         ONERROR(res == -1, "free failed");
+        SimpleFS_freeBlock(d->sfs, ffb);
         return -1;
     }
+    // The block may have been used by a directory removed in the background,
+    // whose names are still cached
+    DentryCache_invalidateDir(&d->sfs->dentries, pos);
+    SimpleFS_cacheFcb(d->sfs, &ffb->fcb);
+    SimpleFS_freeBlock(d->sfs, ffb);
     return 0;
 }
 
-// Free the linked list of blocks starting with the given header
-static int SimpleFS_removeblocks(DiskDriver *disk, BlockHeader *b, int first_block) {
+int SimpleFS_mkDir(DirectoryHandle *d, char *dirname) {
+    pthread_mutex_lock(&d->sfs->lock);
+    int res = SimpleFS_mkDirLocked(d, dirname);
+    pthread_mutex_unlock(&d->sfs->lock);
+    return res;
+}
+
+// Remove the last entry of the directory and return it. If it was the only
+// entry in the last DirectoryBlock (the previous block of the first one),
+// that block is freed. The first block isn't written
+static DirectoryEntry SimpleFS_popEntry(DiskDriver *disk, FirstDirectoryBlock *dcb) {
     int res;
-    int cur_block = first_block;
-    char block[BLOCK_SIZE];
+    int last_pos = dcb->num_entries - 1;
+    DirectoryEntry last_entry;
 
-    res = DiskDriver_freeBlock(disk, cur_block);
-    ONERROR(res == -1, "free failed");
-    cur_block = b->next_block;
+    if(last_pos < FILES_IN_FIRST_DB(disk)) {
+        last_entry = dcb->entries[last_pos];
+    } else {
+        int tail_block = dcb->header.previous_block;
+        int relative_pos = (last_pos - FILES_IN_FIRST_DB(disk)) % FILES_IN_DB(disk);
+        DirectoryBlock *tail = (DirectoryBlock *) DiskDriver_mapBlock(disk, tail_block);
+        ONERROR(!tail, "map failed");
+        last_entry = tail->entries[relative_pos];
+        int new_tail_block = tail->header.previous_block;
+        DiskDriver_unmapBlock(disk, tail_block);
+
+        if(relative_pos == 0) {
+            if(new_tail_block == dcb->fcb.block_in_disk) {
+                dcb->header.next_block = dcb->fcb.block_in_disk;
+            } else {
+                DirectoryBlock *new_tail = (DirectoryBlock *) DiskDriver_mapBlock(disk, new_tail_block);
+                ONERROR(!new_tail, "map failed");
+                new_tail->header.next_block = dcb->fcb.block_in_disk;
+                DiskDriver_unmapBlock(disk, new_tail_block);
+            }
+            dcb->header.previous_block = new_tail_block;
+            res = DiskDriver_freeBlock(disk, tail_block);
+            ONERROR(res == -1, "free failed");
+            dcb->fcb.size_in_blocks--;
+        }
+    }
 
-    while(cur_block != first_block) {
-        res = DiskDriver_readBlock(disk, block, cur_block);
-        ONERROR(res == -1, "read failed");
-        res = DiskDriver_freeBlock(disk, cur_block);
+    dcb->num_entries--;
+    return last_entry;
+}
+
+// Free up to max_blocks blocks at the end of the file, the first block excluded.
+// They're found through the block index if the file has one, so the data blocks
+// aren't read, otherwise by following previous_block from the last one
+// returns the number of blocks freed
+static int SimpleFS_freeTail(DiskDriver *disk, FirstFileBlock *ffb, int max_blocks) {
+    int res, i;
+    for(i = 0; i < max_blocks && ffb->fcb.size_in_blocks > 1; i++) {
+        int block;
+        if(ffb->fcb.index_block != -1) {
+            block = SimpleFS_indexGet(disk, &ffb->fcb, ffb->fcb.size_in_blocks - 1);
+        } else {
+            block = ffb->header.previous_block;
+            FileBlock *fb = (FileBlock *) DiskDriver_mapBlock(disk, block);
+            ONERROR(!fb, "map failed");
+            ffb->header.previous_block = fb->header.previous_block;
+            DiskDriver_unmapBlock(disk, block);
+        }
+
+        res = DiskDriver_freeBlock(disk, block);
         ONERROR(res == -1, "free failed");
-        b = (BlockHeader *)block;
-        cur_block = b->next_block;
+        ffb->fcb.size_in_blocks--;
     }
+    return i;
+}
 
-    return 0;
+// Free the first block of a file (or an empty directory) and its index
+// returns the number of blocks freed
+static int SimpleFS_freeFirst(DiskDriver *disk, FirstFileBlock *ffb) {
+    int freed = SimpleFS_freeIndex(disk, &ffb->fcb);
+    int res = DiskDriver_freeBlock(disk, ffb->fcb.block_in_disk);
+    ONERROR(res == -1, "free failed");
+    return freed + 1;
 }
 
-// Remove all the contents of the given folder. The folder is not removed, and is not updated to reflect the missing files
-int SimpleFS_removecontents(DiskDriver *disk, FirstDirectoryBlock *fdb) {
-    int res;
-    BlockHeader *h = &fdb->header;
-    int first_block = fdb->fcb.block_in_disk;
-    FirstFileBlock ffb;
-    DirectoryBlock db;
-    int entries = fdb->num_entries;
-
-    for(int i = 0; i < entries && i < FILES_IN_FIRST_DB; i++) {
-        res = DiskDriver_readBlock(disk, &ffb, fdb->file_blocks[i]);
-        ONERROR(res == -1, "read failed");
-        if(ffb.fcb.is_dir) {
-            SimpleFS_removecontents(disk, (FirstDirectoryBlock *)&ffb);
+// Returns the entry after block in the free queue
+static int SimpleFS_queueNext(DiskDriver *disk, int block) {
+    FirstFileBlock *ffb = (FirstFileBlock *) DiskDriver_mapBlock(disk, block);
+    ONERROR(!ffb, "map failed");
+    int next = ffb->fcb.directory_block;
+    DiskDriver_unmapBlock(disk, block);
+    return next;
+}
+
+// Make next the entry after prev in the free queue, or the first one if prev is -1
+static void SimpleFS_queueLink(DiskDriver *disk, int prev, int next) {
+    if(prev == -1) {
+        disk->header->free_queue = next;
+        return;
+    }
+    FirstFileBlock *ffb = (FirstFileBlock *) DiskDriver_mapBlock(disk, prev);
+    ONERROR(!ffb, "map failed");
+    ffb->fcb.directory_block = next;
+    DiskDriver_unmapBlock(disk, prev);
+}
+
+// Free a removed file at its last close, taking it out of the free queue. A file
+// below a removed directory may not have been moved to the queue yet, it's
+// left to SimpleFS_reclaim. ffb is the first block in memory, which is up to date
+static void SimpleFS_freeUnlinked(SimpleFS *fs, FirstFileBlock *ffb) {
+    DiskDriver *disk = fs->disk;
+    int block = ffb->fcb.block_in_disk;
+    int prev = -1;
+    for(int entry = disk->header->free_queue; entry != -1; entry = SimpleFS_queueNext(disk, entry)) {
+        if(entry == block) {
+            SimpleFS_queueLink(disk, prev, SimpleFS_queueNext(disk, block));
+            SimpleFS_freeTail(disk, ffb, INT_MAX);
+            SimpleFS_freeFirst(disk, ffb);
+            return;
         }
-        SimpleFS_removeblocks(disk, &ffb.header, fdb->file_blocks[i]);
+        prev = entry;
     }
-    entries -= FILES_IN_FIRST_DB;
+}
 
-    for(; h->next_block != first_block; entries -= FILES_IN_DB) {
-        res = DiskDriver_readBlock(disk, &db, h->next_block);
-        ONERROR(res == -1, "read failed");
-        h = &db.header;
-        for(int j = 0; j < FILES_IN_DB && j < entries; j++) {
-            res = DiskDriver_readBlock(disk, &ffb, db.file_blocks[j]);
-            ONERROR(res == -1, "read failed");
-            if(ffb.fcb.is_dir) {
-                SimpleFS_removecontents(disk, (FirstDirectoryBlock *)&ffb);
-            }
-            SimpleFS_removeblocks(disk, &ffb.header, db.file_blocks[j]);
+// Free up to max_blocks blocks (all of them if max_blocks is -1) of the files
+// and directories in the free queue. The queue is linked through the
+// directory_block of their control blocks, and it's stored on the disk, so
+// the blocks left are freed after the disk is opened again.
+// The children of a directory are moved to the queue one at a time, and the
+// directory is freed once it's empty. The files still open are skipped,
+// they're freed by their last close (see SimpleFS_freeUnlinked).
+// The blocks freed are counted one by one, as other threads may be
+// allocating and freeing blocks of their files in the meantime
+int SimpleFS_reclaim(SimpleFS *fs, int max_blocks) {
+    DiskDriver *disk = fs->disk;
+    int freed = 0;
+
+    pthread_mutex_lock(&fs->lock);
+    int prev = -1;
+    int block = disk->header->free_queue;
+    while(block != -1 && (max_blocks == -1 || freed < max_blocks)) {
+        if(SimpleFS_findOpenFile(fs, block)) {
+            prev = block;
+            block = SimpleFS_queueNext(disk, block);
+            continue;
+        }
+
+        FirstDirectoryBlock *fdb = (FirstDirectoryBlock *) DiskDriver_mapBlock(disk, block);
+        ONERROR(!fdb, "map failed");
+
+        if(fdb->fcb.is_dir && fdb->num_entries > 0) {
+            int size_in_blocks = fdb->fcb.size_in_blocks;
+            DirectoryEntry child = SimpleFS_popEntry(disk, fdb);
+            freed += size_in_blocks - fdb->fcb.size_in_blocks;
+            FirstFileBlock *ffb = (FirstFileBlock *) DiskDriver_mapBlock(disk, child.block);
+            ONERROR(!ffb, "map failed");
+            ffb->fcb.directory_block = block;
+            DiskDriver_unmapBlock(disk, child.block);
+            SimpleFS_queueLink(disk, prev, child.block);
+            DiskDriver_unmapBlock(disk, block);
+            block = child.block;
+        } else if(!fdb->fcb.is_dir && fdb->fcb.size_in_blocks > 1) {
+            freed += SimpleFS_freeTail(disk, (FirstFileBlock *) fdb, max_blocks == -1 ? INT_MAX : max_blocks - freed);
+            DiskDriver_unmapBlock(disk, block);
+        } else {
+            int next = fdb->fcb.directory_block;
+            SimpleFS_queueLink(disk, prev, next);
+            freed += SimpleFS_freeFirst(disk, (FirstFileBlock *) fdb);
+            DiskDriver_unmapBlock(disk, block);
+            block = next;
         }
     }
+    pthread_mutex_unlock(&fs->lock);
 
-    return 0;
+    return freed;
 }
 
-int SimpleFS_remove(DirectoryHandle *d, char *filename) {
-    int res;
-    FileIterator *it = FileIterator_new(d);
-    FirstFileBlock *ffb;
-    while((ffb = FileIterator_next(it))) {
-        if(!strcmp(ffb->fcb.name, filename)) {
+// Free the queue in the background until the reclaimer is stopped, see SimpleFS_startReclaimer.
+// Waiting on the condition releases lock, which is held only once here
+static void *SimpleFS_reclaimer(void *arg) {
+    SimpleFS *fs = (SimpleFS *) arg;
+    pthread_mutex_lock(&fs->lock);
+    while(fs->reclaimer_running) {
+        // Nothing is freed when only the files still open are left in the queue
+        if(fs->disk->header->free_queue == -1 || SimpleFS_reclaim(fs, SIMPLEFS_RECLAIM_BATCH) == 0) {
+            pthread_cond_wait(&fs->reclaim_cond, &fs->lock);
+            continue;
+        }
+        // Let the other threads in between the batches
+        pthread_mutex_unlock(&fs->lock);
+        pthread_mutex_lock(&fs->lock);
+    }
+    pthread_mutex_unlock(&fs->lock);
+    return NULL;
+}
 
-            if(ffb->fcb.is_dir) {
-                SimpleFS_removecontents(d->sfs->disk, (FirstDirectoryBlock *) ffb);
-            }
+void SimpleFS_startReclaimer(SimpleFS *fs) {
+    pthread_mutex_lock(&fs->lock);
+    if(!fs->reclaimer_running) {
+        fs->reclaimer_running = 1;
+        int res = pthread_create(&fs->reclaimer, NULL, SimpleFS_reclaimer, fs);
+        ONERROR(res != 0, "pthread_create failed");
+    }
+    pthread_mutex_unlock(&fs->lock);
+}
 
-            SimpleFS_removeblocks(d->sfs->disk, &ffb->header, ffb->fcb.block_in_disk);
+void SimpleFS_stopReclaimer(SimpleFS *fs) {
+    pthread_mutex_lock(&fs->lock);
+    int running = fs->reclaimer_running;
+    fs->reclaimer_running = 0;
+    pthread_cond_signal(&fs->reclaim_cond);
+    pthread_mutex_unlock(&fs->lock);
+    if(running) pthread_join(fs->reclaimer, NULL);
+}
 
-            // Replace this file in the directory with the last one
-            int last_idx = -1, idx = -1;
-            FileIterator *it2 = FileIterator_new(d);
-            while((idx = FileIterator_nextidx(it2)) != -1) last_idx = idx;
-            FileIterator_close(it2);
+// Returns the number of blocks in the index of a file below node
+static int SimpleFS_indexCountNode(DiskDriver *disk, int node, int depth) {
+    int count = 1;
+    if(depth > 1) {
+        int *entries = (int *) DiskDriver_mapBlock(disk, node);
+        ONERROR(!entries, "map failed");
+        for(int i = 0; i < INDEX_ENTRIES(disk); i++) {
+            if(entries[i] > 0) count += SimpleFS_indexCountNode(disk, entries[i], depth - 1);
+        }
+        DiskDriver_unmapBlock(disk, node);
+    }
+    return count;
+}
 
-            if(last_idx != ffb->fcb.block_in_disk) {
-                FileIterator_update(it, last_idx);
-            }
-            FileIterator_close(it);
+// Returns the number of blocks in the block index of a file, or in the hash
+// index of a directory (the ones freed by SimpleFS_freeIndex)
+static int SimpleFS_indexCount(DiskDriver *disk, FileControlBlock *fcb) {
+    if(fcb->index_block == -1) return 0;
+    if(!fcb->is_dir) return SimpleFS_indexCountNode(disk, fcb->index_block, fcb->index_depth);
+
+    int count = 1;
+    DirectoryHashIndex *root = (DirectoryHashIndex *) DiskDriver_mapBlock(disk, fcb->index_block);
+    ONERROR(!root, "map failed");
+    for(int i = 0; i < root->num_buckets; i++) {
+        for(int bucket_block = root->buckets[i]; bucket_block != 0; count++) {
+            DirectoryHashBucket *bucket = (DirectoryHashBucket *) DiskDriver_mapBlock(disk, bucket_block);
+            ONERROR(!bucket, "map failed");
+            int next_bucket = bucket->next_bucket;
+            DiskDriver_unmapBlock(disk, bucket_block);
+            bucket_block = next_bucket;
+        }
+    }
+    DiskDriver_unmapBlock(disk, fcb->index_block);
+    return count;
+}
 
-            // Shorten the directory by one element. If the element is the only entry in the last DirectoryBlock, free the block
-            if(d->dcb->num_entries > FILES_IN_FIRST_DB) {
-                int relative_pos = (d->dcb->num_entries - 1 - FILES_IN_FIRST_DB) % FILES_IN_DB; // position in the last block
-                DBGPRINT("removing, relative %d", relative_pos);
-                
-                if(relative_pos == 0) {
-                    DirectoryBlock last = {0}, second_to_last = {0};
-                    int last_idx = d->dcb->header.previous_block;
-
-                    res = DiskDriver_readBlock(d->sfs->disk, &last, last_idx);
-                    ONERROR(res == -1, "read failed");
-
-                    if(last.header.previous_block == d->dcb->fcb.block_in_disk) {
-                        d->dcb->header.next_block = d->dcb->fcb.block_in_disk;
-                    } else {
-                        res = DiskDriver_readBlock(d->sfs->disk, &second_to_last, last.header.previous_block);
-                        ONERROR(res == -1, "read failed");
-                        second_to_last.header.next_block = d->dcb->fcb.block_in_disk;
-                        res = DiskDriver_writeBlock(d->sfs->disk, &second_to_last, last.header.previous_block);
-                        ONERROR(res == -1, "write failed");
-                    }
-                    d->dcb->header.previous_block = last.header.previous_block;
-                    res = DiskDriver_freeBlock(d->sfs->disk, last_idx);
-                    ONERROR(res == -1, "free failed");
-                    d->dcb->fcb.size_in_blocks--;
-                }
-            }
-            d->dcb->num_entries--;
-            res = DiskDriver_writeBlock(d->sfs->disk, d->dcb, d->dcb->fcb.block_in_disk);
-            ONERROR(res == -1, "write failed");
+// Returns the number of blocks of a removed file or directory, the ones below it included
+static int SimpleFS_queuedCount(SimpleFS *fs, int block) {
+    DiskDriver *disk = fs->disk;
+    FirstDirectoryBlock *fdb = (FirstDirectoryBlock *) DiskDriver_mapBlock(disk, block);
+    ONERROR(!fdb, "map failed");
+    int count = fdb->fcb.size_in_blocks + SimpleFS_indexCount(disk, &fdb->fcb);
+    if(fdb->fcb.is_dir) {
+        DirectoryHandle dir = { .sfs = fs, .dcb = fdb };
+        FileIterator *it = FileIterator_new(&dir);
+        int child;
+        while((child = FileIterator_nextidx(it)) != -1) {
+            count += SimpleFS_queuedCount(fs, child);
+        }
+        FileIterator_close(it);
+    }
+    DiskDriver_unmapBlock(disk, block);
+    return count;
+}
 
-            return 0;
+int SimpleFS_queuedBlocks(SimpleFS *fs) {
+    DiskDriver *disk = fs->disk;
+    int count = 0;
+    pthread_mutex_lock(&fs->lock);
+    for(int block = disk->header->free_queue; block != -1; ) {
+        count += SimpleFS_queuedCount(fs, block);
+        FirstFileBlock *ffb = (FirstFileBlock *) DiskDriver_mapBlock(disk, block);
+        ONERROR(!ffb, "map failed");
+        int next = ffb->fcb.directory_block;
+        DiskDriver_unmapBlock(disk, block);
+        block = next;
+    }
+    pthread_mutex_unlock(&fs->lock);
+    return count;
+}
+
+// Returns whether block is the directory dir or one below it, following the
+// parents stored on the disk
+static bool SimpleFS_isBelow(DiskDriver *disk, int block, int dir) {
+    while(block != -1 && block != dir) {
+        FirstDirectoryBlock *fdb = (FirstDirectoryBlock *) DiskDriver_mapBlock(disk, block);
+        ONERROR(!fdb, "map failed");
+        int parent = fdb->fcb.directory_block;
+        DiskDriver_unmapBlock(disk, block);
+        block = parent;
+    }
+    return block == dir;
+}
+
+// Mark the directory handles and the open files below the directory dir as
+// unlinked, before it's put in the free queue. The blocks of the directories
+// can be reclaimed at any time from now on, so they must not be read or written
+// anymore. The open files are left in the queue until their last close
+static void SimpleFS_unlinkBelow(SimpleFS *fs, int dir) {
+    for(DirectoryHandle *h = fs->handles; h; h = h->next) {
+        if(!h->unlinked && SimpleFS_isBelow(fs->disk, h->dcb->fcb.block_in_disk, dir)) {
+            h->unlinked = 1;
         }
     }
-    FileIterator_close(it);
-    return -1;
+    for(OpenFile *file = fs->open_files; file; file = file->next) {
+        if(!file->unlinked && SimpleFS_isBelow(fs->disk, file->ffb->fcb.directory_block, dir)) {
+            __atomic_store_n(&file->unlinked, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static int SimpleFS_removeLocked(DirectoryHandle *d, char *filename) {
+    DiskDriver *disk = d->sfs->disk;
+    unsigned int hash = SimpleFS_hash(filename);
+    FileIterator *it = FileIterator_new(d);
+    FirstFileBlock *ffb = FileIterator_find(it, filename, hash);
+    if(!ffb) {
+        FileIterator_close(it);
+        return -1;
+    }
+    int block = ffb->fcb.block_in_disk;
+
+    if(ffb->fcb.is_dir) {
+        // Freeing all the files below a directory takes a while, so it's
+        // just detached and put in the free queue (see SimpleFS_reclaim)
+        DentryCache_invalidateDir(&d->sfs->dentries, block);
+        SimpleFS_unlinkBelow(d->sfs, block);
+        ffb->fcb.directory_block = disk->header->free_queue;
+        disk->header->free_queue = block;
+        pthread_cond_signal(&d->sfs->reclaim_cond);
+    } else {
+        // Other threads may be using the blocks of an open file, they're
+        // freed by its last handle (see SimpleFS_close). Meanwhile the file
+        // waits in the free queue, so that it's freed if the disk is
+        // opened again without closing it
+        OpenFile *file = SimpleFS_findOpenFile(d->sfs, block);
+        if(file) {
+            __atomic_store_n(&file->unlinked, 1, __ATOMIC_RELAXED);
+            ffb->fcb.directory_block = disk->header->free_queue;
+            disk->header->free_queue = block;
+        } else {
+            SimpleFS_freeTail(disk, ffb, INT_MAX);
+            SimpleFS_freeFirst(disk, ffb);
+        }
+    }
+
+    DentryCache_put(&d->sfs->dentries, d->dcb->fcb.block_in_disk, filename, hash, -1, 0, 0);
+
+    if(d->dcb->fcb.index_block != -1) {
+        DirectoryEntry removed = { block, hash };
+        SimpleFS_hashIndexRemove(disk, &d->dcb->fcb, removed);
+    }
+
+    // Replace this file in the directory with the last entry. If it's the
+    // last one, it may be alone in the tail block that popEntry frees, so
+    // the iterator releases its mapping first
+    int last_pos = d->dcb->num_entries - 1;
+    if(it->pos == last_pos) {
+        FileIterator_close(it);
+        SimpleFS_popEntry(disk, d->dcb);
+    } else {
+        DirectoryEntry last_entry = SimpleFS_popEntry(disk, d->dcb);
+        FileIterator_update(it, last_entry);
+        FileIterator_close(it);
+    }
+
+    // Drop the hash index once the directory is small again. Not as soon as it
+    // fits in the first block, so that it isn't rebuilt over and over
+    if(d->dcb->num_entries <= FILES_IN_FIRST_DB(disk) / 2) {
+        SimpleFS_hashIndexFree(disk, &d->dcb->fcb);
+    }
+    DirectoryHandle_write(d);
+
+    return 0;
+}
+
+int SimpleFS_remove(DirectoryHandle *d, char *filename) {
+    pthread_mutex_lock(&d->sfs->lock);
+    int res = SimpleFS_removeLocked(d, filename);
+    pthread_mutex_unlock(&d->sfs->lock);
+    return res;
 }
 
 
@@ -846,7 +2212,9 @@ void FileControlBlock_print(FileControlBlock *f, int spaces) {
     for(int i = 0; i < spaces; i++) putchar(' ');
     printf("  block_in_disk=%d, is_dir=%d,\n", f->block_in_disk, f->is_dir);
     for(int i = 0; i < spaces; i++) putchar(' ');
-    printf("  size_in_bytes=%d, size_in_blocks=%d\n", f->size_in_bytes, f->size_in_blocks);
+    printf("  size_in_bytes=%d, size_in_blocks=%d,\n", f->size_in_bytes, f->size_in_blocks);
+    for(int i = 0; i < spaces; i++) putchar(' ');
+    printf("  index_block=%d, index_depth=%d\n", f->index_block, f->index_depth);
     for(int i = 0; i < spaces; i++) putchar(' ');
     printf(")");
 }
@@ -884,7 +2252,7 @@ void DirectoryBlock_print(DirectoryBlock *f) {
 void DirectoryHandle_print(DirectoryHandle *h) {
     BlockHeader *bh = &h->dcb->header;
     int start_idx = h->dcb->fcb.block_in_disk;
-    char block[BLOCK_SIZE];
+    char *block = (char *) SimpleFS_newBlock(h->sfs);
     
     FirstDirectoryBlock_print((FirstDirectoryBlock *)bh);
 
@@ -896,12 +2264,13 @@ void DirectoryHandle_print(DirectoryHandle *h) {
         DirectoryBlock_print((DirectoryBlock *)block);
     }
     printf("\n");
+    SimpleFS_freeBlock(h->sfs, block);
 }
 
 void FileHandle_print(FileHandle *h) {
     BlockHeader *bh = &h->fcb->header;
     int start_idx = h->fcb->fcb.block_in_disk;
-    char block[BLOCK_SIZE];
+    char *block = (char *) SimpleFS_newBlock(h->sfs);
 
     FirstFileBlock_print((FirstFileBlock *)bh);
 
@@ -913,4 +2282,5 @@ void FileHandle_print(FileHandle *h) {
         FileBlock_print((FileBlock *)block);
     }
     printf("\n");
+    SimpleFS_freeBlock(h->sfs, block);
 }
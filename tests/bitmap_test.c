@@ -31,5 +31,99 @@ int main(int agc, char** argv) {
 
     free(bmap.entries);
 
+    // Compare with a bit by bit search, on bitmaps whose size isn't a multiple of 8
+    srand(42);
+    for(int num_bits = 1; num_bits < 3000; num_bits += 97) {
+        bmap.num_bits = num_bits;
+        bmap.entries = (char *) calloc((num_bits + 7) / 8, 1);
+        for(int density = 0; density <= 100; density += 25) {
+            for(int i = 0; i < num_bits; i++) BitMap_set(&bmap, i, rand() % 100 < density);
+            for(int start = 0; start < num_bits; start += 13) {
+                for(int status = 0; status <= 1; status++) {
+                    int expected = start;
+                    while(expected < num_bits && BitMap_get(&bmap, expected) != status) expected++;
+                    if(expected == num_bits) expected = -1;
+                    assert(BitMap_find(&bmap, start, status) == expected);
+                }
+            }
+        }
+        free(bmap.entries);
+    }
+
+    // A long run of full bytes before the first free bit
+    bmap.num_bits = 100000;
+    bmap.entries = (char *) calloc((100000 + 63) / 64, 8);
+    assert(BitMap_setRange(&bmap, 0, 100000, 1) == 0);
+    assert(BitMap_find(&bmap, 0, 0) == -1);
+    assert(BitMap_setRange(&bmap, 99997, 1, 0) == 0);
+    assert(BitMap_find(&bmap, 5, 0) == 99997);
+    assert(BitMap_find(&bmap, 99998, 0) == -1);
+    assert(BitMap_setRange(&bmap, 0, 100000, 0) == 0);
+    assert(BitMap_find(&bmap, 0, 1) == -1);
+    assert(BitMap_set(&bmap, 65537, 1) == 0);
+    assert(BitMap_find(&bmap, 3, 1) == 65537);
+
+    // All the words are whole
+    bmap.num_bits = 4096;
+    assert(BitMap_setRange(&bmap, 0, 4096, 1) == 0);
+    assert(BitMap_find(&bmap, 0, 0) == -1);
+    assert(BitMap_setRange(&bmap, 4095, 1, 0) == 0);
+    assert(BitMap_find(&bmap, 0, 0) == 4095);
+    assert(BitMap_setRange(&bmap, 0, 4096, 0) == 0);
+    bmap.num_bits = 100000;
+
+    // setRange and countRange
+    assert(BitMap_setRange(&bmap, 3, 1000, 1) == 0);
+    assert(BitMap_get(&bmap, 2) == 0 && BitMap_get(&bmap, 3) == 1);
+    assert(BitMap_get(&bmap, 1002) == 1 && BitMap_get(&bmap, 1003) == 0);
+    assert(BitMap_countRange(&bmap, 0, 100000, 1) == 1001);
+    assert(BitMap_countRange(&bmap, 0, 100000, 0) == 100000 - 1001);
+    assert(BitMap_countRange(&bmap, 5, 10, 1) == 10);
+    assert(BitMap_countRange(&bmap, 1000, 70, 1) == 3);
+    assert(BitMap_countRange(&bmap, 65537, 1, 1) == 1);
+    assert(BitMap_countRange(&bmap, 7, 0, 1) == 0);
+    assert(BitMap_setRange(&bmap, 10, 5, 0) == 0);
+    assert(BitMap_countRange(&bmap, 0, 100000, 1) == 996);
+    assert(BitMap_setRange(&bmap, 99990, 11, 1) == -1);
+    assert(BitMap_countRange(&bmap, -1, 10, 1) == -1);
+    assert(BitMap_countRange(&bmap, 99990, 11, 1) == -1);
+
+    // findRun
+    int len;
+    assert(BitMap_setRange(&bmap, 0, 100000, 1) == 0);
+    assert(BitMap_setRange(&bmap, 100, 3, 0) == 0);
+    assert(BitMap_setRange(&bmap, 200, 10, 0) == 0);
+    assert(BitMap_setRange(&bmap, 99990, 10, 0) == 0);
+    assert(BitMap_findRun(&bmap, 0, 0, 1, 100, &len) == 100 && len == 3);
+    assert(BitMap_findRun(&bmap, 0, 0, 4, 100, &len) == 200 && len == 10);
+    assert(BitMap_findRun(&bmap, 0, 0, 4, 6, &len) == 200 && len == 6);
+    assert(BitMap_findRun(&bmap, 205, 0, 4, 100, &len) == 205 && len == 5);
+    assert(BitMap_findRun(&bmap, 0, 0, 10, 10, &len) == 200 && len == 10);
+    assert(BitMap_findRun(&bmap, 0, 0, 11, 20, &len) == -1);
+    assert(BitMap_findRun(&bmap, 300, 0, 5, 20, &len) == 99990 && len == 10);
+    assert(BitMap_findRun(&bmap, 0, 1, 50000, 60000, &len) == 210 && len == 60000);
+    assert(BitMap_findRun(&bmap, 0, 0, 0, 10, &len) == -1);
+
+    // testAndSet and claim, the entries are a multiple of 8 bytes
+    assert(BitMap_setRange(&bmap, 0, 100000, 0) == 0);
+    assert(BitMap_testAndSet(&bmap, 70, 1) == 0);
+    assert(BitMap_testAndSet(&bmap, 70, 1) == 1 && BitMap_get(&bmap, 70) == 1);
+    assert(BitMap_testAndSet(&bmap, 70, 0) == 1 && BitMap_get(&bmap, 70) == 0);
+    assert(BitMap_testAndSet(&bmap, 100000, 1) == -1);
+    assert(BitMap_setRange(&bmap, 0, 130, 1) == 0);
+    assert(BitMap_testAndSet(&bmap, 65, 0) == 1);
+    assert(BitMap_claim(&bmap, 0, 100000) == 65);
+    assert(BitMap_claim(&bmap, 0, 100000) == 130);
+    assert(BitMap_claim(&bmap, 10, 131) == -1);
+    assert(BitMap_claim(&bmap, 200, 203) == 200);
+    assert(BitMap_claim(&bmap, 200, 203) == 201);
+    assert(BitMap_claim(&bmap, 200, 203) == 202);
+    assert(BitMap_claim(&bmap, 200, 203) == -1);
+    assert(BitMap_claim(&bmap, 99999, 100000) == 99999);
+    assert(BitMap_claim(&bmap, 99999, 100000) == -1);
+    assert(BitMap_claim(&bmap, 0, 100001) == -1);
+    assert(BitMap_countRange(&bmap, 0, 100000, 1) == 135);
+    free(bmap.entries);
+
     printf("Bitmap tests passed\n");
 }
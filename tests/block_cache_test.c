@@ -0,0 +1,79 @@
+#include "block_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define TEST_BLOCK_SIZE 16
+#define TEST_BLOCKS 32
+
+// Fake disk, the cache writes dirty blocks back here
+static char disk[TEST_BLOCKS][TEST_BLOCK_SIZE];
+static int writebacks[TEST_BLOCKS];
+
+int writeback(void *ctx, int block_num, const void *data) {
+    memcpy(disk[block_num], data, TEST_BLOCK_SIZE);
+    writebacks[block_num]++;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    BlockCache c;
+    char block[TEST_BLOCK_SIZE];
+    BlockCache_init(&c, 4, TEST_BLOCK_SIZE, writeback, NULL);
+
+    assert(BlockCache_get(&c, 0) == NULL);
+    assert(c.misses == 1);
+
+    // Fill the cache, block 0 is dirty
+    for(int i = 0; i < 4; i++) {
+        memset(block, 'a' + i, TEST_BLOCK_SIZE);
+        assert(BlockCache_put(&c, i, block, i == 0) == 0);
+    }
+    assert(BlockCache_get(&c, 2)[0] == 'c');
+    assert(c.hits == 1);
+
+    // Block 0 is the least recently used one, so it's evicted and written back
+    memset(block, 'e', TEST_BLOCK_SIZE);
+    assert(BlockCache_put(&c, 4, block, 0) == 0);
+    assert(BlockCache_get(&c, 0) == NULL);
+    assert(writebacks[0] == 1 && disk[0][0] == 'a');
+
+    // Block 1 is clean, evicting it doesn't write anything
+    assert(BlockCache_put(&c, 5, block, 1) == 0);
+    assert(BlockCache_get(&c, 1) == NULL);
+    assert(writebacks[1] == 0);
+
+    // Invalidated blocks are dropped without being written back
+    BlockCache_invalidate(&c, 5);
+    assert(BlockCache_get(&c, 5) == NULL);
+    assert(writebacks[5] == 0);
+
+    // Evicted blocks are written back only if dirty
+    assert(BlockCache_put(&c, 6, block, 1) == 0);
+    assert(BlockCache_evict(&c, 6) == 0);
+    assert(BlockCache_get(&c, 6) == NULL);
+    assert(writebacks[6] == 1);
+    assert(BlockCache_evict(&c, 6) == 0);
+    assert(writebacks[6] == 1);
+
+    // Overwriting a cached block keeps it dirty until the flush
+    memset(block, 'z', TEST_BLOCK_SIZE);
+    assert(BlockCache_put(&c, 2, block, 1) == 0);
+    assert(BlockCache_put(&c, 2, block, 0) == 0);
+    assert(BlockCache_flush(&c) == 0);
+    assert(writebacks[2] == 1 && disk[2][0] == 'z');
+    assert(BlockCache_flush(&c) == 0);
+    assert(writebacks[2] == 1);
+
+    BlockCache_print(&c);
+    assert(BlockCache_destroy(&c) == 0);
+
+    // A cache with no capacity doesn't store anything
+    BlockCache_init(&c, 0, TEST_BLOCK_SIZE, writeback, NULL);
+    assert(BlockCache_put(&c, 0, block, 1) == -1);
+    assert(BlockCache_get(&c, 0) == NULL);
+    assert(BlockCache_destroy(&c) == 0);
+
+    printf("Block cache tests passed\n");
+}
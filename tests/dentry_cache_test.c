@@ -0,0 +1,73 @@
+#include "dentry_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+int main(int argc, char **argv) {
+    DentryCache c;
+    DentryCacheEntry *e;
+    DentryCache_init(&c, 4);
+
+    assert(DentryCache_get(&c, 0, "a", 1) == NULL);
+    assert(c.misses == 1);
+
+    // The same name in different directories, and a negative entry
+    DentryCache_put(&c, 0, "a", 1, 10, 0, 100);
+    DentryCache_put(&c, 5, "a", 1, 11, 1, 0);
+    DentryCache_put(&c, 0, "b", 2, -1, 0, 0);
+    e = DentryCache_get(&c, 0, "a", 1);
+    assert(e && e->block == 10 && !e->is_dir && e->size_in_bytes == 100);
+    e = DentryCache_get(&c, 5, "a", 1);
+    assert(e && e->block == 11 && e->is_dir);
+    e = DentryCache_get(&c, 0, "b", 2);
+    assert(e && e->block == -1);
+    assert(c.hits == 3);
+
+    // Names with the same hash are told apart
+    DentryCache_put(&c, 0, "c", 1, 12, 0, 0);
+    assert(DentryCache_get(&c, 0, "a", 1)->block == 10);
+    assert(DentryCache_get(&c, 0, "c", 1)->block == 12);
+
+    // Putting an existing entry replaces it
+    DentryCache_put(&c, 0, "b", 2, 13, 0, 7);
+    e = DentryCache_get(&c, 0, "b", 2);
+    assert(e && e->block == 13 && e->size_in_bytes == 7);
+
+    // The cache is full, (5, "a") is the least recently used entry
+    DentryCache_put(&c, 0, "d", 3, 14, 0, 0);
+    assert(DentryCache_get(&c, 5, "a", 1) == NULL);
+    assert(DentryCache_get(&c, 0, "a", 1) != NULL);
+
+    DentryCache_invalidate(&c, 0, "a", 1);
+    assert(DentryCache_get(&c, 0, "a", 1) == NULL);
+    assert(DentryCache_get(&c, 0, "c", 1) != NULL);
+
+    // Dropping a directory leaves the others alone
+    DentryCache_put(&c, 5, "a", 1, 11, 1, 0);
+    DentryCache_invalidateDir(&c, 0);
+    assert(DentryCache_get(&c, 0, "b", 2) == NULL);
+    assert(DentryCache_get(&c, 0, "c", 1) == NULL);
+    assert(DentryCache_get(&c, 0, "d", 3) == NULL);
+    assert(DentryCache_get(&c, 5, "a", 1) != NULL);
+
+    // Names too long to be stored aren't cached
+    char long_name[DENTRY_NAME_LEN + 1];
+    memset(long_name, 'x', DENTRY_NAME_LEN);
+    long_name[DENTRY_NAME_LEN] = '\0';
+    DentryCache_put(&c, 0, long_name, 4, 15, 0, 0);
+    assert(DentryCache_get(&c, 0, long_name, 4) == NULL);
+
+    DentryCache_print(&c);
+    DentryCache_clear(&c);
+    assert(DentryCache_get(&c, 5, "a", 1) == NULL);
+    DentryCache_destroy(&c);
+
+    // A cache with no capacity doesn't store anything
+    DentryCache_init(&c, 0);
+    DentryCache_put(&c, 0, "a", 1, 10, 0, 0);
+    assert(DentryCache_get(&c, 0, "a", 1) == NULL);
+    DentryCache_destroy(&c);
+
+    printf("Dentry cache tests passed\n");
+}
@@ -3,8 +3,31 @@
 #include <string.h>
 #include <assert.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "disk_driver.h"
 
+#define ALLOC_THREADS 4
+#define ALLOCS_PER_THREAD 2000
+
+typedef struct {
+    DiskDriver *disk;
+    int *blocks;
+} AllocArgs;
+
+// Allocate ALLOCS_PER_THREAD blocks, with and without hints
+static void *alloc_worker(void *arg) {
+    AllocArgs *a = (AllocArgs *) arg;
+    for(int i = 0; i < ALLOCS_PER_THREAD; i++) {
+        a->blocks[i] = DiskDriver_allocBlockNear(a->disk, i % 3 == 0 ? i * 7 : DISK_NO_HINT);
+        assert(a->blocks[i] != -1);
+    }
+    return NULL;
+}
+
+// Stands for a disk that can't be written
+static int failing_writeback(void *ctx, int block_num, const void *data) {
+    return -1;
+}
 
 int main(int argc, char **argv) {
     DiskDriver disk;
@@ -32,7 +55,237 @@ int main(int argc, char **argv) {
     assert(DiskDriver_readBlock(&disk, block2, 0) == -1);
     assert(DiskDriver_getFreeBlock(&disk, 0) == 0);
 
+    // Block 1 is cached, reading it again doesn't touch the file
+    long hits = disk.cache.hits;
+    assert(DiskDriver_readBlock(&disk, block2, 1) == 0);
+    assert(disk.cache.hits == hits + 1);
+
+    // The dirty blocks reach the file when the cache is written back,
+    // and the data survives a restart
+    memset(block, 'b', BLOCK_SIZE);
+    assert(DiskDriver_writeBlock(&disk, block, 3) == 0);
     DiskDriver_print(&disk);
+    assert(DiskDriver_close(&disk) == 0);
+
+    DiskDriver_init(&disk, "test_data.fs", 128);
+    assert(DiskDriver_readBlock(&disk, block2, 3) == 0);
+    assert(memcmp(block, block2, BLOCK_SIZE) == 0);
+
+    // Multi-block I/O, blocks 10-13 are contiguous and go in a single run
+    char blocks[6][BLOCK_SIZE], blocks2[6][BLOCK_SIZE];
+    void *bufs[6], *bufs2[6];
+    int block_nums[6] = {10, 11, 12, 13, 20, 3};
+    for(int i = 0; i < 6; i++) {
+        memset(blocks[i], 'd' + i, BLOCK_SIZE);
+        bufs[i] = blocks[i];
+        bufs2[i] = blocks2[i];
+    }
+    int free_blocks = disk.header->free_blocks;
+    assert(DiskDriver_readBlocks(&disk, bufs2, block_nums, 6) == -1);
+    assert(DiskDriver_writeBlocks(&disk, bufs, block_nums, 6) == 0);
+    assert(disk.header->free_blocks == free_blocks - 5);
+    assert(DiskDriver_readBlocks(&disk, bufs2, block_nums, 6) == 0);
+    assert(memcmp(blocks, blocks2, sizeof(blocks)) == 0);
+    assert(DiskDriver_readBlock(&disk, block2, 3) == 0);
+    assert(memcmp(blocks[5], block2, BLOCK_SIZE) == 0);
+
+    // Blocks made of a header and the data after it, from different buffers
+    int headers[6];
+    void *heads[6], *tails[6];
+    for(int i = 0; i < 6; i++) {
+        headers[i] = 1000 + i;
+        heads[i] = &headers[i];
+        tails[i] = blocks[(i + 1) % 6];
+    }
+    free_blocks = disk.header->free_blocks;
+    assert(DiskDriver_writeSplitBlocks(&disk, heads, tails, sizeof(int), block_nums, 6) == 0);
+    assert(disk.header->free_blocks == free_blocks);
+    assert(DiskDriver_readBlocks(&disk, bufs2, block_nums, 6) == 0);
+    for(int i = 0; i < 6; i++) {
+        assert(*(int *) blocks2[i] == 1000 + i);
+        assert(memcmp(blocks2[i] + sizeof(int), blocks[(i + 1) % 6], BLOCK_SIZE - sizeof(int)) == 0);
+    }
+
+    // Asynchronous requests, the buffers are valid only after DiskDriver_complete
+    free_blocks = disk.header->free_blocks;
+    for(int i = 0; i < 6; i++) {
+        memset(blocks[i], 'm' + i, BLOCK_SIZE);
+        assert(DiskDriver_submitWrite(&disk, blocks[i], 40 + 2*i) == 0);
+    }
+    assert(DiskDriver_complete(&disk) == 0);
+    assert(disk.header->free_blocks == free_blocks - 6);
+    for(int i = 0; i < 6; i++) {
+        assert(DiskDriver_submitRead(&disk, blocks2[i], 40 + 2*i) == 0);
+    }
+    assert(DiskDriver_submitRead(&disk, blocks2[0], 41) == -1);
+    assert(DiskDriver_complete(&disk) == 0);
+    assert(memcmp(blocks, blocks2, sizeof(blocks)) == 0);
+
+    // Mapped blocks: a dirty cached copy is written back before mapping,
+    // and changes made through the mapping are seen by readBlock
+    memset(block, 'x', BLOCK_SIZE);
+    assert(DiskDriver_writeBlock(&disk, block, 1) == 0);
+    char *mapped = (char *) DiskDriver_mapBlock(&disk, 1);
+    assert(mapped != NULL);
+    assert(memcmp(mapped, block, BLOCK_SIZE) == 0);
+    mapped[0] = 'y';
+    assert(DiskDriver_readBlock(&disk, block2, 1) == 0);
+    assert(block2[0] == 'y');
+    block[0] = 'z';
+    assert(DiskDriver_writeBlock(&disk, block, 1) == 0);
+    assert(mapped[0] == 'z');
+    DiskDriver_unmapBlock(&disk, 1);
+    assert(DiskDriver_mapBlock(&disk, 30) == NULL);
+
+    free_blocks = disk.header->free_blocks;
+    assert(DiskDriver_allocBlock(&disk, 30) == 0);
+    assert(DiskDriver_allocBlock(&disk, 30) == -1);
+    assert(disk.header->free_blocks == free_blocks - 1);
+    mapped = (char *) DiskDriver_mapBlock(&disk, 30);
+    assert(mapped != NULL);
+    memset(mapped, 'w', BLOCK_SIZE);
+    DiskDriver_unmapBlock(&disk, 30);
+    assert(DiskDriver_readBlock(&disk, block2, 30) == 0);
+    assert(block2[BLOCK_SIZE-1] == 'w');
+
+    // Prefetching is only a hint, the blocks out of the disk are skipped
+    int ahead[] = { 30, 31, 32, 1, -1, disk.header->num_blocks, 2 };
+    DiskDriver_prefetchBlocks(&disk, ahead, 7);
+    assert(disk.blocks_prefetched == 7);
+    assert(DiskDriver_readBlock(&disk, block2, 30) == 0);
+    assert(block2[0] == 'w');
+
+    // A resize that can't write back the dirty blocks keeps the old cache
+    memset(block, 'r', BLOCK_SIZE);
+    assert(DiskDriver_writeBlock(&disk, block, 3) == 0);
+    int capacity = disk.cache.capacity;
+    BlockCache_writebackFn writeback = disk.cache.writeback;
+    disk.cache.writeback = failing_writeback;
+    assert(DiskDriver_setCacheCapacity(&disk, 0) == -1);
+    assert(disk.cache.capacity == capacity);
+    disk.cache.writeback = writeback;
+    assert(DiskDriver_readBlock(&disk, block2, 3) == 0 && block2[0] == 'r');
+
+    // Without a cache every write goes to the file
+    assert(DiskDriver_setCacheCapacity(&disk, 0) == 0);
+    // The block written back by the resize is in the file
+    assert(DiskDriver_readBlock(&disk, block2, 3) == 0 && block2[0] == 'r');
+    memset(block, 'c', BLOCK_SIZE);
+    assert(DiskDriver_writeBlock(&disk, block, 3) == 0);
+    assert(DiskDriver_readBlock(&disk, block2, 3) == 0);
+    assert(memcmp(block, block2, BLOCK_SIZE) == 0);
+    assert(disk.cache.hits == 0);
+    assert(DiskDriver_close(&disk) == 0);
+
+    unlink("test_data.fs");
+
+    // Full groups are skipped by getFreeBlock, and the summary is rebuilt when reopening
+    DiskDriver_initWithBlockSize(&disk, "test_data.fs", 3 * DISK_GROUP_BLOCKS + 100, 512);
+    assert(disk.num_groups == 4);
+    assert(disk.group_free[3] == 100);
+    for(int i = 0; i < 2 * DISK_GROUP_BLOCKS; i++) {
+        assert(DiskDriver_allocBlock(&disk, i) == 0);
+    }
+    assert(disk.group_free[0] == 0 && disk.group_free[1] == 0);
+    assert(DiskDriver_getFreeBlock(&disk, 0) == 2 * DISK_GROUP_BLOCKS);
+    assert(DiskDriver_getFreeBlock(&disk, 3 * DISK_GROUP_BLOCKS + 99) == 3 * DISK_GROUP_BLOCKS + 99);
+    assert(DiskDriver_freeBlock(&disk, DISK_GROUP_BLOCKS + 5) == 0);
+    assert(disk.group_free[1] == 1);
+    assert(DiskDriver_getFreeBlock(&disk, 0) == DISK_GROUP_BLOCKS + 5);
+    assert(DiskDriver_getFreeBlock(&disk, DISK_GROUP_BLOCKS + 6) == 2 * DISK_GROUP_BLOCKS);
+    memset(block, 'g', BLOCK_SIZE);
+    assert(DiskDriver_writeBlock(&disk, block, 2 * DISK_GROUP_BLOCKS) == 0);
+    assert(disk.group_free[2] == DISK_GROUP_BLOCKS - 1);
+    assert(DiskDriver_close(&disk) == 0);
+
+    DiskDriver_init(&disk, "test_data.fs", 3 * DISK_GROUP_BLOCKS + 100);
+    assert(disk.group_free[0] == 0 && disk.group_free[1] == 1);
+    assert(disk.group_free[2] == DISK_GROUP_BLOCKS - 1 && disk.group_free[3] == 100);
+    assert(DiskDriver_getFreeBlock(&disk, 0) == DISK_GROUP_BLOCKS + 5);
+    assert(DiskDriver_getFreeBlock(&disk, 3 * DISK_GROUP_BLOCKS + 100) == -1);
+
+    // Extents are allocated from the hint, wrapping around if needed
+    int len;
+    free_blocks = disk.header->free_blocks;
+    assert(DiskDriver_allocExtent(&disk, 2 * DISK_GROUP_BLOCKS + 10, 5, 20, &len) == 2 * DISK_GROUP_BLOCKS + 10);
+    assert(len == 20);
+    assert(disk.header->free_blocks == free_blocks - 20);
+    assert(disk.group_free[2] == DISK_GROUP_BLOCKS - 21);
+    assert(DiskDriver_getFreeBlock(&disk, 2 * DISK_GROUP_BLOCKS + 10) == 2 * DISK_GROUP_BLOCKS + 30);
+    assert(DiskDriver_allocExtent(&disk, 3 * DISK_GROUP_BLOCKS + 90, 20, 20, &len) == 2 * DISK_GROUP_BLOCKS + 30);
+    assert(len == 20);
+    assert(DiskDriver_allocExtent(&disk, 0, 1, 1, &len) == DISK_GROUP_BLOCKS + 5);
+    assert(len == 1);
+    assert(DiskDriver_allocExtent(&disk, 0, 200, 300, &len) == 2 * DISK_GROUP_BLOCKS + 50);
+    assert(len == 300);
+    assert(DiskDriver_allocExtent(&disk, 0, DISK_GROUP_BLOCKS, DISK_GROUP_BLOCKS, &len) == -1);
+
+    // Without a hint the search starts after the last allocated block
+    assert(disk.cursors[0] == 2 * DISK_GROUP_BLOCKS + 350);
+    assert(DiskDriver_getFreeBlockNear(&disk, DISK_NO_HINT) == 2 * DISK_GROUP_BLOCKS + 350);
+    assert(DiskDriver_allocBlock(&disk, 3 * DISK_GROUP_BLOCKS + 99) == 0);
+    assert(disk.cursors[0] == 0);
+    assert(DiskDriver_getFreeBlockNear(&disk, DISK_NO_HINT) == 2 * DISK_GROUP_BLOCKS + 1);
+    assert(DiskDriver_getFreeBlockNear(&disk, 3 * DISK_GROUP_BLOCKS + 99) == 2 * DISK_GROUP_BLOCKS + 1);
+    assert(DiskDriver_getFreeBlockNear(&disk, 2 * DISK_GROUP_BLOCKS + 20) == 2 * DISK_GROUP_BLOCKS + 350);
+    assert(DiskDriver_close(&disk) == 0);
+    unlink("test_data.fs");
+
+    // Blocks allocated by more threads at the same time are all different
+    int num_blocks = 2 * DISK_GROUP_BLOCKS + 10;
+    DiskDriver_init(&disk, "test_data.fs", num_blocks);
+    assert(DiskDriver_allocExtent(&disk, 0, 100, 100, &len) == 0);
+    pthread_t threads[ALLOC_THREADS];
+    AllocArgs args[ALLOC_THREADS];
+    int *allocated = (int *) malloc(ALLOC_THREADS * ALLOCS_PER_THREAD * sizeof(int));
+    for(int i = 0; i < ALLOC_THREADS; i++) {
+        args[i] = (AllocArgs) { &disk, allocated + i * ALLOCS_PER_THREAD };
+        assert(pthread_create(&threads[i], NULL, alloc_worker, &args[i]) == 0);
+    }
+    // Extents are allocated at the same time, with the lock of the driver
+    for(int i = 0; i < 100; i++) {
+        int pos = DiskDriver_allocExtent(&disk, DISK_NO_HINT, 1, 8, &len);
+        assert(pos != -1);
+        for(int j = 0; j < len; j++) assert(DiskDriver_freeBlock(&disk, pos + j) == 0);
+    }
+    for(int i = 0; i < ALLOC_THREADS; i++) pthread_join(threads[i], NULL);
+
+    char *seen = (char *) calloc(num_blocks, 1);
+    for(int i = 0; i < ALLOC_THREADS * ALLOCS_PER_THREAD; i++) {
+        assert(allocated[i] >= 100 && allocated[i] < num_blocks && !seen[allocated[i]]);
+        seen[allocated[i]] = 1;
+    }
+    assert(disk.header->free_blocks == num_blocks - 100 - ALLOC_THREADS * ALLOCS_PER_THREAD);
+    assert(BitMap_countRange(&disk.bitmap, 0, num_blocks, 0) == disk.header->free_blocks);
+    for(int group = 0; group < disk.num_groups; group++) {
+        int first = group * DISK_GROUP_BLOCKS;
+        int count = num_blocks - first < DISK_GROUP_BLOCKS ? num_blocks - first : DISK_GROUP_BLOCKS;
+        assert(disk.group_free[group] == BitMap_countRange(&disk.bitmap, first, count, 0));
+    }
+    // Until the disk is full
+    for(int i = disk.header->free_blocks; i > 0; i--) assert(DiskDriver_allocBlockNear(&disk, DISK_NO_HINT) != -1);
+    assert(DiskDriver_allocBlockNear(&disk, DISK_NO_HINT) == -1);
+    assert(DiskDriver_allocBlockNear(&disk, 17) == -1);
+    free(seen);
+    free(allocated);
+    assert(DiskDriver_close(&disk) == 0);
+    unlink("test_data.fs");
+
+    // The block size is chosen when the disk is created, and kept when it's reopened
+    char *big_block = (char *) malloc(4096), *big_block2 = (char *) malloc(4096);
+    DiskDriver_initWithBlockSize(&disk, "test_data.fs", 64, 4096);
+    assert(disk.block_size == 4096 && disk.header->block_size == 4096);
+    for(int i = 0; i < 4096; i++) big_block[i] = i % 251;
+    assert(DiskDriver_writeBlock(&disk, big_block, 63) == 0);
+    assert(DiskDriver_close(&disk) == 0);
+
+    DiskDriver_init(&disk, "test_data.fs", 64);
+    assert(disk.block_size == 4096);
+    assert(DiskDriver_readBlock(&disk, big_block2, 63) == 0);
+    assert(memcmp(big_block, big_block2, 4096) == 0);
+    assert(DiskDriver_close(&disk) == 0);
+    free(big_block);
+    free(big_block2);
 
     unlink("test_data.fs");
 
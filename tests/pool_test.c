@@ -0,0 +1,71 @@
+#include "pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+int main(int argc, char **argv) {
+    Pool p;
+    Pool_init(&p, 100, 2);
+
+    // New objects come from malloc, zeroed
+    char *a = (char *) Pool_alloc(&p);
+    char *b = (char *) Pool_alloc(&p);
+    char *c = (char *) Pool_alloc(&p);
+    assert(a && b && c && a != b && b != c);
+    for(int i = 0; i < 100; i++) assert(a[i] == 0);
+    assert(p.allocs == 3 && p.mallocs == 3);
+    memset(a, 'a', 100);
+    memset(b, 'b', 100);
+
+    // Only max_free objects are kept
+    Pool_free(&p, a);
+    Pool_free(&p, b);
+    Pool_free(&p, c);
+    Pool_free(&p, NULL);
+    assert(p.frees == 3 && p.num_free == 2);
+
+    // Released objects are reused, zeroed again
+    char *d = (char *) Pool_alloc(&p);
+    char *e = (char *) Pool_alloc(&p);
+    assert((d == a && e == b) || (d == b && e == a));
+    for(int i = 0; i < 100; i++) assert(d[i] == 0 && e[i] == 0);
+    assert(p.allocs == 5 && p.mallocs == 3 && p.num_free == 0);
+
+    // The steady state doesn't call malloc
+    for(int i = 0; i < 1000; i++) {
+        Pool_free(&p, d);
+        d = (char *) Pool_alloc(&p);
+    }
+    assert(p.mallocs == 3);
+    Pool_print(&p);
+
+    // The objects in use outlive the pool
+    Pool_free(&p, d);
+    Pool_destroy(&p);
+    memset(e, 'e', 100);
+    free(e);
+
+    // Objects smaller than a pointer still hold the link of the free list
+    Pool_init(&p, 1, 4);
+    a = (char *) Pool_alloc(&p);
+    b = (char *) Pool_alloc(&p);
+    Pool_free(&p, a);
+    Pool_free(&p, b);
+    assert(Pool_alloc(&p) == b && Pool_alloc(&p) == a);
+    Pool_free(&p, a);
+    Pool_free(&p, b);
+    Pool_destroy(&p);
+
+    // A pool that keeps nothing
+    Pool_init(&p, 100, 0);
+    a = (char *) Pool_alloc(&p);
+    Pool_free(&p, a);
+    assert(p.num_free == 0);
+    a = (char *) Pool_alloc(&p);
+    assert(p.mallocs == 2);
+    Pool_destroy(&p);
+    free(a);
+
+    printf("Pool tests passed\n");
+}
@@ -1,5 +1,7 @@
 #include "simplefs.h"
 #include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,12 +9,144 @@
 
 void readdir(DirectoryHandle *dir) {
     printf("readDir:\n");
-    char *names[100];
-    int num_names = SimpleFS_readDir(names, dir);
-    for(int i = 0; i < num_names; i++) {
-        printf("  %s\n", names[i]);
+    FileInfo info;
+    FileIterator *it = SimpleFS_openDir(dir);
+    while(SimpleFS_nextDir(it, &info)) {
+        printf("  %s\n", info.name);
     }
-    for(int i = 0; i < num_names; i++) free(names[i]);
+    SimpleFS_closeDir(it);
+}
+
+// Write the first block of a file (or directory) in the format of version 2,
+// where directories list their files as bare block numbers after num_entries
+void write_v2(DiskDriver *disk, int block, int parent, const char *name, int is_dir, int *files, int num_files) {
+    char raw[512] = { 0 };
+    FirstDirectoryBlock *b = (FirstDirectoryBlock *) raw;
+    b->header.previous_block = b->header.next_block = block;
+    b->fcb.directory_block = parent;
+    b->fcb.block_in_disk = block;
+    strcpy(b->fcb.name, name);
+    b->fcb.size_in_blocks = 1;
+    b->fcb.is_dir = is_dir;
+    b->fcb.index_block = -1;
+    if(is_dir) {
+        b->num_entries = num_files;
+        memcpy(b->entries, files, num_files * sizeof(int));
+    } else {
+        b->fcb.size_in_bytes = strlen(name);
+        strcpy(((FirstFileBlock *) raw)->data, name);
+    }
+    assert(DiskDriver_allocBlock(disk, block) == 0);
+    assert(DiskDriver_writeBlock(disk, raw, block) == 0);
+}
+
+// A bitmap of 496 bytes: behind the 16 byte header of the disks created before
+// the version was stored the metadata takes a block, behind the current one two
+#define UNVERSIONED_BLOCKS 3968
+
+// The first block of a file (or directory) on those disks, where the control
+// block had no block index
+typedef struct {
+    BlockHeader header;
+    int directory_block;
+    int block_in_disk;
+    char name[MAX_FILENAME_LEN];
+    int size_in_bytes;
+    int size_in_blocks;
+    int is_dir;
+} UnversionedFirstBlock;
+
+// Write a file of size bytes (or a directory, if files isn't NULL) in the
+// blocks from block on of such a disk. Directories list their files after num_entries
+void write_unversioned(int fd, int block, int parent, const char *name, const char *data, int size,
+        int *files, int num_files) {
+    char raw[BLOCK_SIZE] = { 0 };
+    UnversionedFirstBlock *b = (UnversionedFirstBlock *) raw;
+    int in_first = BLOCK_SIZE - sizeof(UnversionedFirstBlock);
+    int in_next = BLOCK_SIZE - sizeof(BlockHeader);
+    int num_blocks = size <= in_first ? 1 : 2 + (size - in_first - 1) / in_next;
+    b->header.previous_block = block + num_blocks - 1;
+    b->header.next_block = num_blocks > 1 ? block + 1 : block;
+    b->directory_block = parent;
+    b->block_in_disk = block;
+    strcpy(b->name, name);
+    b->size_in_bytes = size;
+    b->size_in_blocks = num_blocks;
+    b->is_dir = files != NULL;
+    if(files) {
+        int *entries = (int *) (b + 1);
+        entries[0] = num_files;
+        memcpy(entries + 1, files, num_files * sizeof(int));
+    } else {
+        memcpy(b + 1, data, size < in_first ? size : in_first);
+    }
+    // The data blocks start after the metadata, a single block
+    assert(pwrite(fd, raw, BLOCK_SIZE, (block + 1) * BLOCK_SIZE) == BLOCK_SIZE);
+
+    for(int i = 1; i < num_blocks; i++) {
+        FileBlock *fb = (FileBlock *) raw;
+        bzero(raw, BLOCK_SIZE);
+        fb->header.previous_block = block + i - 1;
+        fb->header.next_block = i + 1 < num_blocks ? block + i + 1 : block;
+        fb->header.block_in_file = i;
+        int offset = in_first + (i - 1) * in_next;
+        memcpy(fb->data, data + offset, size - offset < in_next ? size - offset : in_next);
+        assert(pwrite(fd, raw, BLOCK_SIZE, (block + i + 1) * BLOCK_SIZE) == BLOCK_SIZE);
+    }
+}
+
+// Copy the image of a disk, to open it as it would be found after a crash
+static void copy_disk(const char *from, const char *to) {
+    char buf[BLOCK_SIZE];
+    int in = open(from, O_RDONLY), out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    assert(in != -1 && out != -1);
+    int len;
+    while((len = read(in, buf, sizeof(buf))) > 0) assert(write(out, buf, len) == len);
+    close(in);
+    close(out);
+}
+
+#define THREADS 4
+#define THREAD_FILE_SIZE 40000
+
+typedef struct {
+    DirectoryHandle *dir;
+    int id;    // the file is called t<id>
+    int write; // create and write the file, or read it back
+} ThreadArgs;
+
+// Byte at position pos of the file written by thread id
+static char thread_byte(int id, int pos) {
+    return (char) (id * 31 + pos * 7);
+}
+
+// Create and write the file of the thread, or read it back
+static void *thread_worker(void *arg) {
+    ThreadArgs *a = (ThreadArgs *) arg;
+    char name[16], buf[1000];
+
+    if(a->write) {
+        sprintf(name, "t%d", a->id);
+        FileHandle *fh = SimpleFS_createFile(a->dir, name);
+        assert(fh != NULL);
+        for(int pos = 0; pos < THREAD_FILE_SIZE; pos += sizeof(buf)) {
+            for(int i = 0; i < (int) sizeof(buf); i++) buf[i] = thread_byte(a->id, pos + i);
+            assert(SimpleFS_write(fh, buf, sizeof(buf)) == sizeof(buf));
+        }
+        SimpleFS_close(fh);
+        return NULL;
+    }
+
+    sprintf(name, "/t%d", a->id);
+    FileHandle *fh = SimpleFS_openPath(a->dir, name);
+    assert(fh != NULL);
+    for(int pos = 0; pos < THREAD_FILE_SIZE; pos += sizeof(buf)) {
+        assert(SimpleFS_read(fh, buf, sizeof(buf)) == sizeof(buf));
+        for(int i = 0; i < (int) sizeof(buf); i++) assert(buf[i] == thread_byte(a->id, pos + i));
+    }
+    assert(SimpleFS_seek(fh, 0) == -THREAD_FILE_SIZE);
+    SimpleFS_close(fh);
+    return NULL;
 }
 
 int main(int agc, char** argv) {
@@ -116,9 +250,78 @@ int main(int agc, char** argv) {
         assert(strcmp(name, names[i]) == 0);
         free(names[i]);
     }
+    FileInfo *infos = (FileInfo *) malloc(200 * sizeof(FileInfo));
+    assert(SimpleFS_readDirPlus(infos, dir) == 200);
+    for(int i = 0; i < 200; i++) {
+        char name[60];
+        sprintf(name, "file%d.txt", i);
+        assert(strcmp(name, infos[i].name) == 0);
+        assert(!infos[i].is_dir && infos[i].size_in_bytes == 0 && infos[i].size_in_blocks == 1);
+    }
+    fh = SimpleFS_openFile(dir, "file42.txt");
+    assert(fh->fcb->fcb.block_in_disk == infos[42].block);
+    // An open file has the size seen by its handles, before it's written back
+    assert(SimpleFS_write(fh, "abc", 3) == 3);
+    assert(SimpleFS_readDirPlus(infos, dir) == 200 && infos[42].size_in_bytes == 3);
+    assert(SimpleFS_statPath(dir, "file42.txt", &infos[0]) == 0 && infos[0].size_in_bytes == 3);
+    SimpleFS_close(fh);
+    SimpleFS_changeDir(dir, "..");
+    assert(SimpleFS_readDirPlus(infos, dir) == 3);
+    assert(infos[0].is_dir && strcmp(infos[0].name, "c") == 0);
+    SimpleFS_changeDir(dir, "c");
+    free(infos);
+    // /a/c doesn't fit in its first block, so it has a hash index
+    assert(dir->dcb->fcb.index_block != -1);
+    assert(SimpleFS_createFile(dir, "file123.txt") == NULL);
+    assert(SimpleFS_openFile(dir, "file200.txt") == NULL);
+    for(int i = 0; i < 200; i += 7) {
+        char name[60];
+        sprintf(name, "file%d.txt", i);
+        fh = SimpleFS_openFile(dir, name);
+        assert(fh != NULL && strcmp(fh->fcb->fcb.name, name) == 0);
+        SimpleFS_close(fh);
+    }
     
     printf("OK\n");
 
+    printf("Resolving paths from /a/c... ");
+    fh = SimpleFS_openPath(dir, "/test.txt");
+    assert(fh != NULL && fh->fcb->fcb.size_in_bytes == 4096);
+    SimpleFS_close(fh);
+    char *paths[] = { "file5.txt", "./file5.txt", "../c/file5.txt", "/a/c//file5.txt", "../../a/./c/file5.txt" };
+    for(int i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        fh = SimpleFS_openPath(dir, paths[i]);
+        assert(fh != NULL && strcmp(fh->fcb->fcb.name, "file5.txt") == 0);
+        SimpleFS_close(fh);
+    }
+    assert(SimpleFS_openPath(dir, "/a/c") == NULL);
+    assert(SimpleFS_openPath(dir, "/a/missing/file5.txt") == NULL);
+    assert(SimpleFS_openPath(dir, "/test.txt/file5.txt") == NULL);
+    assert(SimpleFS_openPath(dir, "/../test.txt") == NULL);
+    FileInfo info;
+    assert(SimpleFS_statPath(dir, "/test.txt", &info) == 0);
+    assert(!info.is_dir && info.size_in_bytes == 4096 && info.size_in_blocks == 9);
+    assert(SimpleFS_statPath(dir, "..", &info) == 0);
+    assert(info.is_dir && strcmp(info.name, "a") == 0);
+    assert(SimpleFS_statPath(dir, "/", &info) == 0);
+    assert(info.is_dir && info.block == 0);
+    assert(SimpleFS_statPath(dir, ".", &info) == 0);
+    assert(strcmp(info.name, "c") == 0 && info.block == dir->dcb->fcb.block_in_disk);
+    assert(SimpleFS_statPath(dir, "/a/e/missing", &info) == -1);
+    assert(SimpleFS_mkDir(dir, "x/y") == -1);
+    assert(SimpleFS_mkDir(dir, "..") == -1);
+    assert(SimpleFS_createFile(dir, ".") == NULL);
+    assert(SimpleFS_createFile(dir, "") == NULL);
+    assert(SimpleFS_changeDir(dir, "/a/d") == 0);
+    assert(strcmp(dir->dcb->fcb.name, "d") == 0 && strcmp(dir->directory->fcb.name, "a") == 0);
+    assert(SimpleFS_changeDir(dir, "../c/file5.txt") == -1);
+    assert(strcmp(dir->dcb->fcb.name, "d") == 0);
+    assert(SimpleFS_changeDir(dir, "/") == 0);
+    assert(dir->dcb->fcb.block_in_disk == 0 && dir->directory == NULL);
+    assert(SimpleFS_changeDir(dir, "a/c") == 0);
+    assert(strcmp(dir->dcb->fcb.name, "c") == 0 && strcmp(dir->directory->fcb.name, "a") == 0);
+    printf("OK\n");
+
     printf("Removing /a/c/file0.txt, /a and /test.txt... ");
     int free_blocks = fs.disk->header->free_blocks;
     assert(SimpleFS_remove(dir, "file0.txt") == 0);
@@ -126,8 +329,932 @@ int main(int agc, char** argv) {
     SimpleFS_changeDir(dir, "/");
     assert(SimpleFS_remove(dir, "test.txt") == 0);
     assert(SimpleFS_remove(dir, "a") == 0);
-    assert(fs.disk->header->free_blocks == free_blocks + 214);
+    // The contents of /a are freed later
+    assert(SimpleFS_reclaim(&fs, -1) > 0);
+    // test.txt has 9 blocks, so it has an index block too, and /a/c has a hash index
+    assert(fs.disk->header->free_blocks == free_blocks + 226);
+    printf("OK\n");
+
+    printf("Looking up names through the dentry cache... ");
+    assert(SimpleFS_mkDir(dir, "x") == 0);
+    assert(SimpleFS_openFile(dir, "x") == NULL);
+    assert(SimpleFS_changeDir(dir, "x") == 0);
+    fh = SimpleFS_createFile(dir, "inside.txt");
+    assert(fh != NULL);
+    assert(SimpleFS_write(fh, "data", 4) == 4);
+    SimpleFS_close(fh);
+    assert(SimpleFS_changeDir(dir, "inside.txt") == -1);
+    assert(SimpleFS_openFile(dir, "missing.txt") == NULL);
+    // The negative entry is replaced when the file is created
+    fh = SimpleFS_createFile(dir, "missing.txt");
+    assert(fh != NULL);
+    SimpleFS_close(fh);
+    fh = SimpleFS_openFile(dir, "missing.txt");
+    assert(fh != NULL);
+    SimpleFS_close(fh);
+    assert(SimpleFS_remove(dir, "missing.txt") == 0);
+    assert(SimpleFS_openFile(dir, "missing.txt") == NULL);
+    assert(SimpleFS_changeDir(dir, "..") == 0);
+    assert(SimpleFS_remove(dir, "x") == 0);
+    assert(SimpleFS_changeDir(dir, "x") == -1);
+    // A new directory may get the block of the old one, but not its files
+    assert(SimpleFS_mkDir(dir, "x") == 0);
+    assert(SimpleFS_changeDir(dir, "x") == 0);
+    assert(SimpleFS_openFile(dir, "inside.txt") == NULL);
+    assert(SimpleFS_changeDir(dir, "..") == 0);
+    assert(SimpleFS_remove(dir, "x") == 0);
+    SimpleFS_reclaim(&fs, -1);
+    assert(fs.disk->header->free_blocks == free_blocks + 226);
+    printf("OK\n");
+
+    printf("Removing files in random order from /r... ");
+    assert(SimpleFS_mkDir(dir, "r") == 0);
+    assert(SimpleFS_changeDir(dir, "r") == 0);
+    int first_entries = (512 - sizeof(FirstDirectoryBlock)) / sizeof(DirectoryEntry);
+    int db_entries = (512 - sizeof(DirectoryBlock)) / sizeof(DirectoryEntry);
+    char present[300] = { 0 };
+    int num_present = 0;
+    for(int round = 0; round < 3000; round++) {
+        int i = rand() % 300;
+        sprintf(buf, "r%d", i);
+        if(present[i]) {
+            assert(SimpleFS_remove(dir, buf) == 0);
+            num_present--;
+        } else {
+            fh = SimpleFS_createFile(dir, buf);
+            assert(fh != NULL);
+            SimpleFS_close(fh);
+            num_present++;
+        }
+        present[i] = !present[i];
+
+        // The directory has just enough blocks for its entries
+        int extra = num_present > first_entries ? num_present - first_entries : 0;
+        assert(dir->dcb->num_entries == num_present);
+        assert(dir->dcb->fcb.size_in_blocks == 1 + (extra + db_entries - 1) / db_entries);
+    }
+    // Removing the only entry of the tail block frees it, while the removal
+    // is iterating over it
+    int num_tail = 0;
+    while(num_present + num_tail <= first_entries || (num_present + num_tail - first_entries) % db_entries != 1) {
+        sprintf(buf, "t%d", num_tail++);
+        fh = SimpleFS_createFile(dir, buf);
+        assert(fh != NULL);
+        SimpleFS_close(fh);
+    }
+    int tail_block = dir->dcb->header.previous_block;
+    int size_in_blocks = dir->dcb->fcb.size_in_blocks;
+    int tail_free = fs.disk->header->free_blocks;
+    assert(SimpleFS_remove(dir, buf) == 0);
+    assert(dir->dcb->fcb.size_in_blocks == size_in_blocks - 1);
+    assert(dir->dcb->header.previous_block != tail_block);
+    assert(fs.disk->header->free_blocks == tail_free + 2);
+    assert(fs.disk->pins[tail_block] == 0);
+    while(--num_tail > 0) {
+        sprintf(buf, "t%d", num_tail - 1);
+        assert(SimpleFS_remove(dir, buf) == 0);
+    }
+    assert(dir->dcb->num_entries == num_present);
+    FileIterator *it = SimpleFS_openDir(dir);
+    while(SimpleFS_nextDir(it, &info)) {
+        int i = atoi(info.name + 1);
+        assert(present[i] == 1);
+        present[i] = 2;
+    }
+    SimpleFS_closeDir(it);
+    for(int i = 0; i < 300; i++) {
+        assert(present[i] != 1);
+        sprintf(buf, "r%d", i);
+        fh = SimpleFS_openFile(dir, buf);
+        assert((fh != NULL) == (present[i] == 2));
+        if(fh) SimpleFS_close(fh);
+    }
+    assert(SimpleFS_changeDir(dir, "..") == 0);
+    assert(SimpleFS_remove(dir, "r") == 0);
+    SimpleFS_reclaim(&fs, -1);
+    assert(fs.disk->header->free_blocks == free_blocks + 226);
+    printf("OK\n");
+
+    printf("Writing 100k of data in a single call & reading it back... ");
+    int big_size = 100 * 1024;
+    char *big = (char *) malloc(big_size), *big2 = (char *) malloc(big_size);
+    for(int i = 0; i < big_size; i++) big[i] = rand() % 256;
+    fh = SimpleFS_createFile(dir, "big.bin");
+    assert(fh != NULL);
+    assert(SimpleFS_write(fh, big, 1000) == 1000);
+    assert(SimpleFS_write(fh, big + 1000, big_size - 1000) == big_size - 1000);
+    assert(SimpleFS_seek(fh, 0) == -big_size);
+    assert(SimpleFS_read(fh, big2, big_size) == big_size);
+    assert(memcmp(big, big2, big_size) == 0);
+    assert(fh->fcb->fcb.index_block != -1 && fh->fcb->fcb.index_depth == 2);
+    assert(SimpleFS_close(fh) == 0);
+
+    printf("OK\n");
+    printf("Seeking back and forth in big.bin through its index... ");
+    fh = SimpleFS_openFile(dir, "big.bin");
+    assert(fh != NULL);
+    for(int i = 0; i < 1000; i++) {
+        int pos = rand() % (big_size - 100);
+        int len = rand() % 100;
+        int moved_by = pos - fh->pos_in_file;
+        assert(SimpleFS_seek(fh, pos) == moved_by);
+        assert(SimpleFS_read(fh, big2, len) == len);
+        assert(memcmp(big + pos, big2, len) == 0);
+        memset(big + pos, i, len);
+        assert(SimpleFS_seek(fh, pos) == -len);
+        assert(SimpleFS_write(fh, big + pos, len) == len);
+    }
+    // Block boundaries and the end of the file
+    for(int pos = 0; pos <= big_size; pos += (pos < 2000 ? 1 : 499)) {
+        int len = big_size - pos < 600 ? big_size - pos : 600;
+        assert(SimpleFS_seek(fh, pos) != -1);
+        assert(SimpleFS_read(fh, big2, len) == len);
+        assert(memcmp(big + pos, big2, len) == 0);
+    }
+    assert(SimpleFS_seek(fh, big_size) != -1);
+    assert(SimpleFS_write(fh, big, 5000) == 5000);
+    assert(SimpleFS_seek(fh, big_size - 10) != -1);
+    assert(SimpleFS_read(fh, big2, 5010) == 5010);
+    assert(memcmp(big + big_size - 10, big2, 10) == 0 && memcmp(big, big2 + 10, 5000) == 0);
+    assert(SimpleFS_close(fh) == 0);
+    printf("OK\n");
+
+    printf("Reading big.bin sequentially with readahead... ");
+    fh = SimpleFS_openFile(dir, "big.bin");
+    assert(fh != NULL);
+    long prefetched = disk.blocks_prefetched;
+    for(int pos = 0; pos < big_size; pos += 100) {
+        assert(SimpleFS_read(fh, big2, 100) == 100);
+        assert(memcmp(big + pos, big2, 100) == 0);
+    }
+    // Every block after the first one is prefetched once, in growing windows
+    assert(disk.blocks_prefetched - prefetched == fh->fcb->fcb.size_in_blocks - 1);
+    assert(fh->readahead_window > FILE_READAHEAD_MIN);
+    // Seeking starts over with the smallest window
+    assert(SimpleFS_seek(fh, 50000) != -1);
+    assert(fh->readahead_window == 0);
+    prefetched = disk.blocks_prefetched;
+    assert(SimpleFS_read(fh, big2, 600) == 600);
+    assert(memcmp(big + 50000, big2, 600) == 0);
+    assert(disk.blocks_prefetched - prefetched == FILE_READAHEAD_MIN);
+    fs.readahead_max = 0;
+    assert(SimpleFS_seek(fh, 0) != -1);
+    prefetched = disk.blocks_prefetched;
+    assert(SimpleFS_read(fh, big2, big_size) == big_size);
+    assert(memcmp(big, big2, big_size) == 0);
+    assert(disk.blocks_prefetched == prefetched);
+    fs.readahead_max = FILE_READAHEAD_MAX;
+    assert(SimpleFS_close(fh) == 0);
+
+    assert(SimpleFS_remove(dir, "big.bin") == 0);
+    // All the blocks of big.bin are freed, index blocks included
+    assert(fs.disk->header->free_blocks == free_blocks + 226);
+    free(big);
+    free(big2);
+    printf("OK\n");
+
+    SimpleFS_destroy(&fs);
+    DiskDriver_close(&disk);
+
+    printf("Using 4096 bytes blocks... ");
+    unlink("data.fs");
+    DiskDriver_initWithBlockSize(&disk, "data.fs", 2048, 4096);
+    dir = SimpleFS_init(&fs, &disk);
+    free_blocks = disk.header->free_blocks;
+    big = (char *) malloc(big_size);
+    big2 = (char *) malloc(big_size);
+    for(int i = 0; i < big_size; i++) big[i] = rand() % 256;
+    fh = SimpleFS_createFile(dir, "big.bin");
+    assert(fh != NULL);
+    assert(SimpleFS_write(fh, big, big_size) == big_size);
+    assert(fh->fcb->fcb.size_in_blocks == 26);
+    // A single write allocates all the blocks it needs contiguously
+    FileBlock *fb = (FileBlock *) malloc(4096);
+    int block = fh->fcb->header.next_block;
+    for(int i = 1; i < 26; i++) {
+        assert(block == fh->fcb->header.next_block + i - 1);
+        assert(DiskDriver_readBlock(&disk, fb, block) == 0);
+        assert(fb->header.block_in_file == i);
+        block = fb->header.next_block;
+    }
+    assert(block == fh->fcb->fcb.block_in_disk);
+    free(fb);
+    assert(SimpleFS_seek(fh, 0) == -big_size);
+    assert(SimpleFS_read(fh, big2, big_size) == big_size);
+    assert(memcmp(big, big2, big_size) == 0);
+    assert(SimpleFS_close(fh) == 0);
+    for(int i = 0; i < 1100; i++) {
+        sprintf(buf, "f%d", i);
+        fh = SimpleFS_createFile(dir, buf);
+        assert(fh != NULL);
+        assert(SimpleFS_close(fh) == 0);
+    }
+    assert(dir->dcb->num_entries == 1101);
+    // Stream the directory through a cursor, every file shows up once
+    char seen[1100] = { 0 };
+    it = SimpleFS_openDir(dir);
+    int num_seen = 0;
+    while(SimpleFS_nextDir(it, &info)) {
+        num_seen++;
+        if(!strcmp(info.name, "big.bin")) {
+            assert(info.size_in_bytes == big_size && info.size_in_blocks == 26);
+            continue;
+        }
+        int i = atoi(info.name + 1);
+        assert(info.name[0] == 'f' && !info.is_dir && !seen[i]);
+        seen[i] = 1;
+    }
+    SimpleFS_closeDir(it);
+    assert(num_seen == 1101);
+    // Closing a cursor in the middle of the directory
+    it = SimpleFS_openDir(dir);
+    for(int i = 0; i < 600; i++) assert(SimpleFS_nextDir(it, &info));
+    SimpleFS_closeDir(it);
+    assert(SimpleFS_remove(dir, "big.bin") == 0);
+    for(int i = 0; i < 1100; i++) {
+        sprintf(buf, "f%d", i);
+        assert(SimpleFS_remove(dir, buf) == 0);
+    }
+    assert(disk.header->free_blocks == free_blocks);
+    free(big);
+    free(big2);
+    SimpleFS_destroy(&fs);
+    DiskDriver_close(&disk);
+    printf("OK\n");
+
+    printf("Upgrading a disk from version 2... ");
+    unlink("data.fs");
+    DiskDriver_init(&disk, "data.fs", 256);
+    disk.header->version = 2;
+    disk.header->free_queue = disk.header->num_blocks;
+    // / holds 100 files (too many for its first block) and sub/, which holds 3
+    int root_files[101], sub_files[3];
+    for(int i = 0; i < 100; i++) {
+        sprintf(buf, "old%d", i);
+        root_files[i] = 10 + i;
+        write_v2(&disk, root_files[i], 0, buf, 0, NULL, 0);
+    }
+    for(int i = 0; i < 3; i++) {
+        sprintf(buf, "inner%d", i);
+        sub_files[i] = 120 + i;
+        write_v2(&disk, sub_files[i], 119, buf, 0, NULL, 0);
+    }
+    root_files[100] = 119;
+    write_v2(&disk, 119, 0, "sub", 1, sub_files, 3);
+    // The first block of / has room for 86 entries, the rest go in block 1
+    int in_first = (512 - sizeof(FirstDirectoryBlock)) / sizeof(int);
+    write_v2(&disk, 0, -1, "/", 1, root_files, in_first);
+    FirstDirectoryBlock *root = (FirstDirectoryBlock *) buf;
+    assert(DiskDriver_readBlock(&disk, root, 0) == 0);
+    root->header.next_block = root->header.previous_block = 1;
+    root->fcb.size_in_blocks = 2;
+    root->num_entries = 101;
+    assert(DiskDriver_writeBlock(&disk, root, 0) == 0);
+    DirectoryBlock *db = (DirectoryBlock *) buf2;
+    bzero(db, 512);
+    db->header.next_block = db->header.previous_block = 0;
+    db->header.block_in_file = 1;
+    memcpy(db->entries, root_files + in_first, (101 - in_first) * sizeof(int));
+    assert(DiskDriver_allocBlock(&disk, 1) == 0);
+    assert(DiskDriver_writeBlock(&disk, db, 1) == 0);
+    DiskDriver_close(&disk);
+
+    DiskDriver_init(&disk, "data.fs", 256);
+    dir = SimpleFS_init(&fs, &disk);
+    assert(disk.header->version == DISK_VERSION);
+    assert(dir->dcb->num_entries == 101);
+    assert(dir->dcb->fcb.index_block != -1);
+    for(int i = 0; i < 100; i++) {
+        sprintf(buf, "old%d", i);
+        fh = SimpleFS_openFile(dir, buf);
+        assert(fh != NULL);
+        assert(SimpleFS_read(fh, buf2, strlen(buf)) == (int) strlen(buf));
+        assert(memcmp(buf, buf2, strlen(buf)) == 0);
+        SimpleFS_close(fh);
+    }
+    assert(SimpleFS_changeDir(dir, "sub") == 0);
+    assert(dir->dcb->num_entries == 3);
+    fh = SimpleFS_openFile(dir, "inner2");
+    assert(fh != NULL);
+    SimpleFS_close(fh);
+    assert(SimpleFS_changeDir(dir, "..") == 0);
+    free_blocks = disk.header->free_blocks;
+    assert(SimpleFS_remove(dir, "sub") == 0);
+    assert(SimpleFS_reclaim(&fs, -1) == 4);
+    assert(disk.header->free_blocks == free_blocks + 4);
+    SimpleFS_destroy(&fs);
+    DiskDriver_close(&disk);
+    printf("OK\n");
+
+    printf("Upgrading a disk from before the version was stored... ");
+    unlink("data.fs");
+    int fd = open("data.fs", O_RDWR | O_CREAT, 0666);
+    assert(fd != -1);
+    assert(ftruncate(fd, (UNVERSIONED_BLOCKS + 1) * BLOCK_SIZE) == 0);
+    int old_header[] = { UNVERSIONED_BLOCKS, UNVERSIONED_BLOCKS, UNVERSIONED_BLOCKS / 8, UNVERSIONED_BLOCKS - 8 };
+    assert(pwrite(fd, old_header, sizeof(old_header), 0) == sizeof(old_header));
+    unsigned char used = 0xff; // blocks 0 to 7
+    assert(pwrite(fd, &used, 1, DISK_UNVERSIONED_HEADER_SIZE) == 1);
+    for(int i = 0; i < (int) sizeof(buf2); i++) buf2[i] = 'a' + i % 23;
+    // f fills its 3 blocks, the larger control block pushes it into a 4th one
+    int full_size = BLOCK_SIZE - sizeof(UnversionedFirstBlock) + 2 * (BLOCK_SIZE - sizeof(BlockHeader));
+    int old_root[] = { 1, 4, 6 }, old_sub[] = { 7 };
+    write_unversioned(fd, 0, -1, "/", NULL, 0, old_root, 3);
+    write_unversioned(fd, 1, 0, "f", buf2, full_size, NULL, 0);
+    write_unversioned(fd, 4, 0, "h", buf2, 400, NULL, 0);
+    write_unversioned(fd, 6, 0, "sub", NULL, 0, old_sub, 1);
+    write_unversioned(fd, 7, 6, "g", buf2 + 100, 10, NULL, 0);
+    close(fd);
+
+    DiskDriver_init(&disk, "data.fs", UNVERSIONED_BLOCKS);
+    assert(disk.header->version == 1 && disk.block_size == BLOCK_SIZE);
+    assert(disk.metadata_size == 2 * BLOCK_SIZE);
+    dir = SimpleFS_init(&fs, &disk);
+    assert(disk.header->version == DISK_VERSION);
+    assert(disk.header->free_queue == -1);
+    assert(disk.header->free_blocks == UNVERSIONED_BLOCKS - 9);
+    for(int round = 0; round < 2; round++) {
+        assert(SimpleFS_statPath(dir, "/f", &info) == 0);
+        assert(info.size_in_bytes == full_size + round * 1000 && info.size_in_blocks == 4 + round * 2);
+        fh = SimpleFS_openPath(dir, "/f");
+        assert(fh != NULL);
+        assert(SimpleFS_read(fh, buf, sizeof(buf)) == full_size + round * 1000);
+        assert(memcmp(buf, buf2, full_size) == 0);
+        // Appending after the upgrade, and reading it back once the disk is opened again
+        if(round == 0) assert(SimpleFS_write(fh, buf2, 1000) == 1000);
+        else assert(memcmp(buf + full_size, buf2, 1000) == 0);
+        SimpleFS_close(fh);
+        fh = SimpleFS_openPath(dir, "/h");
+        assert(fh != NULL && SimpleFS_read(fh, buf, sizeof(buf)) == 400 && memcmp(buf, buf2, 400) == 0);
+        SimpleFS_close(fh);
+        fh = SimpleFS_openPath(dir, "/sub/g");
+        assert(fh != NULL && SimpleFS_read(fh, buf, sizeof(buf)) == 10 && memcmp(buf, buf2 + 100, 10) == 0);
+        SimpleFS_close(fh);
+
+        SimpleFS_destroy(&fs);
+        DiskDriver_close(&disk);
+        DiskDriver_init(&disk, "data.fs", UNVERSIONED_BLOCKS);
+        dir = SimpleFS_init(&fs, &disk);
+    }
+    free_blocks = disk.header->free_blocks;
+    assert(SimpleFS_remove(dir, "sub") == 0);
+    assert(SimpleFS_reclaim(&fs, -1) == 2);
+    assert(disk.header->free_blocks == free_blocks + 2);
+    SimpleFS_destroy(&fs);
+    DiskDriver_close(&disk);
+    printf("OK\n");
+
+    printf("Removing a directory tree in the background... ");
+    unlink("data.fs");
+    DiskDriver_init(&disk, "data.fs", 1024);
+    dir = SimpleFS_init(&fs, &disk);
+    free_blocks = disk.header->free_blocks;
+    memset(buf2, 'x', sizeof(buf2));
+    assert(SimpleFS_mkDir(dir, "t") == 0);
+    assert(SimpleFS_changeDir(dir, "t") == 0);
+    for(int i = 0; i < 3; i++) {
+        sprintf(buf, "d%d", i);
+        assert(SimpleFS_mkDir(dir, buf) == 0);
+        assert(SimpleFS_changeDir(dir, buf) == 0);
+        // Enough files for a hash index, some with a block index
+        for(int j = 0; j < 60; j++) {
+            sprintf(buf, "f%d", j);
+            fh = SimpleFS_createFile(dir, buf);
+            assert(fh != NULL);
+            int size = j % 10 == 0 ? 4000 : 600;
+            assert(SimpleFS_write(fh, buf2, size) == size);
+            SimpleFS_close(fh);
+        }
+        assert(SimpleFS_changeDir(dir, "..") == 0);
+    }
+    assert(SimpleFS_changeDir(dir, "..") == 0);
+    // The directory is gone right away, its blocks are freed later
+    int before_remove = disk.header->free_blocks;
+    assert(SimpleFS_remove(dir, "t") == 0);
+    assert(SimpleFS_changeDir(dir, "t") == -1);
+    assert(disk.header->free_blocks == before_remove);
+    assert(disk.header->free_queue != -1);
+    assert(SimpleFS_queuedBlocks(&fs) == free_blocks - before_remove);
+    assert(SimpleFS_reclaim(&fs, 10) >= 10);
+    assert(disk.header->free_blocks >= before_remove + 10);
+    assert(disk.header->free_blocks + SimpleFS_queuedBlocks(&fs) == free_blocks);
+    // The queue is still there when the disk is opened again
+    SimpleFS_destroy(&fs);
+    DiskDriver_close(&disk);
+    DiskDriver_init(&disk, "data.fs", 1024);
+    dir = SimpleFS_init(&fs, &disk);
+    assert(disk.header->free_queue != -1);
+    assert(disk.header->free_blocks + SimpleFS_queuedBlocks(&fs) == free_blocks);
+    SimpleFS_reclaim(&fs, -1);
+    assert(disk.header->free_queue == -1);
+    assert(disk.header->free_blocks == free_blocks);
+    assert(SimpleFS_reclaim(&fs, -1) == 0);
+    assert(SimpleFS_queuedBlocks(&fs) == 0);
+
+    // When the disk is full, the allocations reclaim the queue by themselves
+    assert(SimpleFS_mkDir(dir, "t") == 0);
+    assert(SimpleFS_changeDir(dir, "t") == 0);
+    fh = SimpleFS_createFile(dir, "fill");
+    assert(fh != NULL);
+    for(int i = 0; i < 300000 / (int) sizeof(buf2); i++) {
+        assert(SimpleFS_write(fh, buf2, sizeof(buf2)) == sizeof(buf2));
+    }
+    SimpleFS_close(fh);
+    assert(SimpleFS_changeDir(dir, "..") == 0);
+    assert(SimpleFS_remove(dir, "t") == 0);
+    // Without the blocks of /t/fill there's no room for another one
+    before_remove = disk.header->free_blocks;
+    assert(before_remove * 512 < 300000);
+    fh = SimpleFS_createFile(dir, "fill");
+    assert(fh != NULL);
+    for(int i = 0; i < 300000 / (int) sizeof(buf2); i++) {
+        assert(SimpleFS_write(fh, buf2, sizeof(buf2)) == sizeof(buf2));
+    }
+    SimpleFS_close(fh);
+    // Only the blocks needed were reclaimed
+    assert(disk.header->free_queue != -1 && SimpleFS_queuedBlocks(&fs) > before_remove / 2);
+    SimpleFS_destroy(&fs);
+    DiskDriver_close(&disk);
     printf("OK\n");
 
-    DiskDriver_flush(&disk);
+    printf("Reclaiming removed directories from a background thread... ");
+    unlink("data.fs");
+    DiskDriver_init(&disk, "data.fs", 1024);
+    dir = SimpleFS_init(&fs, &disk);
+    free_blocks = disk.header->free_blocks;
+    SimpleFS_startReclaimer(&fs);
+    SimpleFS_startReclaimer(&fs);
+    for(int round = 0; round < 4; round++) {
+        assert(SimpleFS_mkDir(dir, "t") == 0);
+        assert(SimpleFS_changeDir(dir, "t") == 0);
+        for(int j = 0; j < 40; j++) {
+            sprintf(buf, "f%d", j);
+            fh = SimpleFS_createFile(dir, buf);
+            assert(fh != NULL);
+            assert(SimpleFS_write(fh, buf2, 2000) == 2000);
+            SimpleFS_close(fh);
+        }
+        assert(SimpleFS_changeDir(dir, "..") == 0);
+        assert(SimpleFS_remove(dir, "t") == 0);
+    }
+    for(int i = 0; i < 10000 && SimpleFS_queuedBlocks(&fs) > 0; i++) usleep(1000);
+    assert(SimpleFS_queuedBlocks(&fs) == 0);
+    assert(disk.header->free_blocks == free_blocks);
+    // Once stopped, the queue waits for the next start, even after a restart
+    SimpleFS_stopReclaimer(&fs);
+    assert(SimpleFS_mkDir(dir, "t") == 0);
+    assert(SimpleFS_changeDir(dir, "t") == 0);
+    fh = SimpleFS_createFile(dir, "f");
+    assert(SimpleFS_write(fh, buf2, 2000) == 2000);
+    SimpleFS_close(fh);
+    assert(SimpleFS_changeDir(dir, "..") == 0);
+    assert(SimpleFS_remove(dir, "t") == 0);
+    usleep(10000);
+    assert(SimpleFS_queuedBlocks(&fs) == free_blocks - disk.header->free_blocks);
+    SimpleFS_destroy(&fs);
+    DiskDriver_close(&disk);
+    DiskDriver_init(&disk, "data.fs", 1024);
+    dir = SimpleFS_init(&fs, &disk);
+    assert(SimpleFS_queuedBlocks(&fs) > 0);
+    SimpleFS_startReclaimer(&fs);
+    for(int i = 0; i < 10000 && SimpleFS_queuedBlocks(&fs) > 0; i++) usleep(1000);
+    assert(disk.header->free_blocks == free_blocks);
+    SimpleFS_destroy(&fs);
+    DiskDriver_close(&disk);
+    printf("OK\n");
+
+    printf("Using two disks and several directory handles at once... ");
+    unlink("data.fs");
+    unlink("data2.fs");
+    DiskDriver disk2;
+    SimpleFS fs2;
+    DiskDriver_init(&disk, "data.fs", 256);
+    DiskDriver_init(&disk2, "data2.fs", 256);
+    dir = SimpleFS_init(&fs, &disk);
+    DirectoryHandle *dir2 = SimpleFS_init(&fs2, &disk2);
+    assert(dir != dir2);
+    // The same names on both disks, with different contents
+    for(int i = 0; i < 2; i++) {
+        DirectoryHandle *d = i == 0 ? dir : dir2;
+        assert(SimpleFS_mkDir(d, "sub") == 0);
+        fh = SimpleFS_createFile(d, "f");
+        assert(fh != NULL);
+        assert(SimpleFS_write(fh, i == 0 ? "one" : "two", 3) == 3);
+        SimpleFS_close(fh);
+    }
+    assert(SimpleFS_mkDir(dir2, "only2") == 0);
+    assert(SimpleFS_statPath(dir, "/only2", &info) == -1);
+    fh = SimpleFS_openPath(dir2, "/f");
+    assert(fh != NULL && SimpleFS_read(fh, buf, 3) == 3 && memcmp(buf, "two", 3) == 0);
+    SimpleFS_close(fh);
+    fh = SimpleFS_openPath(dir, "/f");
+    assert(fh != NULL && SimpleFS_read(fh, buf, 3) == 3 && memcmp(buf, "one", 3) == 0);
+    SimpleFS_close(fh);
+
+    // Changes made through a handle show up in the others on the same directory
+    DirectoryHandle *root2 = SimpleFS_openDirectory(dir, "/");
+    DirectoryHandle *sub = SimpleFS_openDirectory(dir, "sub");
+    assert(root2 != NULL && sub != NULL && strcmp(sub->dcb->fcb.name, "sub") == 0);
+    assert(SimpleFS_openDirectory(dir, "f") == NULL);
+    assert(SimpleFS_openDirectory(dir, "missing") == NULL);
+    for(int i = 0; i < 100; i++) {
+        sprintf(buf, "h%d", i);
+        fh = SimpleFS_createFile(i % 2 ? dir : root2, buf);
+        assert(fh != NULL);
+        SimpleFS_close(fh);
+    }
+    assert(dir->dcb->num_entries == 102 && root2->dcb->num_entries == 102);
+    assert(SimpleFS_remove(root2, "h0") == 0);
+    assert(SimpleFS_remove(dir, "h1") == 0);
+    assert(dir->dcb->num_entries == 100 && root2->dcb->num_entries == 100);
+    infos = (FileInfo *) malloc(100 * sizeof(FileInfo));
+    assert(SimpleFS_readDirPlus(infos, root2) == 100);
+    free(infos);
+    assert(SimpleFS_changeDir(root2, "sub") == 0);
+    fh = SimpleFS_createFile(sub, "inner");
+    assert(fh != NULL);
+    SimpleFS_close(fh);
+    assert(root2->dcb->num_entries == 1);
+    SimpleFS_closeDirectory(sub);
+    // Formatting moves the handles to the top level directory
+    SimpleFS_format(&fs);
+    assert(root2->dcb->fcb.block_in_disk == 0 && root2->dcb->num_entries == 0 && root2->directory == NULL);
+    assert(dir->dcb->num_entries == 0);
+    SimpleFS_closeDirectory(root2);
+    SimpleFS_destroy(&fs);
+    DiskDriver_close(&disk);
+    SimpleFS_destroy(&fs2);
+    DiskDriver_close(&disk2);
+    unlink("data2.fs");
+    printf("OK\n");
+
+    printf("Writing and reading files from %d threads... ", THREADS);
+    unlink("data.fs");
+    DiskDriver_init(&disk, "data.fs", 1024);
+    dir = SimpleFS_init(&fs, &disk);
+    free_blocks = disk.header->free_blocks;
+    pthread_t threads[2 * THREADS];
+    ThreadArgs args[2 * THREADS];
+    // Each thread creates and writes its own file, allocating blocks at the same time
+    for(int i = 0; i < THREADS; i++) {
+        args[i] = (ThreadArgs) { dir, i, 1 };
+        assert(pthread_create(&threads[i], NULL, thread_worker, &args[i]) == 0);
+    }
+    for(int i = 0; i < THREADS; i++) pthread_join(threads[i], NULL);
+    assert(dir->dcb->num_entries == THREADS);
+    // Half of the threads read the same file, the others one file each
+    for(int i = 0; i < 2 * THREADS; i++) {
+        args[i] = (ThreadArgs) { dir, i < THREADS ? 0 : i - THREADS, 0 };
+        assert(pthread_create(&threads[i], NULL, thread_worker, &args[i]) == 0);
+    }
+    for(int i = 0; i < 2 * THREADS; i++) pthread_join(threads[i], NULL);
+
+    // The handles on the same file share its first block
+    FileHandle *fh2 = SimpleFS_openFile(dir, "t1");
+    fh = SimpleFS_openFile(dir, "t1");
+    assert(fh != NULL && fh2 != NULL && fh->fcb == fh2->fcb && fh->file->refs == 2);
+    assert(SimpleFS_seek(fh, THREAD_FILE_SIZE) == THREAD_FILE_SIZE);
+    assert(SimpleFS_write(fh, "end", 3) == 3);
+    SimpleFS_close(fh);
+    assert(SimpleFS_seek(fh2, THREAD_FILE_SIZE) == THREAD_FILE_SIZE);
+    assert(SimpleFS_read(fh2, buf, 10) == 3 && memcmp(buf, "end", 3) == 0);
+    SimpleFS_close(fh2);
+    assert(fs.open_files == NULL);
+
+    for(int i = 0; i < THREADS; i++) {
+        sprintf(buf, "t%d", i);
+        assert(SimpleFS_remove(dir, buf) == 0);
+    }
+    assert(disk.header->free_blocks == free_blocks);
+    SimpleFS_destroy(&fs);
+    DiskDriver_close(&disk);
+    printf("OK\n");
+
+    printf("Appending a byte at a time... ");
+    unlink("data.fs");
+    DiskDriver_init(&disk, "data.fs", 256);
+    dir = SimpleFS_init(&fs, &disk);
+    fh = SimpleFS_createFile(dir, "log");
+    assert(fh != NULL);
+    long blocks_written = disk.blocks_written;
+    for(int i = 0; i < 100; i++) {
+        assert(SimpleFS_write(fh, "abcdefghij" + i % 10, 1) == 1);
+    }
+    // The first block is still only in memory
+    assert(disk.blocks_written == blocks_written);
+    FirstFileBlock *on_disk = (FirstFileBlock *) malloc(BLOCK_SIZE);
+    assert(DiskDriver_readBlock(&disk, on_disk, fh->fcb->fcb.block_in_disk) == 0);
+    assert(on_disk->fcb.size_in_bytes == 0);
+    assert(SimpleFS_fsync(fh) == 0);
+    assert(disk.blocks_written == blocks_written + 1);
+    assert(DiskDriver_readBlock(&disk, on_disk, fh->fcb->fcb.block_in_disk) == 0);
+    assert(on_disk->fcb.size_in_bytes == 100);
+    // Nothing to write back
+    assert(SimpleFS_fsync(fh) == 0);
+    assert(disk.blocks_written == blocks_written + 1);
+    // A new block is linked to the first one, which is written back at once
+    while(fh->fcb->fcb.size_in_blocks == 1) {
+        assert(SimpleFS_write(fh, "x", 1) == 1);
+    }
+    assert(disk.blocks_written > blocks_written + 1);
+    blocks_written = disk.blocks_written;
+    assert(SimpleFS_write(fh, "yz", 2) == 2);
+    assert(disk.blocks_written == blocks_written);
+    int size = fh->fcb->fcb.size_in_bytes;
+    SimpleFS_close(fh);
+    assert(disk.blocks_written == blocks_written + 1);
+    SimpleFS_destroy(&fs);
+    DiskDriver_close(&disk);
+
+    DiskDriver_init(&disk, "data.fs", 256);
+    dir = SimpleFS_init(&fs, &disk);
+    fh = SimpleFS_openFile(dir, "log");
+    assert(fh != NULL && fh->fcb->fcb.size_in_bytes == size);
+    assert(SimpleFS_read(fh, buf, 10) == 10 && memcmp(buf, "abcdefghij", 10) == 0);
+    assert(SimpleFS_seek(fh, size - 3) == size - 13);
+    assert(SimpleFS_read(fh, buf, 10) == 3 && memcmp(buf, "xyz", 3) == 0);
+    // Removing a file with changes that weren't written back
+    assert(SimpleFS_write(fh, "!", 1) == 1);
+    assert(SimpleFS_remove(dir, "log") == 0);
+    blocks_written = disk.blocks_written;
+    SimpleFS_close(fh);
+    assert(disk.blocks_written == blocks_written);
+    free(on_disk);
+    SimpleFS_destroy(&fs);
+    DiskDriver_close(&disk);
+    printf("OK\n");
+
+    printf("Reusing blocks, handles and iterators from the pools... ");
+    unlink("data.fs");
+    DiskDriver_init(&disk, "data.fs", 256);
+    dir = SimpleFS_init(&fs, &disk);
+    assert(SimpleFS_mkDir(dir, "sub") == 0);
+    fh = SimpleFS_createFile(dir, "f");
+    assert(fh != NULL && SimpleFS_write(fh, "pool", 4) == 4);
+    SimpleFS_close(fh);
+    // Nothing new is allocated once the objects in use are back in the pools
+    long mallocs[2][5];
+    for(int round = 0; round < 2; round++) {
+        for(int i = 0; i < 10; i++) {
+            DirectoryHandle *sub = SimpleFS_openDirectory(dir, "sub");
+            assert(sub != NULL);
+            fh = SimpleFS_openPath(sub, "../f");
+            fh2 = SimpleFS_openFile(dir, "f");
+            assert(fh != NULL && fh2 != NULL);
+            assert(SimpleFS_read(fh, buf, 10) == 4 && memcmp(buf, "pool", 4) == 0);
+            assert(SimpleFS_statPath(sub, "../f", &info) == 0 && info.size_in_bytes == 4);
+            assert(SimpleFS_openFile(sub, "missing") == NULL);
+            SimpleFS_close(fh);
+            SimpleFS_close(fh2);
+            SimpleFS_closeDirectory(sub);
+        }
+        mallocs[round][0] = fs.block_pool.mallocs;
+        mallocs[round][1] = fs.file_handle_pool.mallocs;
+        mallocs[round][2] = fs.open_file_pool.mallocs;
+        mallocs[round][3] = fs.dir_handle_pool.mallocs;
+        mallocs[round][4] = fs.iterator_pool.mallocs;
+    }
+    assert(memcmp(mallocs[0], mallocs[1], sizeof(mallocs[0])) == 0);
+    assert(fs.file_handle_pool.allocs >= 40 && fs.iterator_pool.allocs > 0);
+    assert(fs.file_handle_pool.allocs == fs.file_handle_pool.frees);
+    assert(fs.open_file_pool.allocs == fs.open_file_pool.frees);
+    SimpleFS_destroy(&fs);
+    DiskDriver_close(&disk);
+    printf("OK\n");
+
+    printf("Seeking both ways along the chain of a file without an index... ");
+    unlink("data.fs");
+    DiskDriver_init(&disk, "data.fs", 256);
+    dir = SimpleFS_init(&fs, &disk);
+    int in_ffb = BLOCK_SIZE - sizeof(FirstFileBlock), in_fb = BLOCK_SIZE - sizeof(FileBlock);
+    int chain_size = in_ffb + (FILE_INDEX_MIN_BLOCKS - 1) * in_fb;
+    char *chain = (char *) malloc(chain_size);
+    for(int i = 0; i < chain_size; i++) chain[i] = rand() % 256;
+    fh = SimpleFS_createFile(dir, "chain");
+    assert(fh != NULL);
+    // One block at a time, so that the blocks aren't contiguous on the disk
+    FileHandle *other = SimpleFS_createFile(dir, "other");
+    for(int pos = 0; pos < chain_size; pos += in_fb) {
+        int len = chain_size - pos < in_fb ? chain_size - pos : in_fb;
+        assert(SimpleFS_write(fh, chain + pos, len) == len);
+        assert(SimpleFS_write(other, chain, in_fb) == in_fb);
+    }
+    SimpleFS_close(other);
+    assert(fh->fcb->fcb.index_block == -1 && fh->fcb->fcb.size_in_blocks == FILE_INDEX_MIN_BLOCKS);
+
+    // The end of the file is reached through the last block
+    assert(SimpleFS_seek(fh, chain_size - 5) == -5);
+    assert(fh->current_block_pos == fh->fcb->header.previous_block);
+    assert(SimpleFS_read(fh, buf, 10) == 5 && memcmp(buf, chain + chain_size - 5, 5) == 0);
+    // Block boundaries stay in the block before, like the reads
+    assert(SimpleFS_seek(fh, in_ffb + 2 * in_fb) != -1);
+    assert(fh->current_block->block_in_file == 2);
+    assert(fh->checkpoints[0].block_in_file == 2 && fh->checkpoints[0].block == fh->current_block_pos);
+    assert(SimpleFS_seek(fh, in_ffb) != -1 && fh->current_block->block_in_file == 0);
+    for(int i = 0; i < 2000; i++) {
+        int pos = rand() % chain_size;
+        int len = rand() % 600;
+        if(pos + len > chain_size) len = chain_size - pos;
+        int moved_by = pos - fh->pos_in_file;
+        assert(SimpleFS_seek(fh, pos) == moved_by);
+        assert(SimpleFS_read(fh, buf, len) == len);
+        assert(memcmp(chain + pos, buf, len) == 0);
+    }
+    for(int i = 0; i < FILE_SEEK_CHECKPOINTS; i++) {
+        int b = fh->checkpoints[i].block_in_file;
+        assert(b > 0 && b < FILE_INDEX_MIN_BLOCKS - 1);
+    }
+    SimpleFS_close(fh);
+    free(chain);
+    SimpleFS_destroy(&fs);
+    DiskDriver_close(&disk);
+    printf("OK\n");
+
+    printf("Appending many blocks in a single write... ");
+    unlink("data.fs");
+    DiskDriver_init(&disk, "data.fs", 256);
+    dir = SimpleFS_init(&fs, &disk);
+    int bulk_size = in_ffb + 40 * in_fb + 123;
+    char *bulk = (char *) malloc(bulk_size), *bulk2 = (char *) malloc(bulk_size);
+    for(int i = 0; i < bulk_size; i++) bulk[i] = rand() % 256;
+    fh = SimpleFS_createFile(dir, "bulk");
+    assert(fh != NULL);
+    free_blocks = disk.header->free_blocks;
+    blocks_written = disk.blocks_written;
+    assert(SimpleFS_write(fh, bulk, bulk_size) == bulk_size);
+    // The 41 new blocks and the first one are written once each
+    assert(fh->fcb->fcb.size_in_blocks == 42 && fh->fcb->fcb.index_block != -1);
+    assert(disk.header->free_blocks == free_blocks - 42);
+    assert(disk.blocks_written == blocks_written + 42);
+    assert(fh->current_block_pos == fh->fcb->header.previous_block);
+    assert(SimpleFS_write(fh, "tail", 4) == 4);
+    SimpleFS_close(fh);
+
+    fh = SimpleFS_openFile(dir, "bulk");
+    assert(SimpleFS_read(fh, bulk2, bulk_size) == bulk_size);
+    assert(memcmp(bulk, bulk2, bulk_size) == 0);
+    assert(SimpleFS_read(fh, buf, 10) == 4 && memcmp(buf, "tail", 4) == 0);
+    // Backwards along the chain, as written
+    for(int pos = bulk_size - 1; pos >= 0; pos -= in_fb / 2) {
+        assert(SimpleFS_seek(fh, pos) != -1);
+        assert(SimpleFS_read(fh, buf, 1) == 1 && buf[0] == bulk[pos]);
+    }
+
+    // Without enough space for all of them no block is taken
+    free_blocks = disk.header->free_blocks;
+    int too_big = (free_blocks + 2) * in_fb;
+    char *huge = (char *) calloc(1, too_big);
+    assert(SimpleFS_seek(fh, bulk_size + 4) != -1);
+    assert(SimpleFS_write(fh, huge, too_big) == -1);
+    assert(disk.header->free_blocks == free_blocks);
+    assert(fh->fcb->fcb.size_in_blocks == 42);
+    free(huge);
+    SimpleFS_close(fh);
+    free(bulk);
+    free(bulk2);
+    SimpleFS_destroy(&fs);
+    DiskDriver_close(&disk);
+    printf("OK\n");
+
+    printf("Removing a file while it's open... ");
+    unlink("data.fs");
+    DiskDriver_init(&disk, "data.fs", 256);
+    dir = SimpleFS_init(&fs, &disk);
+    free_blocks = disk.header->free_blocks;
+    memset(buf2, 'o', sizeof(buf2));
+    fh = SimpleFS_createFile(dir, "open.txt");
+    assert(fh != NULL);
+    assert(SimpleFS_write(fh, buf2, 3000) == 3000);
+    fh2 = SimpleFS_openFile(dir, "open.txt");
+    assert(fh2 != NULL);
+    int open_free = disk.header->free_blocks;
+    assert(SimpleFS_remove(dir, "open.txt") == 0);
+    assert(SimpleFS_openFile(dir, "open.txt") == NULL);
+    // The handles keep working on blocks that are still in use
+    assert(disk.header->free_blocks == open_free);
+    assert(SimpleFS_write(fh, buf2, 1000) == 1000);
+    assert(SimpleFS_read(fh2, buf, 4000) == 4000);
+    assert(memcmp(buf, buf2, 4000) == 0);
+    // The name can be taken by a new file
+    FileHandle *fh3 = SimpleFS_createFile(dir, "open.txt");
+    assert(fh3 != NULL);
+    SimpleFS_close(fh3);
+    // The first block isn't written back, and the last close frees the file
+    assert(SimpleFS_seek(fh, 0) != -1);
+    assert(SimpleFS_write(fh, "x", 1) == 1);
+    blocks_written = disk.blocks_written;
+    SimpleFS_close(fh);
+    assert(disk.header->free_blocks < free_blocks - 1);
+    SimpleFS_close(fh2);
+    assert(disk.blocks_written == blocks_written);
+    assert(disk.header->free_blocks == free_blocks - 1);
+    SimpleFS_destroy(&fs);
+    DiskDriver_close(&disk);
+    printf("OK\n");
+
+    printf("Removing a directory with handles open below it... ");
+    unlink("data.fs");
+    DiskDriver_init(&disk, "data.fs", 256);
+    dir = SimpleFS_init(&fs, &disk);
+    free_blocks = disk.header->free_blocks;
+    assert(SimpleFS_mkDir(dir, "d") == 0);
+    DirectoryHandle *dh = SimpleFS_openDirectory(dir, "d");
+    assert(dh != NULL);
+    assert(SimpleFS_mkDir(dh, "e") == 0);
+    DirectoryHandle *eh = SimpleFS_openDirectory(dh, "e");
+    assert(eh != NULL);
+    fh = SimpleFS_createFile(dh, "f");
+    assert(fh != NULL);
+    assert(SimpleFS_write(fh, "hello", 5) == 5);
+    assert(SimpleFS_remove(dir, "d") == 0);
+    assert(SimpleFS_reclaim(&fs, -1) > 0);
+    // Only the open file is left in the queue, it's skipped until its last close
+    assert(disk.header->free_queue == fh->fcb->fcb.block_in_disk);
+    assert(SimpleFS_reclaim(&fs, -1) == 0);
+    assert(disk.header->free_blocks == free_blocks - 1);
+    // The handles below /d can't see or change it anymore
+    assert(SimpleFS_createFile(dh, "g") == NULL);
+    assert(SimpleFS_mkDir(eh, "g") == -1);
+    assert(SimpleFS_openFile(dh, "f") == NULL);
+    assert(SimpleFS_readDir(NULL, dh) == 0);
+    assert(SimpleFS_changeDir(eh, "..") == -1);
+    assert(SimpleFS_remove(dh, "e") == -1);
+    // The blocks of /d go to new files
+    int fillers = 0;
+    for(;; fillers++) {
+        sprintf(buf, "fill%d", fillers);
+        fh2 = SimpleFS_createFile(dir, buf);
+        if(!fh2) break;
+        assert(SimpleFS_write(fh2, buf, strlen(buf)) == (int) strlen(buf));
+        SimpleFS_close(fh2);
+    }
+    int full = disk.header->free_blocks;
+    blocks_written = disk.blocks_written;
+    SimpleFS_close(fh);
+    assert(disk.blocks_written == blocks_written);
+    assert(disk.header->free_blocks == full + 1);
+    // An absolute path moves a handle out of the removed tree
+    assert(SimpleFS_changeDir(dh, "/") == 0);
+    fh2 = SimpleFS_openFile(dh, "fill0");
+    assert(fh2 != NULL);
+    SimpleFS_close(fh2);
+    SimpleFS_closeDirectory(eh);
+    SimpleFS_destroy(&fs);
+    DiskDriver_close(&disk);
+
+    // The top level directory is intact on the disk
+    DiskDriver_init(&disk, "data.fs", 256);
+    dir = SimpleFS_init(&fs, &disk);
+    for(int i = 0; i < fillers; i++) {
+        sprintf(buf, "fill%d", i);
+        fh2 = SimpleFS_openFile(dir, buf);
+        assert(fh2 != NULL);
+        assert(SimpleFS_read(fh2, buf2, 100) == (int) strlen(buf));
+        assert(memcmp(buf, buf2, strlen(buf)) == 0);
+        SimpleFS_close(fh2);
+        assert(SimpleFS_remove(dir, buf) == 0);
+    }
+    assert(disk.header->free_blocks == free_blocks);
+    SimpleFS_destroy(&fs);
+    DiskDriver_close(&disk);
+    printf("OK\n");
+
+    printf("Opening a disk again with removed files still open... ");
+    unlink("data.fs");
+    DiskDriver_init(&disk, "data.fs", 256);
+    dir = SimpleFS_init(&fs, &disk);
+    free_blocks = disk.header->free_blocks;
+    assert(SimpleFS_mkDir(dir, "d") == 0);
+    dh = SimpleFS_openDirectory(dir, "d");
+    assert(dh != NULL);
+    fh = SimpleFS_createFile(dh, "f");
+    assert(fh != NULL);
+    fh2 = SimpleFS_createFile(dir, "g");
+    assert(fh2 != NULL);
+    assert(SimpleFS_write(fh2, buf2, 1000) == 1000);
+    assert(SimpleFS_remove(dir, "g") == 0);
+    assert(SimpleFS_remove(dir, "d") == 0);
+    SimpleFS_reclaim(&fs, -1);
+    // The blocks added after the removal are in the queue too
+    assert(SimpleFS_write(fh, buf2, 2000) == 2000);
+    assert(SimpleFS_write(fh2, buf2, 2000) == 2000);
+    int queued = SimpleFS_queuedBlocks(&fs);
+    assert(queued == free_blocks - disk.header->free_blocks);
+    // The disk is opened again before the handles are closed
+    assert(DiskDriver_flush(&disk) == 0);
+    copy_disk("data.fs", "crash.fs");
+    SimpleFS_close(fh);
+    SimpleFS_close(fh2);
+    SimpleFS_destroy(&fs);
+    DiskDriver_close(&disk);
+    DiskDriver_init(&disk, "crash.fs", 256);
+    dir = SimpleFS_init(&fs, &disk);
+    assert(SimpleFS_queuedBlocks(&fs) == queued);
+    assert(SimpleFS_reclaim(&fs, -1) == queued);
+    assert(disk.header->free_queue == -1);
+    assert(disk.header->free_blocks == free_blocks);
+    SimpleFS_destroy(&fs);
+    DiskDriver_close(&disk);
+    unlink("crash.fs");
+    printf("OK\n");
 }